@@ -0,0 +1,321 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bulk.h"
+#include "db.h"
+#include "pager.h"
+
+/*
+ * Start loading into table, which must be empty. fill is the percentage
+ * of each node to use, leaving room for later inserts. Returns NULL if
+ * the table already has rows.
+ */
+struct bulk_load *bulk_load_begin(struct table *table, uint32_t fill)
+{
+	struct pager *pager = table->pager;
+	struct bulk_load *load;
+	uint32_t num_cells;
+	bool leaf;
+	void *root;
+
+	root = get_page(pager, table->root_page_num);
+	leaf = get_node_type(root) == NODE_LEAF;
+	num_cells = *leaf_node_num_cells(root);
+	unpin_page(pager, table->root_page_num);
+
+	if (!leaf || num_cells)
+		return NULL;
+
+	if (!fill || fill > 100)
+		fill = BULK_DEFAULT_FILL;
+
+	load = calloc(1, sizeof(*load));
+	if (!load) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	load->table = table;
+	load->leaf_space = LEAF_NODE_SPACE_FOR_CELLS(pager) * fill / 100;
+	load->internal_keys = INTERNAL_NODE_MAX_CELLS(pager) * fill / 100;
+
+	/* so the last node of a level can always borrow a child */
+	if (load->internal_keys < 2)
+		load->internal_keys = 2;
+
+	return load;
+}
+
+static uint32_t bulk_new_internal_node(struct pager *pager)
+{
+	uint32_t page_num = get_unused_page_num(pager);
+	void *node = get_page(pager, page_num);
+
+	initialize_internal_node(node);
+	mark_page_dirty(pager, page_num);
+	unpin_page(pager, page_num);
+
+	return page_num;
+}
+
+static void bulk_set_parent(struct pager *pager, uint32_t page_num,
+		uint32_t parent_page_num)
+{
+	void *node = get_page(pager, page_num);
+
+	*node_parent(node) = parent_page_num;
+	mark_page_dirty(pager, page_num);
+	unpin_page(pager, page_num);
+}
+
+/*
+ * Hand a completed child, holding count rows, to the open node of
+ * level. The previously pending child becomes a cell; when the node is
+ * already full it becomes its right child instead and the node moves
+ * up a level.
+ */
+static void bulk_add_child(struct bulk_load *load, uint32_t level,
+		uint32_t page_num, uint32_t max_key, uint32_t count)
+{
+	struct pager *pager = load->table->pager;
+	struct bulk_level *l = &load->levels[level];
+
+	if (level == load->num_levels) {
+		if (level == BULK_MAX_LEVELS) {
+			fprintf(stderr, "Tree too deep\n");
+			exit(EXIT_FAILURE);
+		}
+
+		l->page_num = bulk_new_internal_node(pager);
+		load->num_levels++;
+	} else {
+		void *node = get_page(pager, l->page_num);
+		uint32_t *num_keys = internal_node_num_keys(node);
+
+		if (*num_keys == load->internal_keys) {
+			uint32_t full_page_num = l->page_num;
+			uint32_t full_count;
+
+			*internal_node_right_child(node) = l->pending_child;
+			*internal_node_count(node, *num_keys) =
+				l->pending_count;
+			full_count = node_row_count(node);
+			mark_page_dirty(pager, full_page_num);
+			unpin_page(pager, full_page_num);
+
+			l->page_num = bulk_new_internal_node(pager);
+			bulk_add_child(load, level + 1, full_page_num,
+					l->pending_key, full_count);
+		} else {
+			internal_node_insert_cell(node, *num_keys,
+					l->pending_child, l->pending_key,
+					l->pending_count);
+			mark_page_dirty(pager, l->page_num);
+			unpin_page(pager, l->page_num);
+		}
+	}
+
+	l->pending_child = page_num;
+	l->pending_key = max_key;
+	l->pending_count = count;
+	bulk_set_parent(pager, page_num, l->page_num);
+}
+
+static void bulk_close_leaf(struct bulk_load *load)
+{
+	struct pager *pager = load->table->pager;
+
+	mark_page_dirty(pager, load->leaf_page_num);
+	unpin_page(pager, load->leaf_page_num);
+	load->leaf = NULL;
+}
+
+/*
+ * Add the next row. Keys have to be strictly increasing; returns false,
+ * leaving the row out, when one isn't.
+ */
+bool bulk_load_add(struct bulk_load *load, struct row *row)
+{
+	struct pager *pager = load->table->pager;
+	uint32_t size;
+	uint32_t num_cells;
+
+	if (load->num_rows && row->id <= load->last_key)
+		return false;
+
+	row_spill_profile(pager, row);
+	size = row_size(row);
+
+	/* a leaf takes at least one row, whatever the fill factor */
+	if (load->leaf && *leaf_node_num_cells(load->leaf) &&
+			load->leaf_used + LEAF_NODE_CELL_BYTES(size) >
+			load->leaf_space) {
+		uint32_t full_page_num = load->leaf_page_num;
+		uint32_t next_page_num = get_unused_page_num(pager);
+		uint32_t full_count = *leaf_node_num_cells(load->leaf);
+
+		*leaf_node_next_leaf(load->leaf) = next_page_num;
+		bulk_close_leaf(load);
+		bulk_add_child(load, 0, full_page_num, load->last_key,
+				full_count);
+
+		load->leaf_page_num = next_page_num;
+		load->leaf = get_page(pager, next_page_num);
+		initialize_leaf_node(load->leaf);
+		load->leaf_used = 0;
+		load->num_leaves++;
+	} else if (!load->leaf) {
+		/* the empty root is the first leaf */
+		load->leaf_page_num = load->table->root_page_num;
+		load->leaf = get_page(pager, load->leaf_page_num);
+		load->num_leaves++;
+	}
+
+	num_cells = *leaf_node_num_cells(load->leaf);
+	serialize_row(row, leaf_node_insert_cell(pager, load->leaf, num_cells,
+				row->id, size));
+	load->leaf_used += LEAF_NODE_CELL_BYTES(size);
+
+	load->num_rows++;
+	load->last_key = row->id;
+
+	return true;
+}
+
+/*
+ * The open node of level may have ended up with its pending child only.
+ * Its left sibling is what level + 1 has pending, borrow that one's
+ * right child so no internal node is left without a key.
+ */
+static void bulk_balance_last(struct bulk_load *load, uint32_t level)
+{
+	struct pager *pager = load->table->pager;
+	struct bulk_level *l = &load->levels[level];
+	struct bulk_level *up = &load->levels[level + 1];
+	uint32_t left_page_num = up->pending_child;
+	uint32_t moved_count;
+	uint32_t *left_keys;
+	uint32_t *num_keys;
+	uint32_t moved;
+	void *left;
+	void *node;
+
+	node = get_page(pager, l->page_num);
+	num_keys = internal_node_num_keys(node);
+	left = get_page(pager, left_page_num);
+	left_keys = internal_node_num_keys(left);
+
+	if (*num_keys || *left_keys < 2) {
+		unpin_page(pager, left_page_num);
+		unpin_page(pager, l->page_num);
+		return;
+	}
+
+	moved = *internal_node_right_child(left);
+	moved_count = *internal_node_count(left, *left_keys);
+	internal_node_insert_cell(node, 0, moved, up->pending_key,
+			moved_count);
+
+	*internal_node_right_child(left) = *internal_node_child(left,
+			*left_keys - 1);
+	*internal_node_count(left, *left_keys) = *internal_node_count(left,
+			*left_keys - 1);
+	up->pending_key = *internal_node_key(left, *left_keys - 1);
+	up->pending_count -= moved_count;
+	internal_node_remove_cell(left, *left_keys - 1);
+
+	mark_page_dirty(pager, left_page_num);
+	mark_page_dirty(pager, l->page_num);
+	unpin_page(pager, left_page_num);
+	unpin_page(pager, l->page_num);
+
+	bulk_set_parent(pager, moved, l->page_num);
+}
+
+/*
+ * Complete the open node of every level, bottom-up, and make the top
+ * one the root.
+ */
+void bulk_load_finish(struct bulk_load *load)
+{
+	struct table *table = load->table;
+	struct pager *pager = table->pager;
+	uint32_t root_page_num;
+	uint32_t count;
+	void *node;
+
+	if (!load->leaf) {
+		free(load);
+		return;
+	}
+
+	root_page_num = load->leaf_page_num;
+	count = *leaf_node_num_cells(load->leaf);
+	bulk_close_leaf(load);
+
+	if (load->num_leaves > 1)
+		bulk_add_child(load, 0, load->leaf_page_num, load->last_key,
+				count);
+
+	for (uint32_t level = 0; level < load->num_levels; level++) {
+		struct bulk_level *l = &load->levels[level];
+
+		if (level + 1 < load->num_levels)
+			bulk_balance_last(load, level);
+
+		node = get_page(pager, l->page_num);
+		*internal_node_right_child(node) = l->pending_child;
+		*internal_node_count(node, *internal_node_num_keys(node)) =
+			l->pending_count;
+		count = node_row_count(node);
+		mark_page_dirty(pager, l->page_num);
+		unpin_page(pager, l->page_num);
+
+		if (level + 1 < load->num_levels)
+			bulk_add_child(load, level + 1, l->page_num,
+					l->pending_key, count);
+		else
+			root_page_num = l->page_num;
+	}
+
+	table_drop_hint(table);
+
+	if (root_page_num != table->root_page_num) {
+		node = get_page(pager, table->root_page_num);
+		set_node_root(node, false);
+		mark_page_dirty(pager, table->root_page_num);
+		unpin_page(pager, table->root_page_num);
+
+		node = get_page(pager, root_page_num);
+		set_node_root(node, true);
+		*node_parent(node) = 0;
+		mark_page_dirty(pager, root_page_num);
+		unpin_page(pager, root_page_num);
+
+		table->root_page_num = root_page_num;
+		pager_set_root(pager, root_page_num);
+	}
+
+	free(load);
+}
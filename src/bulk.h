@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BULK_H__
+#define __BULK_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "db.h"
+
+#define BULK_DEFAULT_FILL	100
+/* enough for 2^32 keys even with two children per node */
+#define BULK_MAX_LEVELS		32
+
+/*
+ * The open node of one internal level. Its last child is held back in
+ * pending until we know whether it becomes a cell or the right child.
+ */
+struct bulk_level {
+	uint32_t page_num;
+	uint32_t pending_child;
+	uint32_t pending_key;
+	uint32_t pending_count;
+};
+
+/*
+ * Builds a tree bottom-up from rows handed over in ascending key order.
+ * Leaves are packed to the fill factor and written one after the other,
+ * internal nodes are completed as soon as their last child is known.
+ */
+struct bulk_load {
+	struct table *table;
+	uint32_t leaf_space;
+	uint32_t internal_keys;
+
+	uint32_t leaf_page_num;
+	void *leaf;
+	uint32_t leaf_used;
+	uint32_t num_leaves;
+
+	uint32_t num_rows;
+	uint32_t last_key;
+
+	struct bulk_level levels[BULK_MAX_LEVELS];
+	uint32_t num_levels;
+};
+
+struct bulk_load *bulk_load_begin(struct table *table, uint32_t fill);
+bool bulk_load_add(struct bulk_load *load, struct row *row);
+void bulk_load_finish(struct bulk_load *load);
+
+#endif /* __BULK_H__ */
@@ -22,9 +22,83 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bulk.h"
 #include "compiler.h"
 #include "cursor.h"
 #include "db.h"
+#include "scan.h"
+
+static enum prepare_result prepare_row(char *args, struct row *row);
+
+/*
+ * .load <filename> [fill]: bulk-load an empty table from a file with one
+ * "id username email [profile]" row per line, sorted by id.
+ */
+static void do_load(char *args, struct table *table)
+{
+	struct bulk_load *load;
+	char *filename;
+	char *fill;
+	char *line = NULL;
+	size_t len = 0;
+	uint32_t line_num = 0;
+	FILE *file;
+
+	filename = strtok(args, " ");
+	fill = strtok(NULL, " ");
+
+	if (!filename) {
+		printf("Syntax error. Could not parse statement.\n");
+		return;
+	}
+
+	file = fopen(filename, "r");
+	if (!file) {
+		printf("Error: Unable to open %s.\n", filename);
+		return;
+	}
+
+	pager_begin(table->pager);
+	table_latch(table, LATCH_EXCLUSIVE);
+
+	load = bulk_load_begin(table, fill ? atoi(fill) : BULK_DEFAULT_FILL);
+	if (!load) {
+		printf("Error: Table not empty.\n");
+		table_unlatch(table);
+		pager_commit(table->pager);
+		fclose(file);
+		return;
+	}
+
+	while (getline(&line, &len, file) > 0) {
+		struct row row;
+
+		line_num++;
+		line[strcspn(line, "\n")] = '\0';
+
+		if (prepare_row(line, &row) != PREPARE_SUCCESS) {
+			printf("Syntax error on line %d.\n", line_num);
+			break;
+		}
+
+		if (!bulk_load_add(load, &row)) {
+			printf("Error: Rows out of order on line %d.\n",
+					line_num);
+			free(row.profile);
+			break;
+		}
+
+		free(row.profile);
+	}
+
+	printf("Loaded %d rows.\n", load->num_rows);
+	bulk_load_finish(load);
+	table_unlatch(table);
+	pager_commit(table->pager);
+
+	free(line);
+	fclose(file);
+}
 
 enum meta_command_result do_meta_command(struct input_buffer *input,
 		struct table *table)
@@ -36,31 +110,46 @@ enum meta_command_result do_meta_command(struct input_buffer *input,
 	} else if (strncmp(input->buffer, ".constants",
 					input->input_length) == 0) {
 		printf("Constants:\n");
-		print_constants();
+		print_constants(table->pager);
 		return META_COMMAND_SUCCESS;
 	} else if (strncmp(input->buffer, ".btree",
 					input->input_length) == 0) {
 		printf("Tree:\n");
-		print_tree(table->pager, 0, 0);
+		pager_begin(table->pager);
+		table_latch(table, LATCH_EXCLUSIVE);
+		print_tree(table->pager, table->root_page_num, 0);
+		table_unlatch(table);
+		pager_commit(table->pager);
+		return META_COMMAND_SUCCESS;
+	} else if (strncmp(input->buffer, ".load ", 6) == 0) {
+		do_load(input->buffer + 6, table);
 		return META_COMMAND_SUCCESS;
 	}
 
         return META_COMMAND_UNRECOGNIZED_COMMAND;
 }
 
-enum prepare_result prepare_insert(struct input_buffer *input,
-		struct statement *statement)
+/*
+ * Parse "id username email [profile]" from args, strtok()-style. The
+ * row owns the copy of the profile.
+ */
+static enum prepare_result prepare_row(char *args, struct row *row)
 {
 	int id;
 
 	char *id_string;
 	char *username;
 	char *email;
+	char *profile;
 
-	strtok(input->buffer, " ");
-	id_string = strtok(NULL, " ");
+	row->profile_len = 0;
+	row->profile_overflow = 0;
+	row->profile = NULL;
+
+	id_string = strtok(args, " ");
 	username = strtok(NULL, " ");
 	email = strtok(NULL, " ");
+	profile = strtok(NULL, " ");
 
 	if (!id_string || !username || !email)
 		return PREPARE_SYNTAX_ERROR;
@@ -73,32 +162,192 @@ enum prepare_result prepare_insert(struct input_buffer *input,
 	if (strlen(email) > COLUMN_EMAIL_SIZE)
 		return PREPARE_STRING_TOO_LONG;
 
+	if (profile && strlen(profile) > COLUMN_PROFILE_SIZE)
+		return PREPARE_STRING_TOO_LONG;
+
+	row->id = id;
+	strcpy(row->username, username);
+	strcpy(row->email, email);
+
+	if (profile) {
+		row->profile = strdup(profile);
+		row->profile_len = strlen(profile);
+	}
+
+	return PREPARE_SUCCESS;
+}
+
+enum prepare_result prepare_insert(struct input_buffer *input,
+		struct statement *statement)
+{
+	strtok(input->buffer, " ");
+
 	statement->type = STATEMENT_INSERT;
-	statement->row.id = id;
-	strcpy(statement->row.username, username);
-	strcpy(statement->row.email, email);
-        
+
+	return prepare_row(NULL, &statement->row);
+}
+
+enum prepare_result prepare_update(struct input_buffer *input,
+		struct statement *statement)
+{
+	strtok(input->buffer, " ");
+
+	statement->type = STATEMENT_UPDATE;
+
+	return prepare_row(NULL, &statement->row);
+}
+
+enum prepare_result prepare_delete(struct input_buffer *input,
+		struct statement *statement)
+{
+	char *id_string;
+
+	strtok(input->buffer, " ");
+	id_string = strtok(NULL, " ");
+
+	if (!id_string)
+		return PREPARE_SYNTAX_ERROR;
+
+	statement->type = STATEMENT_DELETE;
+	statement->row.id = atoi(id_string);
+
 	return PREPARE_SUCCESS;
 }
 
+/*
+ * Parse "unordered", "limit N" and "offset M", in that order and all
+ * optional
+ */
+static enum prepare_result prepare_limit(char *token,
+		struct statement *statement)
+{
+	if (token && strcmp(token, "unordered") == 0) {
+		statement->ordered = false;
+		token = strtok(NULL, " ");
+	}
+
+	if (token && strcmp(token, "limit") == 0) {
+		token = strtok(NULL, " ");
+		if (!token)
+			return PREPARE_SYNTAX_ERROR;
+
+		statement->limit = atoi(token);
+		token = strtok(NULL, " ");
+	}
+
+	if (token && strcmp(token, "offset") == 0) {
+		token = strtok(NULL, " ");
+		if (!token)
+			return PREPARE_SYNTAX_ERROR;
+
+		statement->offset = atoi(token);
+		token = strtok(NULL, " ");
+	}
+
+	return token ? PREPARE_SYNTAX_ERROR : PREPARE_SUCCESS;
+}
+
+/*
+ * select [* | count(*)] [where id = N | where id between A and B]
+ * [unordered] [limit N] [offset M]. Only "*" projects the profile.
+ * Unordered rows come in whatever order the scan's workers read them.
+ */
+enum prepare_result prepare_select(struct input_buffer *input,
+		struct statement *statement)
+{
+	char *token;
+
+	statement->type = STATEMENT_SELECT;
+	statement->all_columns = false;
+	statement->count = false;
+	statement->where = false;
+	statement->ordered = true;
+	statement->limit = UINT32_MAX;
+	statement->offset = 0;
+
+	strtok(input->buffer, " ");
+	token = strtok(NULL, " ");
+
+	if (token && strcmp(token, "*") == 0) {
+		statement->all_columns = true;
+		token = strtok(NULL, " ");
+	} else if (token && strcmp(token, "count(*)") == 0) {
+		statement->count = true;
+		token = strtok(NULL, " ");
+	}
+
+	if (!token || strcmp(token, "where") != 0)
+		return prepare_limit(token, statement);
+
+	token = strtok(NULL, " ");
+	if (!token || strcmp(token, "id") != 0)
+		return PREPARE_SYNTAX_ERROR;
+
+	token = strtok(NULL, " ");
+	if (!token)
+		return PREPARE_SYNTAX_ERROR;
+
+	if (strcmp(token, "=") == 0) {
+		token = strtok(NULL, " ");
+		if (!token)
+			return PREPARE_SYNTAX_ERROR;
+
+		statement->low = atoi(token);
+		statement->high = statement->low;
+	} else if (strcmp(token, "between") == 0) {
+		char *low = strtok(NULL, " ");
+		char *and = strtok(NULL, " ");
+		char *high = strtok(NULL, " ");
+
+		if (!low || !and || !high || strcmp(and, "and") != 0)
+			return PREPARE_SYNTAX_ERROR;
+
+		statement->low = atoi(low);
+		statement->high = atoi(high);
+	} else {
+		return PREPARE_SYNTAX_ERROR;
+	}
+
+	statement->where = true;
+
+	return prepare_limit(strtok(NULL, " "), statement);
+}
+
 enum prepare_result prepare_statement(struct input_buffer *input,
 		struct statement *statement)
 {
+	statement->row.profile = NULL;
+
 	if (strncmp(input->buffer, "insert", 6) == 0) {
 		return prepare_insert(input, statement);
 	}
 
-	if (strncmp(input->buffer, "select", input->input_length) == 0) {
-		statement->type = STATEMENT_SELECT;
-		return PREPARE_SUCCESS;
+	if (strncmp(input->buffer, "update", 6) == 0) {
+		return prepare_update(input, statement);
+	}
+
+	if (strncmp(input->buffer, "delete", 6) == 0) {
+		return prepare_delete(input, statement);
+	}
+
+	if (strncmp(input->buffer, "select ", 7) == 0 ||
+			strncmp(input->buffer, "select", input->input_length) == 0) {
+		return prepare_select(input, statement);
 	}
 
 	return PREPARE_UNRECOGNIZED_STATEMENT;
 }
 
+/*
+ * Inserts share the tree and only latch their leaf, unless the leaf is
+ * full: the split goes back up the tree, so it's retried holding the
+ * tree exclusively. Copy-on-write trees have a single writer.
+ */
 enum execute_result execute_insert(struct statement *statement,
 		struct table *table)
 {
+	enum latch_mode mode = table->pager->cow ?
+		LATCH_EXCLUSIVE : LATCH_SHARED;
 	struct cursor *cursor;
 	struct row *row;
 
@@ -107,54 +356,211 @@ enum execute_result execute_insert(struct statement *statement,
 
         void *node;
 
-        node = get_page(table->pager, table->root_page_num);
-	num_cells = *leaf_node_num_cells(node);
-
 	row = &statement->row;
 	key = row->id;
-        cursor = table_find(table, key);
 
-	if (cursor->cell_num < num_cells) {
-		uint32_t cur = *leaf_node_key(node, cursor->cell_num);
+	while (true) {
+		table_latch(table, mode);
+
+		if (mode == LATCH_SHARED)
+			cursor = table_find_latched(table, key,
+					LATCH_EXCLUSIVE);
+		else
+			cursor = table_find(table, key);
+
+		node = get_page(table->pager, cursor->page_num);
+		num_cells = *leaf_node_num_cells(node);
+
+		if (cursor->cell_num < num_cells) {
+			uint32_t cur = *leaf_node_key(node, cursor->cell_num);
+
+			if (cur == key) {
+				unpin_page(table->pager, cursor->page_num);
+				cursor_close(cursor);
+				table_unlatch(table);
+				return EXECUTE_DUPLICATE_KEY;
+			}
+		}
+
+		unpin_page(table->pager, cursor->page_num);
+
+		if (leaf_node_insert(cursor, row->id, row))
+			break;
+
+		cursor_close(cursor);
+		table_unlatch(table);
+		mode = LATCH_EXCLUSIVE;
+	}
+
+        cursor_close(cursor);
+	table_unlatch(table);
+
+	return EXECUTE_SUCCESS;
+}
+
+/* Counting only takes a descent to each end of the range */
+enum execute_result execute_count(struct statement *statement,
+		struct table *table)
+{
+	uint32_t count;
+
+	table_latch(table, LATCH_SHARED);
+	count = table_row_count(table);
+
+	if (statement->where && statement->low > statement->high) {
+		count = 0;
+	} else if (statement->where) {
+		if (statement->high < UINT32_MAX)
+			count = table_rank(table, statement->high + 1);
 
-		if (cur == key)
-			return EXECUTE_DUPLICATE_KEY;
+		count -= table_rank(table, statement->low);
 	}
 
-	leaf_node_insert(cursor, row->id, row);
-        free(cursor);
+	table_unlatch(table);
+
+	printf("(%d)\n", count);
 
 	return EXECUTE_SUCCESS;
 }
 
+/* Print rows until the limit runs out */
+static bool select_print(struct row *row, void *arg)
+{
+	uint32_t *left = arg;
+
+	print_row(row);
+
+	return --*left;
+}
+
 enum execute_result execute_select(struct statement *statement,
 		struct table *table)
 {
-	struct cursor *cursor;
-	struct row row;
+	uint32_t low = statement->where ? statement->low : 0;
+	uint32_t high = statement->where ? statement->high : UINT32_MAX;
+	uint32_t left = statement->limit;
+
+	if (statement->count)
+		return execute_count(statement, table);
+
+	/*
+	 * A where clause scans from its first key on, an offset skips rows
+	 * by their position in the tree and starts from the key it finds.
+	 */
+	table_latch(table, LATCH_SHARED);
+
+	if (statement->offset) {
+		uint32_t first = table_rank(table, low);
+		struct cursor *cursor;
+
+		if (statement->offset > UINT32_MAX - first)
+			first = UINT32_MAX;
+		else
+			first += statement->offset;
 
-	cursor = table_start(table);
+		cursor = table_seek_rank(table, first);
+		if (cursor->end) {
+			left = 0;
+		} else {
+			void *node = get_page(table->pager, cursor->page_num);
 
-	while (!cursor->end) {
-		deserialize_row(cursor_value(cursor), &row);
-		print_row(&row);
-		cursor_advance(cursor);
+			low = *leaf_node_key(node, cursor->cell_num);
+			unpin_page(table->pager, cursor->page_num);
+		}
+
+		cursor_close(cursor);
 	}
 
-	free(cursor);
+	if (left)
+		table_scan(table, low, high, statement->all_columns,
+				statement->ordered, select_print, &left);
+
+	table_unlatch(table);
 
         return EXECUTE_SUCCESS;
 }
 
+enum execute_result execute_update(struct statement *statement,
+		struct table *table)
+{
+	struct cursor *cursor;
+	bool found;
+	void *node;
+
+	table_latch(table, LATCH_EXCLUSIVE);
+	cursor = table_find(table, statement->row.id);
+
+	node = get_page(table->pager, cursor->page_num);
+	found = cursor->cell_num < *leaf_node_num_cells(node) &&
+		*leaf_node_key(node, cursor->cell_num) == statement->row.id;
+	unpin_page(table->pager, cursor->page_num);
+
+	if (found)
+		leaf_node_update(cursor, &statement->row);
+
+	cursor_close(cursor);
+	table_unlatch(table);
+
+	return found ? EXECUTE_SUCCESS : EXECUTE_NOT_FOUND;
+}
+
+enum execute_result execute_delete(struct statement *statement,
+		struct table *table)
+{
+	struct cursor *cursor;
+	bool found;
+	void *node;
+
+	table_latch(table, LATCH_EXCLUSIVE);
+	cursor = table_find(table, statement->row.id);
+
+	node = get_page(table->pager, cursor->page_num);
+	found = cursor->cell_num < *leaf_node_num_cells(node) &&
+		*leaf_node_key(node, cursor->cell_num) == statement->row.id;
+	unpin_page(table->pager, cursor->page_num);
+
+	if (found)
+		leaf_node_delete(cursor);
+
+	cursor_close(cursor);
+	table_unlatch(table);
+
+	return found ? EXECUTE_SUCCESS : EXECUTE_NOT_FOUND;
+}
+
+/*
+ * Every statement is a transaction of its own, except for selects on
+ * a snapshot: they change nothing and commits shouldn't wait for them.
+ */
 enum execute_result execute_statement(struct statement *statement,
 		struct table *table)
 {
+	enum execute_result result;
+
+	if (statement->type == STATEMENT_SELECT && table->pager->cow)
+		return execute_select(statement, table);
+
+	pager_begin(table->pager);
+
 	switch (statement->type) {
 	case STATEMENT_INSERT:
-		return execute_insert(statement, table);
+		result = execute_insert(statement, table);
+		break;
 	case STATEMENT_SELECT:
-		return execute_select(statement, table);
+		result = execute_select(statement, table);
+		break;
+	case STATEMENT_UPDATE:
+		result = execute_update(statement, table);
+		break;
+	case STATEMENT_DELETE:
+		result = execute_delete(statement, table);
+		break;
 	default:
-		return EXECUTE_UNKNOWN;
+		result = EXECUTE_UNKNOWN;
+		break;
 	}
+
+	pager_commit(table->pager);
+
+	return result;
 }
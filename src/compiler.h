@@ -20,6 +20,7 @@
 #ifndef __COMPILER_H__
 #define __COMPILER_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "buffer.h"
 #include "db.h"
@@ -39,6 +40,7 @@ enum prepare_result {
 enum execute_result {
 	EXECUTE_SUCCESS,
 	EXECUTE_DUPLICATE_KEY,
+	EXECUTE_NOT_FOUND,
 	EXECUTE_TABLE_FULL,
 	EXECUTE_UNKNOWN,
 };
@@ -46,11 +48,24 @@ enum execute_result {
 enum statement_type {
 	STATEMENT_INSERT,
 	STATEMENT_SELECT,
+	STATEMENT_UPDATE,
+	STATEMENT_DELETE,
 };
 
 struct statement {
 	enum statement_type type;
 	struct row row;
+	bool all_columns;
+	bool count;
+
+	/* select only the ids from low to high, both included */
+	bool where;
+	uint32_t low;
+	uint32_t high;
+
+	bool ordered;
+	uint32_t limit;
+	uint32_t offset;
 };
 
 enum meta_command_result do_meta_command(struct input_buffer *input,
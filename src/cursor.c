@@ -27,33 +27,388 @@
 
 #include "cursor.h"
 #include "db.h"
+#include "search.h"
 
 struct cursor *table_start(struct table *table)
+{
+	return table_seek(table, 0);
+}
+
+/*
+ * Move a latched cursor onto the leaf page_num, latching it before the
+ * current one is let go so no split can slip in between. A page_num of
+ * 0 ends the cursor instead.
+ */
+static void cursor_step(struct cursor *cursor, uint32_t page_num)
+{
+	struct pager *pager = cursor->table->pager;
+
+	if (!page_num) {
+		cursor->end = true;
+		return;
+	}
+
+	get_page(pager, page_num);
+	latch_page(pager, page_num, LATCH_SHARED);
+	unlatch_page(pager, cursor->page_num);
+	unpin_page(pager, cursor->page_num);
+
+	cursor->page_num = page_num;
+	cursor->cell_num = 0;
+}
+
+/*
+ * Position a cursor on the first key >= key. table_find() can stop past
+ * the last cell of a leaf, the key is then in the next one if anywhere.
+ */
+struct cursor *table_seek(struct table *table, uint32_t key)
 {
 	struct cursor *cursor;
 	uint32_t num_cells;
+	uint32_t next;
 	void *node;
 
-	cursor = table_find(table, 0);
+	cursor = table_find_latched(table, key, LATCH_SHARED);
 	node = get_page(table->pager, cursor->page_num);
 	num_cells = *leaf_node_num_cells(node);
-	cursor->end = (num_cells == 0);
+	next = *leaf_node_next_leaf(node);
+	unpin_page(table->pager, cursor->page_num);
+
+	if (cursor->cell_num >= num_cells)
+		cursor_step(cursor, next);
 
 	return cursor;
 }
 
+/* Snapshots find the root they started with in the header */
+static uint32_t table_root(struct table *table)
+{
+	if (pager_in_snapshot())
+		return pager_get_root(table->pager);
+
+	return table->root_page_num;
+}
+
+/*
+ * The hinted leaf can only be trusted if it's still a leaf and still
+ * holds key's neighbourhood: splits move the upper part of a leaf out,
+ * so past its last key only the rightmost leaf will do.
+ */
+static bool table_hint_valid(struct table *table, uint32_t page_num,
+		uint32_t key)
+{
+	void *node = get_page(table->pager, page_num);
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	bool valid = false;
+
+	if (get_node_type(node) == NODE_LEAF)
+		valid = !*leaf_node_next_leaf(node) ||
+			(num_cells && key <= *leaf_node_key(node,
+							    num_cells - 1));
+
+	unpin_page(table->pager, page_num);
+
+	return valid;
+}
+
+/*
+ * The hinted leaf of key, pinned and latched in mode, or 0 if there's
+ * none. Hints follow the latest tree, snapshots go without.
+ */
+static uint32_t table_hint_latch(struct table *table, uint32_t key,
+		enum latch_mode mode)
+{
+	uint32_t page_num;
+
+	if (pager_in_snapshot())
+		return 0;
+
+	pthread_mutex_lock(&table->hint_lock);
+	page_num = table->hint_page_num;
+	if (key < table->hint_low || key > table->hint_high)
+		page_num = 0;
+	pthread_mutex_unlock(&table->hint_lock);
+
+	if (!page_num)
+		return 0;
+
+	get_page(table->pager, page_num);
+	latch_page(table->pager, page_num, mode);
+
+	if (table_hint_valid(table, page_num, key))
+		return page_num;
+
+	unlatch_page(table->pager, page_num);
+	unpin_page(table->pager, page_num);
+
+	return 0;
+}
+
+/*
+ * Find the leaf of key and keep it pinned and latched in mode until
+ * cursor_close(). The caller holds the tree latch, shared at least.
+ */
+struct cursor *table_find_latched(struct table *table, uint32_t key,
+		enum latch_mode mode)
+{
+	uint32_t root_page_num = table_root(table);
+	struct cursor *cursor;
+	uint32_t page_num;
+	void *root_node;
+
+	page_num = table_hint_latch(table, key, mode);
+	if (page_num) {
+		cursor = leaf_node_find(table, page_num, key);
+		cursor->latched = true;
+
+		return cursor;
+	}
+
+	root_node = get_page(table->pager, root_page_num);
+	if (get_node_type(root_node) == NODE_INTERNAL) {
+		unpin_page(table->pager, root_page_num);
+
+		return internal_node_find(table, root_page_num, key, mode);
+	}
+
+	latch_page(table->pager, root_page_num, mode);
+	cursor = leaf_node_find(table, root_page_num, key);
+	cursor->latched = true;
+
+	if (pager_in_snapshot())
+		return cursor;
+
+	pthread_mutex_lock(&table->hint_lock);
+	table->hint_page_num = root_page_num;
+	table->hint_low = 0;
+	table->hint_high = UINT32_MAX;
+	pthread_mutex_unlock(&table->hint_lock);
+
+	return cursor;
+}
+
+/* A cursor holding nothing, for callers which have the tree to themselves */
 struct cursor *table_find(struct table *table, uint32_t key)
 {
-	uint32_t root_page_num = table->root_page_num;
-	void *root_node = get_page(table->pager, root_page_num);
+	struct cursor *cursor = table_find_latched(table, key, LATCH_SHARED);
+
+	cursor_release(cursor);
 
-	if (get_node_type(root_node) == NODE_LEAF) {
-		return leaf_node_find(table, root_page_num, key);
-	} else {
-		return internal_node_find(table, root_page_num, key);
+	return cursor;
+}
+
+uint32_t table_row_count(struct table *table)
+{
+	uint32_t root_page_num = table_root(table);
+	void *root = get_page(table->pager, root_page_num);
+	uint32_t count;
+
+	latch_page(table->pager, root_page_num, LATCH_SHARED);
+	count = node_row_count(root);
+	unlatch_page(table->pager, root_page_num);
+	unpin_page(table->pager, root_page_num);
+
+	return count;
+}
+
+/*
+ * How many rows have an id below key. The counts of the children left
+ * of the path down to key's leaf add up to it, no leaf is scanned.
+ */
+uint32_t table_rank(struct table *table, uint32_t key)
+{
+	uint32_t page_num = table_root(table);
+	uint32_t rank = 0;
+
+	while (true) {
+		void *node = get_page(table->pager, page_num);
+		uint32_t child_page_num;
+		uint32_t index;
+
+		if (get_node_type(node) == NODE_LEAF) {
+			latch_page(table->pager, page_num, LATCH_SHARED);
+			rank += keys_lower_bound(leaf_node_key(node, 0),
+					*leaf_node_num_cells(node), key);
+			unlatch_page(table->pager, page_num);
+			unpin_page(table->pager, page_num);
+
+			return rank;
+		}
+
+		index = internal_node_find_child(node, key);
+		for (uint32_t i = 0; i < index; i++)
+			rank += __atomic_load_n(internal_node_count(node, i),
+					__ATOMIC_RELAXED);
+
+		child_page_num = *internal_node_child(node, index);
+		unpin_page(table->pager, page_num);
+		page_num = child_page_num;
 	}
 }
 
+/* The rows of the subtree at page_num, which hold the ids low to high */
+struct span {
+	uint32_t page_num;
+	uint32_t low;
+	uint32_t high;
+	uint32_t count;
+};
+
+/*
+ * Replace every span with those of its children which overlap the ids
+ * low to high. Returns false, changing nothing, once spans are leaves.
+ */
+static bool table_split_spans(struct table *table, struct span **spans,
+		uint32_t *num_spans, uint32_t low, uint32_t high)
+{
+	struct span *children = NULL;
+	uint32_t num_children = 0;
+
+	for (uint32_t i = 0; i < *num_spans; i++) {
+		struct span *span = &(*spans)[i];
+		void *node = get_page(table->pager, span->page_num);
+		uint32_t num_keys;
+
+		if (get_node_type(node) == NODE_LEAF) {
+			unpin_page(table->pager, span->page_num);
+			free(children);
+			return false;
+		}
+
+		num_keys = *internal_node_num_keys(node);
+		children = realloc(children, (num_children + num_keys + 1) *
+				sizeof(*children));
+		if (!children) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (uint32_t j = 0; j <= num_keys; j++) {
+			struct span *child = &children[num_children];
+
+			child->low = j ? *internal_node_key(node, j - 1) + 1 :
+				span->low;
+			child->high = j < num_keys ?
+				*internal_node_key(node, j) : span->high;
+			if (child->high < low || child->low > high)
+				continue;
+
+			child->page_num = *internal_node_child(node, j);
+			child->count = __atomic_load_n(
+				internal_node_count(node, j), __ATOMIC_RELAXED);
+			num_children++;
+		}
+
+		unpin_page(table->pager, span->page_num);
+	}
+
+	free(*spans);
+	*spans = children;
+	*num_spans = num_children;
+
+	return true;
+}
+
+/*
+ * Split the ids from low to high into at most max ranges of about as
+ * many rows, cutting at the separators of the internal nodes. Range i
+ * ends at cuts[i], the last one at high. Returns how many there are.
+ */
+uint32_t table_partition(struct table *table, uint32_t low, uint32_t high,
+		uint32_t *cuts, uint32_t max)
+{
+	struct span *spans = malloc(sizeof(*spans));
+	uint32_t num_spans = 1;
+	uint32_t num_cuts = 0;
+	uint64_t total = 0;
+	uint64_t sum = 0;
+
+	if (!spans) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	spans[0].page_num = table_root(table);
+	spans[0].low = 0;
+	spans[0].high = UINT32_MAX;
+
+	/* go down until there are enough subtrees to choose from */
+	while (num_spans < max && table_split_spans(table, &spans,
+				&num_spans, low, high))
+		;
+
+	for (uint32_t i = 0; i < num_spans; i++)
+		total += spans[i].count;
+
+	for (uint32_t i = 0; i + 1 < num_spans && num_cuts + 1 < max; i++) {
+		sum += spans[i].count;
+		if (sum * max >= total * (num_cuts + 1))
+			cuts[num_cuts++] = spans[i].high;
+	}
+
+	cuts[num_cuts++] = high;
+	free(spans);
+
+	return num_cuts;
+}
+
+/* Position a cursor on the row with the given rank, counting from 0 */
+struct cursor *table_seek_rank(struct table *table, uint32_t rank)
+{
+	uint32_t page_num = table_root(table);
+	struct cursor *cursor;
+	uint32_t num_cells;
+	void *node;
+
+	while (true) {
+		uint32_t child_page_num;
+		uint32_t num_keys;
+		uint32_t index;
+
+		node = get_page(table->pager, page_num);
+		if (get_node_type(node) == NODE_LEAF)
+			break;
+
+		num_keys = *internal_node_num_keys(node);
+		for (index = 0; index < num_keys; index++) {
+			uint32_t count = __atomic_load_n(
+				internal_node_count(node, index),
+				__ATOMIC_RELAXED);
+
+			if (rank < count)
+				break;
+
+			rank -= count;
+		}
+
+		child_page_num = *internal_node_child(node, index);
+		unpin_page(table->pager, page_num);
+		page_num = child_page_num;
+	}
+
+	latch_page(table->pager, page_num, LATCH_SHARED);
+	num_cells = *leaf_node_num_cells(node);
+
+	cursor = malloc(sizeof(*cursor));
+	cursor->table = table;
+	cursor->page_num = page_num;
+	cursor->cell_num = rank;
+	cursor->end = false;
+	cursor->latched = true;
+	cursor->ra_window = 0;
+	cursor->ra_ahead = 0;
+
+	/* past the last row only when every row came before */
+	if (rank >= num_cells)
+		cursor_step(cursor, *leaf_node_next_leaf(node));
+
+	return cursor;
+}
+
+/*
+ * The page under the cursor stays pinned until the caller is done with
+ * the value and calls unpin_page() on cursor->page_num.
+ */
 void *cursor_value(struct cursor *cursor)
 {
 	uint32_t page_num = cursor->page_num;
@@ -62,6 +417,34 @@ void *cursor_value(struct cursor *cursor)
 	return leaf_node_value(page, cursor->cell_num);
 }
 
+/*
+ * Called every time the cursor steps onto a new leaf. Once the leaves
+ * we prefetched last time are used up, prefetch the next window of
+ * siblings and double the window, since the scan is evidently
+ * sequential.
+ */
+static void cursor_readahead(struct cursor *cursor)
+{
+	uint32_t siblings[CURSOR_READAHEAD_MAX];
+	uint32_t n;
+
+	if (cursor->ra_ahead) {
+		cursor->ra_ahead--;
+		return;
+	}
+
+	if (!cursor->ra_window)
+		cursor->ra_window = CURSOR_READAHEAD_MIN;
+
+	n = leaf_node_next_siblings(cursor->table, cursor->page_num, siblings,
+			cursor->ra_window);
+	pager_prefetch(cursor->table->pager, siblings, n);
+	cursor->ra_ahead = n;
+
+	if (cursor->ra_window < CURSOR_READAHEAD_MAX)
+		cursor->ra_window *= 2;
+}
+
 void cursor_advance(struct cursor *cursor)
 {
 	uint32_t page_num = cursor->page_num;
@@ -69,15 +452,29 @@ void cursor_advance(struct cursor *cursor)
 
         cursor->cell_num += 1;
         if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-		/* Advance to next leaf node */
-		uint32_t next_page_num = *leaf_node_next_leaf(node);
-
-		if (next_page_num == 0) {
-			/* This was rightmost leaf */
-			cursor->end = true;
-		} else {
-			cursor->page_num = next_page_num;
-			cursor->cell_num = 0;
-		}
+		/* Advance to next leaf node, crabbing along the siblings */
+		cursor_step(cursor, *leaf_node_next_leaf(node));
 	}
+
+	unpin_page(cursor->table->pager, page_num);
+
+	if (!cursor->end && cursor->page_num != page_num)
+		cursor_readahead(cursor);
+}
+
+/* Let go of the leaf a latched cursor holds */
+void cursor_release(struct cursor *cursor)
+{
+	if (!cursor->latched)
+		return;
+
+	unlatch_page(cursor->table->pager, cursor->page_num);
+	unpin_page(cursor->table->pager, cursor->page_num);
+	cursor->latched = false;
+}
+
+void cursor_close(struct cursor *cursor)
+{
+	cursor_release(cursor);
+	free(cursor);
 }
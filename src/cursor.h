@@ -22,16 +22,36 @@
 
 #include "db.h"
 
+#define CURSOR_READAHEAD_MIN	4
+#define CURSOR_READAHEAD_MAX	64
+
 struct cursor {
 	struct table *table;
 	uint32_t page_num;
 	uint32_t cell_num;
 	bool end;
+
+	/* the leaf stays pinned and latched until cursor_close() */
+	bool latched;
+
+	/* leaves to prefetch next time, and how many are still ahead */
+	uint32_t ra_window;
+	uint32_t ra_ahead;
 };
 
 struct cursor *table_start(struct table *table);
 struct cursor *table_find(struct table *table, uint32_t key);
+struct cursor *table_find_latched(struct table *table, uint32_t key,
+		enum latch_mode mode);
+struct cursor *table_seek(struct table *table, uint32_t key);
+uint32_t table_row_count(struct table *table);
+uint32_t table_rank(struct table *table, uint32_t key);
+struct cursor *table_seek_rank(struct table *table, uint32_t rank);
+uint32_t table_partition(struct table *table, uint32_t low, uint32_t high,
+		uint32_t *cuts, uint32_t max);
 void *cursor_value(struct cursor *cursor);
 void cursor_advance(struct cursor *cursor);
+void cursor_release(struct cursor *cursor);
+void cursor_close(struct cursor *cursor);
 
 #endif /* __CURSOR_H__ */
@@ -29,163 +29,217 @@
 #include "compiler.h"
 #include "db.h"
 #include "cursor.h"
+#include "overflow.h"
+#include "pager.h"
+#include "search.h"
 
-uint32_t get_unused_page_num(struct pager *pager)
+static uint32_t profile_inline_size(uint32_t len)
 {
-	return pager->num_pages;
+	return len < PROFILE_INLINE_SIZE ? len : PROFILE_INLINE_SIZE;
 }
 
-void *get_page(struct pager *pager, uint32_t page_num)
+uint32_t row_size(struct row *row)
 {
-	if (page_num > TABLE_MAX_PAGES) {
-		fprintf(stderr, "Page number out of bounds --> %d > %d",
-				page_num, TABLE_MAX_PAGES);
-		exit(EXIT_FAILURE);
-	}
+	uint32_t size = ID_SIZE + STRING_LENGTH_SIZE + strlen(row->username) +
+		STRING_LENGTH_SIZE + strlen(row->email) +
+		PROFILE_LENGTH_SIZE + profile_inline_size(row->profile_len);
 
-	if (pager->pages[page_num] == NULL) {
-		/* Cache miss: allocate memory and load from file. */
-		void *page = malloc(PAGE_SIZE);
-		uint32_t num_pages = pager->len / PAGE_SIZE;
+	if (row->profile_len > PROFILE_INLINE_SIZE)
+		size += PROFILE_OVERFLOW_SIZE;
 
-		/* We might save a partial page at the end of the file */
-		if (pager->len % PAGE_SIZE)
-			num_pages += 1;
+	return size;
+}
 
-		if (page_num <= num_pages) {
-			ssize_t bytes;
+/*
+ * Move whatever part of the profile doesn't stay inline out to overflow
+ * pages. Has to happen before the row is serialized.
+ */
+void row_spill_profile(struct pager *pager, struct row *row)
+{
+	if (row->profile_len <= PROFILE_INLINE_SIZE || row->profile_overflow)
+		return;
 
-                        lseek(pager->fd, page_num * PAGE_SIZE, SEEK_SET);
-			bytes = read(pager->fd, page, PAGE_SIZE);
-			if (bytes < 0) {
-				fprintf(stderr, "Error reading file: %s\n",
-						strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-		}
+	row->profile_overflow = overflow_write(pager,
+			row->profile + PROFILE_INLINE_SIZE,
+			row->profile_len - PROFILE_INLINE_SIZE);
+}
 
-		pager->pages[page_num] = page;
+static void *serialize_string(void *dst, const char *str)
+{
+	uint8_t len = strlen(str);
 
-		if (page_num >= pager->num_pages)
-			pager->num_pages = page_num + 1;
-	}
+	*(uint8_t *) dst = len;
+	memcpy(dst + STRING_LENGTH_SIZE, str, len);
 
-	return pager->pages[page_num];
+	return dst + STRING_LENGTH_SIZE + len;
 }
 
-static void pager_flush(struct pager *pager, uint32_t page_num)
+static void *deserialize_string(void *src, char *str, size_t max)
 {
-	ssize_t bytes;
-	off_t offset;
+	uint8_t len = *(uint8_t *) src;
+	size_t copy = len < max ? len : max;
 
-        if (!pager->pages[page_num]) {
-		fprintf(stderr, "Tried to flush NULL page\n");
-		exit(EXIT_FAILURE);
-	}
+	memcpy(str, src + STRING_LENGTH_SIZE, copy);
+	str[copy] = '\0';
 
-	offset = lseek(pager->fd, page_num * PAGE_SIZE, SEEK_SET);
-	if (offset < 0) {
-		fprintf(stderr, "Error seeking: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+	return src + STRING_LENGTH_SIZE + len;
+}
 
-	bytes = write(pager->fd, pager->pages[page_num], PAGE_SIZE);
-	if (bytes < 0) {
-		fprintf(stderr, "Error writing: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+/* Where the profile starts, past the variable length strings */
+static void *row_profile(void *src)
+{
+	void *email = src + USERNAME_OFFSET + STRING_LENGTH_SIZE +
+		*(uint8_t *) (src + USERNAME_OFFSET);
+
+	return email + STRING_LENGTH_SIZE + *(uint8_t *) email;
 }
 
-struct pager *pager_open(const char *filename)
+/* Returns how many bytes were written, row_size() of them */
+uint32_t serialize_row(struct row *src, void *dst)
 {
-	struct pager *pager;
-	off_t len;
-	int fd;
+	uint32_t inline_size = profile_inline_size(src->profile_len);
+	void *end;
 
-	fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
-	if (fd == -1) {
-		fprintf(stderr, "Unable to open file %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+	memcpy(dst + ID_OFFSET, &src->id, ID_SIZE);
+	end = serialize_string(dst + USERNAME_OFFSET, src->username);
+	end = serialize_string(end, src->email);
 
-	len = lseek(fd, 0, SEEK_END);
-	pager = malloc(sizeof(*pager));
-	pager->fd = fd;
-	pager->len = len;
-	pager->num_pages = len / PAGE_SIZE;
+	memcpy(end, &src->profile_len, PROFILE_LENGTH_SIZE);
+	end += PROFILE_LENGTH_SIZE;
 
-	if (len % PAGE_SIZE) {
-		printf("Db file is not aligned to PAGE_SIZE\n");
-		exit(EXIT_FAILURE);
-	}
+	if (inline_size)
+		memcpy(end, src->profile, inline_size);
+	end += inline_size;
 
-	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
-		pager->pages[i] = NULL;
+	if (src->profile_len > PROFILE_INLINE_SIZE) {
+		memcpy(end, &src->profile_overflow, PROFILE_OVERFLOW_SIZE);
+		end += PROFILE_OVERFLOW_SIZE;
+	}
 
-        return pager;
+	return end - dst;
 }
 
-void serialize_row(struct row *src, void *dst)
+/* Leaves the profile alone, its overflow pages aren't even looked at */
+void deserialize_row(void *src, struct row *dst)
 {
-	memcpy(dst + ID_OFFSET, &src->id, ID_SIZE);
-	memcpy(dst + USERNAME_OFFSET, &src->username, USERNAME_SIZE);
-	memcpy(dst + EMAIL_OFFSET, &src->email, EMAIL_SIZE);
+	void *email;
+	void *profile;
+
+	memcpy(&dst->id, src + ID_OFFSET, ID_SIZE);
+	email = deserialize_string(src + USERNAME_OFFSET, dst->username,
+			COLUMN_USERNAME_SIZE);
+	profile = deserialize_string(email, dst->email, COLUMN_EMAIL_SIZE);
+
+	memcpy(&dst->profile_len, profile, PROFILE_LENGTH_SIZE);
+	dst->profile_overflow = 0;
+	dst->profile = NULL;
+
+	if (dst->profile_len > PROFILE_INLINE_SIZE)
+		memcpy(&dst->profile_overflow, profile + PROFILE_LENGTH_SIZE +
+				PROFILE_INLINE_SIZE, PROFILE_OVERFLOW_SIZE);
 }
 
-void deserialize_row(void *src, struct row *dst)
+/*
+ * Load the profile of a row deserialize_row() filled in from src. The
+ * caller frees dst->profile.
+ */
+void deserialize_profile(struct pager *pager, void *src, struct row *dst)
 {
-	memcpy(&dst->id, src + ID_OFFSET, ID_SIZE);
-	memcpy(&dst->username, src + USERNAME_OFFSET, USERNAME_SIZE);
-	memcpy(&dst->email, src + EMAIL_OFFSET, EMAIL_SIZE);
+	uint32_t inline_size = profile_inline_size(dst->profile_len);
+
+	dst->profile = malloc(dst->profile_len + 1);
+	if (!dst->profile) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(dst->profile, row_profile(src) + PROFILE_LENGTH_SIZE,
+			inline_size);
+	overflow_read(pager, dst->profile_overflow,
+			dst->profile + inline_size,
+			dst->profile_len - inline_size);
+	dst->profile[dst->profile_len] = '\0';
 }
 
-struct table *db_open(const char *filename)
+struct table *db_open(const char *filename,
+		const struct pager_options *options)
 {
-	struct pager *pager = pager_open(filename);
+	struct pager *pager = pager_open(filename, options);
 	struct table *table = malloc(sizeof(*table));
 
 	table->pager = pager;
-	table->root_page_num = 0;
-
-	if (!pager->num_pages) {
-		void *root = get_page(pager, 0);
-
+	pager_latch_init(&table->latch);
+	pthread_mutex_init(&table->hint_lock, NULL);
+	pager_begin(pager);
+	table->root_page_num = pager_get_root(pager);
+	table->hint_page_num = 0;
+	table->scan_workers = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+		sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+	if (!table->root_page_num) {
+		void *root;
+
+		table->root_page_num = get_unused_page_num(pager);
+		root = get_page(pager, table->root_page_num);
 		initialize_leaf_node(root);
 		set_node_root(root, true);
+		mark_page_dirty(pager, table->root_page_num);
+		unpin_page(pager, table->root_page_num);
+
+		pager_set_root(pager, table->root_page_num);
 	}
-        
+
+	pager_commit(pager);
+
 	return table;
 }
 
 void db_close(struct table *table)
 {
-	struct pager *pager = table->pager;
-	int ret;
-
-	for (uint32_t i = 0; i < pager->num_pages; i++) {
-		if (!pager->pages[i])
-			continue;
+	pager_close(table->pager);
+	pthread_mutex_destroy(&table->hint_lock);
+	pthread_rwlock_destroy(&table->latch);
+	free(table);
+}
 
-		pager_flush(pager, i);
-		free(pager->pages[i]);
-		pager->pages[i] = NULL;
+/*
+ * Mapped files have no page latches, everything takes the tree alone.
+ * With copy-on-write, readers don't take it at all but read from a
+ * snapshot, and the writer's changes show once it lets go.
+ */
+void table_latch(struct table *table, enum latch_mode mode)
+{
+	if (mode == LATCH_SHARED && table->pager->cow) {
+		pager_snapshot_begin(table->pager);
+		return;
 	}
 
-	ret = close(pager->fd);
-	if (ret < 0) {
-		fprintf(stderr, "Error closing db file: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+	if (mode == LATCH_EXCLUSIVE || table->pager->mode == PAGER_MODE_MMAP)
+		pthread_rwlock_wrlock(&table->latch);
+	else
+		pthread_rwlock_rdlock(&table->latch);
 
-	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-		void *page = pager->pages[i];
+	if (mode == LATCH_EXCLUSIVE)
+		pager_write_begin(table->pager);
+}
 
-		free(page);
-		pager->pages[i] = NULL;
+void table_unlatch(struct table *table)
+{
+	if (pager_in_snapshot()) {
+		pager_snapshot_end(table->pager);
+		return;
 	}
 
-        free(pager);
-	free(table);
+	pager_publish(table->pager);
+	pthread_rwlock_unlock(&table->latch);
+}
+
+/* Forget the last leaf, once leaves have moved under it */
+void table_drop_hint(struct table *table)
+{
+	pthread_mutex_lock(&table->hint_lock);
+	table->hint_page_num = 0;
+	pthread_mutex_unlock(&table->hint_lock);
 }
 
 uint32_t *internal_node_num_keys(void *node)
@@ -198,10 +252,19 @@ uint32_t *internal_node_right_child(void *node)
 	return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
-uint32_t *internal_node_cell(void *node, uint32_t cell_num)
+static uint32_t *internal_node_keys(void *node)
+{
+	return node + INTERNAL_NODE_HEADER_SIZE;
+}
+
+static uint32_t *internal_node_children(void *node)
+{
+	return internal_node_keys(node) + *internal_node_num_keys(node);
+}
+
+static uint32_t *internal_node_counts(void *node)
 {
-	return node + INTERNAL_NODE_HEADER_SIZE +
-		cell_num * INTERNAL_NODE_CELL_SIZE;
+	return internal_node_keys(node) + 2 * *internal_node_num_keys(node);
 }
 
 uint32_t *internal_node_child(void *node, uint32_t child_num)
@@ -217,26 +280,106 @@ uint32_t *internal_node_child(void *node, uint32_t child_num)
 	if (child_num == num_keys)
 		return internal_node_right_child(node);
 
-	return internal_node_cell(node, child_num);
+	return internal_node_children(node) + child_num;
 }
 
 uint32_t *internal_node_key(void *node, uint32_t key_num)
 {
-	return (void *) internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+	return internal_node_keys(node) + key_num;
 }
 
-uint32_t get_node_max_key(void *node)
+/* Rows in the subtree of the child_num-th child */
+uint32_t *internal_node_count(void *node, uint32_t child_num)
 {
-	switch (get_node_type(node)) {
-	case NODE_INTERNAL:
-		return *internal_node_key(node,
-				*internal_node_num_keys(node) - 1);
-	case NODE_LEAF:
-		return *leaf_node_key(node,
-				*leaf_node_num_cells(node) - 1);
-	}
+	if (child_num == *internal_node_num_keys(node))
+		return node + INTERNAL_NODE_RIGHT_COUNT_OFFSET;
 
-	exit(EXIT_FAILURE);
+	return internal_node_counts(node) + child_num;
+}
+
+/* Rows in the subtree rooted at node */
+uint32_t node_row_count(void *node)
+{
+	uint32_t num_keys;
+	uint32_t count;
+
+	if (get_node_type(node) == NODE_LEAF)
+		return *leaf_node_num_cells(node);
+
+	num_keys = *internal_node_num_keys(node);
+	count = __atomic_load_n(internal_node_count(node, num_keys),
+			__ATOMIC_RELAXED);
+	for (uint32_t i = 0; i < num_keys; i++)
+		count += __atomic_load_n(internal_node_count(node, i),
+				__ATOMIC_RELAXED);
+
+	return count;
+}
+
+/*
+ * Insert a key and the child to its left, with its row count, at
+ * index. The arrays after the keys move up to make room, the children
+ * by one entry and the counts by two.
+ */
+void internal_node_insert_cell(void *node, uint32_t index, uint32_t child,
+		uint32_t key, uint32_t count)
+{
+	uint32_t num_keys = *internal_node_num_keys(node);
+	uint32_t *keys = internal_node_keys(node);
+	uint32_t *children = keys + num_keys;
+	uint32_t *counts = children + num_keys;
+
+	memmove(counts + index + 3, counts + index,
+			(num_keys - index) * INTERNAL_NODE_COUNT_SIZE);
+	memmove(counts + 2, counts, index * INTERNAL_NODE_COUNT_SIZE);
+	memmove(children + index + 2, children + index,
+			(num_keys - index) * INTERNAL_NODE_CHILD_SIZE);
+	memmove(children + 1, children, index * INTERNAL_NODE_CHILD_SIZE);
+	memmove(keys + index + 1, keys + index,
+			(num_keys - index) * INTERNAL_NODE_KEY_SIZE);
+
+	keys[index] = key;
+	children[index + 1] = child;
+	counts[index + 2] = count;
+	*internal_node_num_keys(node) = num_keys + 1;
+}
+
+/* Drop the key at index together with the child to its left */
+void internal_node_remove_cell(void *node, uint32_t index)
+{
+	uint32_t num_keys = *internal_node_num_keys(node);
+	uint32_t *keys = internal_node_keys(node);
+	uint32_t *children = keys + num_keys;
+	uint32_t *counts = children + num_keys;
+
+	memmove(keys + index, keys + index + 1,
+			(num_keys - index - 1) * INTERNAL_NODE_KEY_SIZE);
+	memmove(children - 1, children, index * INTERNAL_NODE_CHILD_SIZE);
+	memmove(children - 1 + index, children + index + 1,
+			(num_keys - index - 1) * INTERNAL_NODE_CHILD_SIZE);
+	memmove(counts - 2, counts, index * INTERNAL_NODE_COUNT_SIZE);
+	memmove(counts - 2 + index, counts + index + 1,
+			(num_keys - index - 1) * INTERNAL_NODE_COUNT_SIZE);
+
+	*internal_node_num_keys(node) = num_keys - 1;
+}
+
+/* The largest key in the subtree rooted at node */
+uint32_t get_node_max_key(struct pager *pager, void *node)
+{
+	uint32_t right_child_page_num;
+	uint32_t max_key;
+	void *right_child;
+
+	if (get_node_type(node) == NODE_LEAF)
+		return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+
+	right_child_page_num = *internal_node_right_child(node);
+	right_child = get_page_in_place(pager, right_child_page_num);
+	max_key = get_node_max_key(pager, right_child);
+	unpin_page(pager, right_child_page_num);
+
+	return max_key;
 }
 
 uint32_t *node_parent(void *node)
@@ -258,6 +401,22 @@ void set_node_root(void *node, bool is_root)
 	*((uint8_t *) (node + IS_ROOT_OFFSET)) = value;
 }
 
+/* Point every child of an internal node back at it */
+static void internal_node_adopt_children(struct pager *pager, void *node,
+		uint32_t page_num)
+{
+	uint32_t num_keys = *internal_node_num_keys(node);
+
+	for (uint32_t i = 0; i <= num_keys; i++) {
+		uint32_t child_page_num = *internal_node_child(node, i);
+		void *child = get_page_in_place(pager, child_page_num);
+
+		*node_parent(child) = page_num;
+		mark_page_dirty(pager, child_page_num);
+		unpin_page(pager, child_page_num);
+	}
+}
+
 void create_new_root(struct table *table, uint32_t right_child_page_num)
 {
 	void *right_child;
@@ -273,24 +432,73 @@ void create_new_root(struct table *table, uint32_t right_child_page_num)
 	left_child = get_page(table->pager, left_child_page_num);
 
 	/* left child has data copied from old root */
-        memcpy(left_child, root, PAGE_SIZE);
+	memcpy(left_child, root, table->pager->page_size);
 	set_node_root(left_child, false);
 
+	if (get_node_type(left_child) == NODE_INTERNAL)
+		internal_node_adopt_children(table->pager, left_child,
+				left_child_page_num);
+
 	initialize_internal_node(root);
 	set_node_root(root, true);
 	*internal_node_num_keys(root) = 1;
 	*internal_node_child(root, 0) = left_child_page_num;
-	left_child_max_key = get_node_max_key(left_child);
+	left_child_max_key = get_node_max_key(table->pager, left_child);
 	*internal_node_key(root, 0) = left_child_max_key;
 	*internal_node_right_child(root) = right_child_page_num;
+	*internal_node_count(root, 0) = node_row_count(left_child);
+	*internal_node_count(root, 1) = node_row_count(right_child);
 	*node_parent(left_child) = table->root_page_num;
 	*node_parent(right_child) = table->root_page_num;
+
+	mark_page_dirty(table->pager, left_child_page_num);
+	mark_page_dirty(table->pager, right_child_page_num);
+	mark_page_dirty(table->pager, table->root_page_num);
+
+	unpin_page(table->pager, left_child_page_num);
+	unpin_page(table->pager, right_child_page_num);
+	unpin_page(table->pager, table->root_page_num);
 }
 
 void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key)
 {
 	uint32_t old_child_index = internal_node_find_child(node, old_key);
-	*internal_node_key(node, old_child_index) = new_key;
+
+	/* the right child has no key of its own */
+	if (old_child_index < *internal_node_num_keys(node))
+		*internal_node_key(node, old_child_index) = new_key;
+}
+
+/*
+ * Add delta to the row counts on the way from the root to the leaf of
+ * key. Inserts count their row before the leaf gets it, so splits can
+ * simply recount the nodes they touch; deletes after it's gone. With
+ * the tree shared the counts are the only thing changing in internal
+ * nodes, concurrent inserts bump them atomically instead of latching.
+ */
+void update_row_counts(struct table *table, uint32_t key, int32_t delta)
+{
+	uint32_t page_num = table->root_page_num;
+
+	while (true) {
+		void *node = get_page(table->pager, page_num);
+		uint32_t child_page_num;
+		uint32_t index;
+
+		if (get_node_type(node) == NODE_LEAF) {
+			unpin_page(table->pager, page_num);
+			return;
+		}
+
+		index = internal_node_find_child(node, key);
+		__atomic_add_fetch(internal_node_count(node, index), delta,
+				__ATOMIC_RELAXED);
+		child_page_num = *internal_node_child(node, index);
+		mark_page_dirty(table->pager, page_num);
+		unpin_page(table->pager, page_num);
+
+		page_num = child_page_num;
+	}
 }
 
 uint32_t *leaf_node_num_cells(void *node)
@@ -298,19 +506,27 @@ uint32_t *leaf_node_num_cells(void *node)
 	return node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
 
-void *leaf_node_cell(void *node, uint32_t cell)
+uint32_t *leaf_node_key(void *node, uint32_t cell)
 {
-	return node + LEAF_NODE_HEADER_SIZE + cell * LEAF_NODE_CELL_SIZE;
+	return node + LEAF_NODE_HEADER_SIZE + cell * LEAF_NODE_KEY_SIZE;
 }
 
-uint32_t *leaf_node_key(void *node, uint32_t cell)
+uint16_t *leaf_node_slot(void *node, uint32_t cell)
 {
-	return leaf_node_cell(node, cell);
+	uint32_t num_cells = *leaf_node_num_cells(node);
+
+	return (void *) leaf_node_key(node, num_cells) +
+		cell * LEAF_NODE_SLOT_SIZE;
 }
 
 void *leaf_node_value(void *node, uint32_t cell)
 {
-	return leaf_node_cell(node, cell) + LEAF_NODE_KEY_SIZE;
+	return node + *leaf_node_slot(node, cell) + LEAF_NODE_VALUE_LENGTH_SIZE;
+}
+
+uint32_t leaf_node_value_size(void *node, uint32_t cell)
+{
+	return *(uint16_t *) (node + *leaf_node_slot(node, cell));
 }
 
 uint32_t *leaf_node_next_leaf(void *node)
@@ -318,12 +534,139 @@ uint32_t *leaf_node_next_leaf(void *node)
 	return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
+/* Start of the value heap, 0 while nothing was allocated from it */
+uint32_t *leaf_node_heap(void *node)
+{
+	return node + LEAF_NODE_HEAP_OFFSET;
+}
+
+/* Free bytes in the leaf, counting the holes in its heap */
+uint32_t leaf_node_free_space(struct pager *pager, void *node)
+{
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint32_t used = 0;
+
+	for (uint32_t i = 0; i < num_cells; i++)
+		used += LEAF_NODE_CELL_BYTES(leaf_node_value_size(node, i));
+
+	return LEAF_NODE_SPACE_FOR_CELLS(pager) - used;
+}
+
+/* Rewrite the values back to back at the end of the page */
+void leaf_node_compact(struct pager *pager, void *node)
+{
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint32_t heap = pager->page_size;
+	void *copy;
+
+	copy = malloc(pager->page_size);
+	if (!copy) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(copy, node, pager->page_size);
+
+	for (uint32_t i = 0; i < num_cells; i++) {
+		uint32_t len = LEAF_NODE_VALUE_LENGTH_SIZE +
+			leaf_node_value_size(copy, i);
+
+		heap -= len;
+		memcpy(node + heap, copy + *leaf_node_slot(copy, i), len);
+		*leaf_node_slot(node, i) = heap;
+	}
+
+	*leaf_node_heap(node) = heap;
+	free(copy);
+}
+
+/*
+ * Make room for a cell at index cell with a value of size bytes and
+ * return where the value goes. The caller makes sure it fits, see
+ * leaf_node_free_space().
+ */
+void *leaf_node_insert_cell(struct pager *pager, void *node, uint32_t cell,
+		uint32_t key, uint32_t size)
+{
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint32_t *keys = leaf_node_key(node, 0);
+	uint16_t *slots = (void *) (keys + num_cells);
+	uint16_t *new_slots = (void *) (keys + num_cells + 1);
+	uint32_t heap = *leaf_node_heap(node);
+	uint32_t end = LEAF_NODE_HEADER_SIZE + (num_cells + 1) *
+		(LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE);
+
+	if (!heap)
+		heap = pager->page_size;
+
+	/* the space is there, but not in one piece */
+	if (heap < end + LEAF_NODE_VALUE_LENGTH_SIZE + size) {
+		leaf_node_compact(pager, node);
+		heap = *leaf_node_heap(node);
+	}
+
+	heap -= LEAF_NODE_VALUE_LENGTH_SIZE + size;
+	*leaf_node_heap(node) = heap;
+	*(uint16_t *) (node + heap) = size;
+
+	memmove(new_slots + cell + 1, slots + cell,
+			(num_cells - cell) * LEAF_NODE_SLOT_SIZE);
+	memmove(new_slots, slots, cell * LEAF_NODE_SLOT_SIZE);
+	memmove(keys + cell + 1, keys + cell,
+			(num_cells - cell) * LEAF_NODE_KEY_SIZE);
+
+	keys[cell] = key;
+	new_slots[cell] = heap;
+	*leaf_node_num_cells(node) = num_cells + 1;
+
+	return node + heap + LEAF_NODE_VALUE_LENGTH_SIZE;
+}
+
+/*
+ * Collect up to max page numbers of the leaves that follow page_num
+ * under the same parent, in key order.
+ */
+uint32_t leaf_node_next_siblings(struct table *table, uint32_t page_num,
+		uint32_t *siblings, uint32_t max)
+{
+	uint32_t parent_page_num;
+	uint32_t num_keys;
+	uint32_t n = 0;
+	uint32_t index;
+	void *parent;
+	void *node;
+	bool root;
+
+	node = get_page(table->pager, page_num);
+	root = is_node_root(node);
+	parent_page_num = *node_parent(node);
+	unpin_page(table->pager, page_num);
+
+	if (root)
+		return 0;
+
+	parent = get_page(table->pager, parent_page_num);
+	num_keys = *internal_node_num_keys(parent);
+
+	for (index = 0; index <= num_keys; index++)
+		if (*internal_node_child(parent, index) == page_num)
+			break;
+
+	for (index++; index <= num_keys && n < max; index++)
+		siblings[n++] = *internal_node_child(parent, index);
+
+	unpin_page(table->pager, parent_page_num);
+
+	return n;
+}
+
 void initialize_leaf_node(void *node)
 {
 	set_node_type(node, NODE_LEAF);
 	set_node_root(node, false);
 	*leaf_node_num_cells(node) = 0;
 	*leaf_node_next_leaf(node) = 0; /* 0 represents no sibbling */
+	*leaf_node_heap(node) = 0;
 }
 
 void initialize_internal_node(void *node)
@@ -331,222 +674,936 @@ void initialize_internal_node(void *node)
 	set_node_type(node, NODE_INTERNAL);
 	set_node_root(node, false);
 	*internal_node_num_keys(node) = 0;
+	*internal_node_count(node, 0) = 0;
+}
+
+/*
+ * Bytes the i-th cell of the leaf would take once the new cell is put
+ * at cursor->cell_num.
+ */
+static uint32_t leaf_node_split_cell_bytes(void *node, uint32_t i,
+		uint32_t cell_num, uint32_t new_size)
+{
+	if (i == cell_num)
+		return LEAF_NODE_CELL_BYTES(new_size);
+
+	return LEAF_NODE_CELL_BYTES(leaf_node_value_size(node,
+				i < cell_num ? i : i - 1));
 }
 
 void leaf_node_split_and_insert(struct cursor *cursor, uint32_t key,
 		struct row *value)
 {
+	struct pager *pager = cursor->table->pager;
+	uint32_t value_size = row_size(value);
 	uint32_t new_page_num;
+	uint32_t left_count;
+	uint32_t num_cells;
 	uint32_t old_max;
 	void *old_node;
 	void *new_node;
+	void *copy;
 
-	old_node = get_page(cursor->table->pager, cursor->page_num);
-	old_max = get_node_max_key(old_node);
-	new_page_num = get_unused_page_num(cursor->table->pager);
-	new_node = get_page(cursor->table->pager, new_page_num);
+	old_node = get_page(pager, cursor->page_num);
+	old_max = get_node_max_key(pager, old_node);
+	num_cells = *leaf_node_num_cells(old_node);
+	new_page_num = get_unused_page_num(pager);
+	new_node = get_page(pager, new_page_num);
 	initialize_leaf_node(new_node);
 	*node_parent(new_node) = *node_parent(old_node);
+
+	/*
+	 * Appending past the end of the last leaf: keep it full and start
+	 * the new leaf with just the new row, increasing keys would leave
+	 * the left half empty forever otherwise. Other splits divide the
+	 * bytes, not the cells, evenly.
+	 */
+	if (cursor->cell_num == num_cells && !*leaf_node_next_leaf(old_node)) {
+		left_count = num_cells;
+	} else {
+		uint32_t bytes = 0;
+		uint32_t total = 0;
+
+		for (uint32_t i = 0; i <= num_cells; i++)
+			total += leaf_node_split_cell_bytes(old_node, i,
+					cursor->cell_num, value_size);
+
+		for (left_count = 0; left_count < num_cells &&
+				bytes * 2 < total; left_count++)
+			bytes += leaf_node_split_cell_bytes(old_node,
+					left_count, cursor->cell_num,
+					value_size);
+
+		if (!left_count)
+			left_count = 1;
+	}
+
 	*leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
 	*leaf_node_next_leaf(old_node) = new_page_num;
 
-	for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-		uint32_t index_within_node;
-		void *dst_node;
-		void *dst;
+	/* refill the old leaf from a copy, which packs its heap too */
+	copy = malloc(pager->page_size);
+	if (!copy) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
 
-		if (i >= LEAF_NODE_LEFT_SPLIT_COUNT)
-			dst_node = new_node;
-		else
-			dst_node = old_node;
+	memcpy(copy, old_node, pager->page_size);
+	*leaf_node_num_cells(old_node) = 0;
+	*leaf_node_heap(old_node) = 0;
 
-		index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-		dst = leaf_node_cell(dst_node, index_within_node);
+	for (uint32_t i = 0; i <= num_cells; i++) {
+		void *dst_node = i < left_count ? old_node : new_node;
+		uint32_t src = i < cursor->cell_num ? i : i - 1;
+		uint32_t size;
+		void *dst;
 
 		if (i == cursor->cell_num) {
-			serialize_row(value, leaf_node_value(dst_node, index_within_node));
-			*leaf_node_key(dst_node, index_within_node) = key;
-		} else if (i > cursor->cell_num) {
-			memcpy(dst, leaf_node_cell(old_node, i - 1),
-					LEAF_NODE_CELL_SIZE);
+			dst = leaf_node_insert_cell(pager, dst_node,
+					*leaf_node_num_cells(dst_node), key,
+					value_size);
+			serialize_row(value, dst);
 		} else {
-			memcpy(dst, leaf_node_cell(old_node, i),
-					LEAF_NODE_CELL_SIZE);
+			size = leaf_node_value_size(copy, src);
+			dst = leaf_node_insert_cell(pager, dst_node,
+					*leaf_node_num_cells(dst_node),
+					*leaf_node_key(copy, src), size);
+			memcpy(dst, leaf_node_value(copy, src), size);
 		}
 	}
 
-	*leaf_node_num_cells(old_node) = LEAF_NODE_LEFT_SPLIT_COUNT;
-	*leaf_node_num_cells(new_node) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+	free(copy);
+
+	mark_page_dirty(pager, cursor->page_num);
+	mark_page_dirty(pager, new_page_num);
 
 	if (is_node_root(old_node)) {
 		create_new_root(cursor->table, new_page_num);
-		return;
+		unpin_page(pager, new_page_num);
+		unpin_page(pager, cursor->page_num);
 	} else {
 		uint32_t parent_page_num = *node_parent(old_node);
-		uint32_t new_max = get_node_max_key(old_node);
-		void *parent = get_page(cursor->table->pager, parent_page_num);
+		uint32_t new_max = get_node_max_key(pager, old_node);
+		void *parent = get_page(pager, parent_page_num);
 
 		update_internal_node_key(parent, old_max, new_max);
+		*internal_node_count(parent, internal_node_find_child(parent,
+					new_max)) = *leaf_node_num_cells(old_node);
+		mark_page_dirty(pager, parent_page_num);
+
+		/* the parent may split in turn, don't hold on to pages */
+		unpin_page(pager, parent_page_num);
+		unpin_page(pager, new_page_num);
+		unpin_page(pager, cursor->page_num);
+
 		internal_node_insert(cursor->table, parent_page_num, new_page_num);
-		return;
 	}
 }
 
-void leaf_node_insert(struct cursor *cursor, uint32_t key, struct row *value)
+/*
+ * Insert at the cursor. A cursor which holds its leaf latched comes
+ * from a descent with the tree shared: the leaf is only safe to change
+ * if the row fits, a split would touch its ancestors. Then nothing is
+ * inserted and false is returned, the caller tries again holding the
+ * tree exclusively.
+ */
+bool leaf_node_insert(struct cursor *cursor, uint32_t key, struct row *value)
 {
-	void *node = get_page(cursor->table->pager, cursor->page_num);
-	uint32_t num_cells;
+	struct pager *pager = cursor->table->pager;
+	uint32_t size = row_size(value);
+	bool fits;
+	void *node;
 
-	num_cells = *leaf_node_num_cells(node);
-	if (num_cells >= LEAF_NODE_MAX_CELLS) {
-		leaf_node_split_and_insert(cursor, key, value);
-		return;
-	}
+	node = get_page(pager, cursor->page_num);
+	fits = leaf_node_free_space(pager, node) >= LEAF_NODE_CELL_BYTES(size);
+	unpin_page(pager, cursor->page_num);
 
-	if (cursor->cell_num < num_cells) {
-		for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-			void *src = leaf_node_cell(node, i);
-			void *dst = leaf_node_cell(node, i - 1);
+	if (!fits && cursor->latched)
+		return false;
 
-                        memcpy(src, dst, LEAF_NODE_CELL_SIZE);
-		}
+	row_spill_profile(pager, value);
+	update_row_counts(cursor->table, key, 1);
+
+	if (!fits) {
+		leaf_node_split_and_insert(cursor, key, value);
+		return true;
 	}
 
-	*(leaf_node_num_cells(node)) += 1;
-	*(leaf_node_key(node, cursor->cell_num)) = key;
+	node = get_page(pager, cursor->page_num);
+	serialize_row(value, leaf_node_insert_cell(pager, node,
+				cursor->cell_num, key, size));
+	mark_page_dirty(pager, cursor->page_num);
+	unpin_page(pager, cursor->page_num);
 
-	serialize_row(value, leaf_node_value(node, cursor->cell_num));
+	return true;
 }
 
-uint32_t internal_node_find_child(void *node, uint32_t key)
+/*
+ * Replace the value under the cursor. A row without a profile keeps the
+ * old one. The new value goes where the old one was when it's no
+ * bigger, or elsewhere in the same leaf when that has room, so only
+ * the leaf gets dirty. Rows which outgrow their leaf are reinserted.
+ */
+void leaf_node_update(struct cursor *cursor, struct row *value)
 {
-	/* return the index of the child which should contain the given key */
-	uint32_t max_index;
-	uint32_t min_index;
-	uint32_t num_keys;
+	struct pager *pager = cursor->table->pager;
+	uint8_t buf[ROW_SIZE];
+	uint32_t old_overflow;
+	struct row old_row;
+	uint32_t old_size;
+	uint32_t size;
+	void *node;
+	void *old;
+
+	node = get_page(pager, cursor->page_num);
+	old = leaf_node_value(node, cursor->cell_num);
+	old_size = leaf_node_value_size(node, cursor->cell_num);
+	deserialize_row(old, &old_row);
+	old_overflow = old_row.profile_overflow;
+
+	if (!value->profile) {
+		uint32_t inline_size = profile_inline_size(
+				old_row.profile_len);
+
+		value->profile = malloc(inline_size + 1);
+		if (!value->profile) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
 
-	num_keys = *internal_node_num_keys(node);
+		memcpy(value->profile, row_profile(old) + PROFILE_LENGTH_SIZE,
+				inline_size);
+		value->profile[inline_size] = '\0';
+		value->profile_len = old_row.profile_len;
+		value->profile_overflow = old_overflow;
+		old_overflow = 0;
+	}
+
+	unpin_page(pager, cursor->page_num);
+	row_spill_profile(pager, value);
+	node = get_page(pager, cursor->page_num);
 
-	/* Binary search */
-	min_index = 0;
-	max_index = num_keys; /* there is one more child than key */
+	size = serialize_row(value, buf);
 
-	while (min_index != max_index) {
-		uint32_t index = (min_index + max_index) / 2;
-		uint32_t key_to_right = *internal_node_key(node, index);
+	if (size <= old_size) {
+		void *slot = node + *leaf_node_slot(node, cursor->cell_num);
 
-		if (key_to_right >= key)
-			max_index = index;
-		else
-			min_index = index + 1;
+		*(uint16_t *) slot = size;
+		memcpy(slot + LEAF_NODE_VALUE_LENGTH_SIZE, buf, size);
+	} else if (leaf_node_free_space(pager, node) >= size - old_size) {
+		leaf_node_remove_cell(node, cursor->cell_num);
+		memcpy(leaf_node_insert_cell(pager, node, cursor->cell_num,
+					value->id, size), buf, size);
+	} else {
+		leaf_node_remove_cell(node, cursor->cell_num);
+		mark_page_dirty(pager, cursor->page_num);
+		unpin_page(pager, cursor->page_num);
+
+		/* leaf_node_insert() counts the row again */
+		update_row_counts(cursor->table, value->id, -1);
+		leaf_node_insert(cursor, value->id, value);
+		overflow_free(pager, old_overflow);
+		return;
 	}
 
-	return min_index;
+	mark_page_dirty(pager, cursor->page_num);
+	unpin_page(pager, cursor->page_num);
+
+	overflow_free(pager, old_overflow);
 }
 
-struct cursor *internal_node_find(struct table *table, uint32_t page_num, uint32_t key)
+/* return the index of the child which should contain the given key */
+uint32_t internal_node_find_child(void *node, uint32_t key)
 {
-	void *node = get_page(table->pager, page_num);
-	uint32_t child_index = internal_node_find_child(node, key);
-	uint32_t child_num = *internal_node_child(node, child_index);
-	void *child = get_page(table->pager, child_num);
+	return keys_lower_bound(internal_node_keys(node),
+			*internal_node_num_keys(node), key);
+}
 
-	switch (get_node_type(child)) {
-	case NODE_LEAF:
-		return leaf_node_find(table, child_num, key);
-	case NODE_INTERNAL:
-		return internal_node_find(table, child_num, key);
+/*
+ * Descend from the internal node page_num to the leaf of key, crabbing:
+ * each child is latched before its parent is let go, so the path can't
+ * change under us. Internal nodes are latched shared, the leaf in mode,
+ * and it's left pinned and latched for the cursor. Node types only
+ * change with the tree held exclusively, so a child's type can be read
+ * before it's latched.
+ */
+struct cursor *internal_node_find(struct table *table, uint32_t page_num,
+		uint32_t key, enum latch_mode mode)
+{
+	struct pager *pager = table->pager;
+	uint32_t high = UINT32_MAX;
+	struct cursor *cursor;
+	uint32_t low = 0;
+	void *node;
+
+	node = get_page(pager, page_num);
+	latch_page(pager, page_num, LATCH_SHARED);
+
+	while (get_node_type(node) == NODE_INTERNAL) {
+		uint32_t child_index = internal_node_find_child(node, key);
+		uint32_t child_num = *internal_node_child(node, child_index);
+		void *child = get_page(pager, child_num);
+
+		/* narrow down the range of keys the hint covers */
+		if (child_index > 0)
+			low = *internal_node_key(node, child_index - 1) + 1;
+		if (child_index < *internal_node_num_keys(node))
+			high = *internal_node_key(node, child_index);
+
+		latch_page(pager, child_num, get_node_type(child) ==
+				NODE_LEAF ? mode : LATCH_SHARED);
+		unlatch_page(pager, page_num);
+		unpin_page(pager, page_num);
+
+		page_num = child_num;
+		node = child;
 	}
 
-	return NULL;
+	cursor = leaf_node_find(table, page_num, key);
+	cursor->latched = true;
+
+	if (pager_in_snapshot())
+		return cursor;
+
+	pthread_mutex_lock(&table->hint_lock);
+	table->hint_page_num = page_num;
+	table->hint_low = low;
+	table->hint_high = high;
+	pthread_mutex_unlock(&table->hint_lock);
+
+	return cursor;
 }
 
 void internal_node_insert(struct table *table, uint32_t parent_page_num,
 		uint32_t child_page_num)
 {
 	uint32_t right_child_page_num;
-	void *right_child;
+	uint32_t original_num_keys;
+	uint32_t child_max_key;
+	uint32_t right_max_key;
+	uint32_t child_count;
+	uint32_t right_count;
+	uint32_t index;
+	void *parent;
+	void *child;
 
 	/* add a new child/key pair to parent that corresponds to child */
-	void *parent = get_page(table->pager, parent_page_num);
-	void *child = get_page(table->pager, child_page_num);
-	uint32_t child_max_key = get_node_max_key(child);
-	uint32_t index = internal_node_find_child(parent, child_max_key);
-
-	uint32_t original_num_keys = *internal_node_num_keys(parent);
-	*internal_node_num_keys(parent) = original_num_keys + 1;
+	parent = get_page(table->pager, parent_page_num);
+	original_num_keys = *internal_node_num_keys(parent);
 
-	if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-		printf("Need to implement splitting internal node\n");
-		exit(EXIT_FAILURE);
+	if (original_num_keys >= INTERNAL_NODE_MAX_CELLS(table->pager)) {
+		unpin_page(table->pager, parent_page_num);
+		internal_node_split_and_insert(table, parent_page_num,
+				child_page_num);
+		return;
 	}
 
+	child = get_page(table->pager, child_page_num);
+	child_max_key = get_node_max_key(table->pager, child);
+	child_count = node_row_count(child);
+	*node_parent(child) = parent_page_num;
+	mark_page_dirty(table->pager, child_page_num);
+	unpin_page(table->pager, child_page_num);
+
+	index = internal_node_find_child(parent, child_max_key);
+
 	right_child_page_num = *internal_node_right_child(parent);
-	right_child = get_page(table->pager, right_child_page_num);
+	right_max_key = get_node_max_key(table->pager,
+			get_page(table->pager, right_child_page_num));
+	unpin_page(table->pager, right_child_page_num);
 
-	if (child_max_key > get_node_max_key(right_child)) {
+	if (child_max_key > right_max_key) {
 		/* replace child */
-		*internal_node_child(parent, original_num_keys) =
-			right_child_page_num;
-		*internal_node_key(parent, original_num_keys) =
-			get_node_max_key(right_child);
+		right_count = *internal_node_count(parent, original_num_keys);
+		internal_node_insert_cell(parent, original_num_keys,
+				right_child_page_num, right_max_key, right_count);
 		*internal_node_right_child(parent) = child_page_num;
+		*internal_node_count(parent, original_num_keys + 1) =
+			child_count;
 	} else {
-		/* make room for the new cell */
-		for (uint32_t i = original_num_keys; i > index; i--) {
-			void *dst = internal_node_cell(parent, i);
-			void *src = internal_node_cell(parent, i - 1);
-			memcpy(dst, src, INTERNAL_NODE_CELL_SIZE);
-		}
+		internal_node_insert_cell(parent, index, child_page_num,
+				child_max_key, child_count);
+	}
 
-		*internal_node_child(parent, index) = child_page_num;
-		*internal_node_key(parent, index) = child_max_key;
+	mark_page_dirty(table->pager, parent_page_num);
+	unpin_page(table->pager, parent_page_num);
+}
+
+/*
+ * Lay out n children with their max keys and row counts in node, the
+ * last one becomes the right child and its key is dropped.
+ */
+static void internal_node_fill(void *node, const uint32_t *children,
+		const uint32_t *keys, const uint32_t *counts, uint32_t n)
+{
+	*internal_node_num_keys(node) = n - 1;
+	for (uint32_t i = 0; i < n; i++) {
+		*internal_node_child(node, i) = children[i];
+		*internal_node_count(node, i) = counts[i];
+		if (i < n - 1)
+			*internal_node_key(node, i) = keys[i];
 	}
 }
 
-struct cursor *leaf_node_find(struct table *table, uint32_t page_num,
-		uint32_t key)
+/* Whether page_num is on the right edge of the tree */
+static bool internal_node_is_rightmost(struct pager *pager, uint32_t page_num)
 {
-	struct cursor *cursor;
+	while (true) {
+		uint32_t parent_page_num;
+		uint32_t right_child;
+		void *node;
+		void *parent;
+		bool root;
+
+		node = get_page(pager, page_num);
+		root = is_node_root(node);
+		parent_page_num = *node_parent(node);
+		unpin_page(pager, page_num);
+
+		if (root)
+			return true;
+
+		parent = get_page(pager, parent_page_num);
+		right_child = *internal_node_right_child(parent);
+		unpin_page(pager, parent_page_num);
+
+		if (right_child != page_num)
+			return false;
+
+		page_num = parent_page_num;
+	}
+}
+
+/*
+ * Split a full internal node in two while adding child to it. The lower
+ * half of the children stay in place, the upper half move to a new node
+ * which then gets inserted into the parent, splitting that too if need
+ * be. Splitting the root grows the tree by one level.
+ */
+void internal_node_split_and_insert(struct table *table, uint32_t page_num,
+		uint32_t child_page_num)
+{
+	struct pager *pager = table->pager;
+	uint32_t right_child_page_num;
+	uint32_t parent_page_num;
+	uint32_t new_page_num;
+	uint32_t left_count;
+	uint32_t num_keys;
+	uint32_t child_count;
+	uint32_t child_max;
+	uint32_t *children;
+	uint32_t *counts;
+	uint32_t *keys;
+	uint32_t total;
+	uint32_t index;
+	void *old_node;
+	void *new_node;
+	void *child;
+
+	old_node = get_page(pager, page_num);
+	num_keys = *internal_node_num_keys(old_node);
+	total = num_keys + 2;
+
+	children = malloc(total * sizeof(*children));
+	counts = malloc(total * sizeof(*counts));
+	keys = malloc(total * sizeof(*keys));
+	if (!children || !counts || !keys) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* lay out every child, the new one included, with its max key */
+	for (uint32_t i = 0; i < num_keys; i++) {
+		children[i] = *internal_node_child(old_node, i);
+		counts[i] = *internal_node_count(old_node, i);
+		keys[i] = *internal_node_key(old_node, i);
+	}
+
+	right_child_page_num = *internal_node_right_child(old_node);
+	children[num_keys] = right_child_page_num;
+	counts[num_keys] = *internal_node_count(old_node, num_keys);
+	keys[num_keys] = get_node_max_key(pager,
+			get_page(pager, right_child_page_num));
+	unpin_page(pager, right_child_page_num);
+
+	child = get_page(pager, child_page_num);
+	child_max = get_node_max_key(pager, child);
+	child_count = node_row_count(child);
+	unpin_page(pager, child_page_num);
+
+	for (index = 0; index <= num_keys; index++)
+		if (keys[index] >= child_max)
+			break;
+
+	memmove(&children[index + 1], &children[index],
+			(num_keys + 1 - index) * sizeof(*children));
+	memmove(&counts[index + 1], &counts[index],
+			(num_keys + 1 - index) * sizeof(*counts));
+	memmove(&keys[index + 1], &keys[index],
+			(num_keys + 1 - index) * sizeof(*keys));
+	children[index] = child_page_num;
+	counts[index] = child_count;
+	keys[index] = child_max;
+
+	/*
+	 * Same as for leaves: when the rightmost node of a level gets a new
+	 * last child, leave it nearly full and give the new node just the
+	 * old and the new right children.
+	 */
+	if (index == total - 1 && internal_node_is_rightmost(pager, page_num))
+		left_count = total - 2;
+	else
+		left_count = (total + 1) / 2;
+
+	new_page_num = get_unused_page_num(pager);
+	new_node = get_page(pager, new_page_num);
+	initialize_internal_node(new_node);
+
+	internal_node_fill(old_node, children, keys, counts, left_count);
+	internal_node_fill(new_node, children + left_count, keys + left_count,
+			counts + left_count, total - left_count);
+
+	/* the new child may have landed in either half */
+	internal_node_adopt_children(pager, new_node, new_page_num);
+	if (index < left_count) {
+		child = get_page_in_place(pager, child_page_num);
+		*node_parent(child) = page_num;
+		mark_page_dirty(pager, child_page_num);
+		unpin_page(pager, child_page_num);
+	}
+
+	mark_page_dirty(pager, page_num);
+	mark_page_dirty(pager, new_page_num);
+
+	if (is_node_root(old_node)) {
+		create_new_root(table, new_page_num);
+		unpin_page(pager, new_page_num);
+		unpin_page(pager, page_num);
+	} else {
+		void *parent;
 
-        uint32_t one_past_max_index;
+		parent_page_num = *node_parent(old_node);
+		*node_parent(new_node) = parent_page_num;
+
+		parent = get_page(pager, parent_page_num);
+		update_internal_node_key(parent, keys[total - 1],
+				keys[left_count - 1]);
+		*internal_node_count(parent, internal_node_find_child(parent,
+					keys[left_count - 1])) =
+			node_row_count(old_node);
+		mark_page_dirty(pager, parent_page_num);
+
+		unpin_page(pager, parent_page_num);
+		unpin_page(pager, new_page_num);
+		unpin_page(pager, page_num);
+
+		internal_node_insert(table, parent_page_num, new_page_num);
+	}
+
+	free(children);
+	free(counts);
+	free(keys);
+}
+
+/* Drop a cell, leaving a hole in the heap for compaction to reclaim */
+void leaf_node_remove_cell(void *node, uint32_t cell)
+{
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint32_t *keys = leaf_node_key(node, 0);
+	uint16_t *slots = (void *) (keys + num_cells);
+	uint16_t *new_slots = (void *) (keys + num_cells - 1);
+
+	memmove(keys + cell, keys + cell + 1,
+			(num_cells - cell - 1) * LEAF_NODE_KEY_SIZE);
+	memmove(new_slots, slots, cell * LEAF_NODE_SLOT_SIZE);
+	memmove(new_slots + cell, slots + cell + 1,
+			(num_cells - cell - 1) * LEAF_NODE_SLOT_SIZE);
+
+	*leaf_node_num_cells(node) = num_cells - 1;
+	if (num_cells == 1)
+		*leaf_node_heap(node) = 0;
+}
+
+static bool node_is_underfull(struct pager *pager, void *node)
+{
+	if (get_node_type(node) == NODE_LEAF)
+		return LEAF_NODE_SPACE_FOR_CELLS(pager) -
+			leaf_node_free_space(pager, node) <
+			LEAF_NODE_MIN_FILL(pager);
+
+	return *internal_node_num_keys(node) < INTERNAL_NODE_MIN_CELLS(pager);
+}
+
+static uint32_t internal_node_child_index(void *node, uint32_t page_num)
+{
+	uint32_t num_keys = *internal_node_num_keys(node);
+	uint32_t index;
+
+	for (index = 0; index < num_keys; index++)
+		if (*internal_node_child(node, index) == page_num)
+			break;
+
+	return index;
+}
+
+/*
+ * An internal root left with nothing but its right child hands the
+ * root page over to that child, the tree shrinks by one level.
+ */
+static void collapse_root(struct table *table)
+{
+	struct pager *pager = table->pager;
+	uint32_t child_page_num;
+	void *root;
+	void *child;
+
+	root = get_page(pager, table->root_page_num);
+	if (get_node_type(root) != NODE_INTERNAL ||
+			*internal_node_num_keys(root)) {
+		unpin_page(pager, table->root_page_num);
+		return;
+	}
+
+	child_page_num = *internal_node_right_child(root);
+	child = get_page(pager, child_page_num);
+
+	memcpy(root, child, pager->page_size);
+	set_node_root(root, true);
+
+	if (get_node_type(root) == NODE_INTERNAL)
+		internal_node_adopt_children(pager, root,
+				table->root_page_num);
+
+	mark_page_dirty(pager, table->root_page_num);
+	unpin_page(pager, child_page_num);
+	unpin_page(pager, table->root_page_num);
+
+	pager_free_page(pager, child_page_num);
+}
+
+/*
+ * Copies of two leaves back to back, find the i-th cell of both of them
+ * together.
+ */
+static void *leaf_pair_cell(struct pager *pager, void *copies,
+		uint32_t num_left, uint32_t i, uint32_t *cell)
+{
+	if (i < num_left) {
+		*cell = i;
+		return copies;
+	}
+
+	*cell = i - num_left;
+	return copies + pager->page_size;
+}
+
+static uint32_t leaf_pair_cell_bytes(struct pager *pager, void *copies,
+		uint32_t num_left, uint32_t i)
+{
+	uint32_t cell;
+	void *node = leaf_pair_cell(pager, copies, num_left, i, &cell);
+
+	return LEAF_NODE_CELL_BYTES(leaf_node_value_size(node, cell));
+}
+
+/*
+ * Even out two neighbouring leaves, children index and index + 1 of
+ * parent, by their bytes. When everything fits in the left one the
+ * right one is merged into it and freed; returns whether that happened.
+ */
+static bool leaf_nodes_rebalance(struct table *table, void *parent,
+		uint32_t index)
+{
+	struct pager *pager = table->pager;
+	uint32_t left_page_num = *internal_node_child(parent, index);
+	uint32_t right_page_num = *internal_node_child(parent, index + 1);
+	uint32_t space = LEAF_NODE_SPACE_FOR_CELLS(pager);
+	uint32_t num_left;
 	uint32_t num_cells;
-	uint32_t min_index;
+	uint32_t left_count;
+	uint32_t total;
+	uint32_t bytes;
+	void *copies;
+	void *left;
+	void *right;
+	bool merge;
+
+	left = get_page(pager, left_page_num);
+	right = get_page(pager, right_page_num);
+
+	num_left = *leaf_node_num_cells(left);
+	num_cells = num_left + *leaf_node_num_cells(right);
+	total = 2 * space - leaf_node_free_space(pager, left) -
+		leaf_node_free_space(pager, right);
+	merge = total <= space;
+
+	copies = malloc(2 * pager->page_size);
+	if (!copies) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
 
-        void *node;
+	memcpy(copies, left, pager->page_size);
+	memcpy(copies + pager->page_size, right, pager->page_size);
 
-        node = get_page(table->pager, page_num);
-	num_cells = *leaf_node_num_cells(node);
+	if (merge) {
+		left_count = num_cells;
+	} else {
+		/* as even as possible, as long as both halves fit */
+		bytes = 0;
+		for (left_count = 0; left_count < num_cells &&
+				bytes * 2 < total; left_count++)
+			bytes += leaf_pair_cell_bytes(pager, copies, num_left,
+					left_count);
+
+		while (bytes > space)
+			bytes -= leaf_pair_cell_bytes(pager, copies, num_left,
+					--left_count);
+		while (total - bytes > space)
+			bytes += leaf_pair_cell_bytes(pager, copies, num_left,
+					left_count++);
+	}
 
-	one_past_max_index = num_cells;
-	min_index = 0;
+	*leaf_node_num_cells(left) = 0;
+	*leaf_node_heap(left) = 0;
+	*leaf_node_num_cells(right) = 0;
+	*leaf_node_heap(right) = 0;
 
-	cursor = malloc(sizeof(*cursor));
-	cursor->page_num = page_num;
-	cursor->table = table;
+	for (uint32_t i = 0; i < num_cells; i++) {
+		uint32_t cell;
+		void *src = leaf_pair_cell(pager, copies, num_left, i, &cell);
+		void *dst_node = i < left_count ? left : right;
+		uint32_t size = leaf_node_value_size(src, cell);
+		void *dst;
 
-	while (one_past_max_index != min_index) {
-		uint32_t key_at_index;
-		uint32_t index;
+		dst = leaf_node_insert_cell(pager, dst_node,
+				*leaf_node_num_cells(dst_node),
+				*leaf_node_key(src, cell), size);
+		memcpy(dst, leaf_node_value(src, cell), size);
+	}
 
-		index = (min_index + one_past_max_index) / 2;
-		key_at_index = *leaf_node_key(node, index);
+	free(copies);
 
-		if (key == key_at_index) {
-			cursor->cell_num = index;
-			return cursor;
-		}
+	if (merge) {
+		*leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+		internal_node_remove_cell(parent, index);
+		*internal_node_child(parent, index) = left_page_num;
+	} else {
+		*internal_node_key(parent, index) = get_node_max_key(pager,
+				left);
+		*internal_node_count(parent, index + 1) =
+			*leaf_node_num_cells(right);
+	}
 
-                if (key < key_at_index) {
-			one_past_max_index = index;
-		} else {
-			min_index = index + 1;
-		}
+	*internal_node_count(parent, index) = *leaf_node_num_cells(left);
+
+	mark_page_dirty(pager, left_page_num);
+	mark_page_dirty(pager, right_page_num);
+	unpin_page(pager, left_page_num);
+	unpin_page(pager, right_page_num);
+
+	if (merge)
+		pager_free_page(pager, right_page_num);
+
+	return merge;
+}
+
+/*
+ * Same for two neighbouring internal nodes, by their children. The
+ * parent's key between them becomes the key of the left node's right
+ * child.
+ */
+static bool internal_nodes_rebalance(struct table *table, void *parent,
+		uint32_t index)
+{
+	struct pager *pager = table->pager;
+	uint32_t left_page_num = *internal_node_child(parent, index);
+	uint32_t right_page_num = *internal_node_child(parent, index + 1);
+	uint32_t num_left;
+	uint32_t left_count;
+	uint32_t total;
+	uint32_t *children;
+	uint32_t *counts;
+	uint32_t *keys;
+	void *left;
+	void *right;
+	bool merge;
+
+	left = get_page(pager, left_page_num);
+	right = get_page(pager, right_page_num);
+
+	num_left = *internal_node_num_keys(left) + 1;
+	total = num_left + *internal_node_num_keys(right) + 1;
+	merge = total - 1 <= INTERNAL_NODE_MAX_CELLS(pager);
+
+	children = malloc(total * sizeof(*children));
+	counts = malloc(total * sizeof(*counts));
+	keys = malloc(total * sizeof(*keys));
+	if (!children || !counts || !keys) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < num_left; i++) {
+		children[i] = *internal_node_child(left, i);
+		counts[i] = *internal_node_count(left, i);
+		keys[i] = i < num_left - 1 ? *internal_node_key(left, i) :
+			*internal_node_key(parent, index);
+	}
+
+	for (uint32_t i = num_left; i < total; i++) {
+		children[i] = *internal_node_child(right, i - num_left);
+		counts[i] = *internal_node_count(right, i - num_left);
+		keys[i] = i < total - 1 ?
+			*internal_node_key(right, i - num_left) : 0;
 	}
 
-	cursor->cell_num = min_index;
+	left_count = merge ? total : total / 2;
 
-        return cursor;
+	internal_node_fill(left, children, keys, counts, left_count);
+	if (merge) {
+		internal_node_remove_cell(parent, index);
+		*internal_node_child(parent, index) = left_page_num;
+	} else {
+		internal_node_fill(right, children + left_count,
+				keys + left_count, counts + left_count,
+				total - left_count);
+		*internal_node_key(parent, index) = keys[left_count - 1];
+		*internal_node_count(parent, index + 1) =
+			node_row_count(right);
+	}
+
+	*internal_node_count(parent, index) = node_row_count(left);
+
+	mark_page_dirty(pager, left_page_num);
+	mark_page_dirty(pager, right_page_num);
+	unpin_page(pager, left_page_num);
+	unpin_page(pager, right_page_num);
+
+	/* only the children which changed sides need a new parent */
+	for (uint32_t i = left_count < num_left ? left_count : num_left;
+			i < (left_count < num_left ? num_left : left_count);
+			i++) {
+		void *child = get_page_in_place(pager, children[i]);
+
+		*node_parent(child) = i < left_count ? left_page_num :
+			right_page_num;
+		mark_page_dirty(pager, children[i]);
+		unpin_page(pager, children[i]);
+	}
+
+	free(children);
+	free(counts);
+	free(keys);
+
+	if (merge)
+		pager_free_page(pager, right_page_num);
+
+	return merge;
+}
+
+/*
+ * Fix up a node which got underfull, by evening it out with a sibling
+ * or merging the two. Merging takes a key away from the parent, which
+ * may then need fixing up in turn.
+ */
+static void node_rebalance(struct table *table, uint32_t page_num)
+{
+	struct pager *pager = table->pager;
+	uint32_t parent_page_num;
+	uint32_t index;
+	void *parent;
+	void *node;
+	bool merged;
+	bool leaf;
+
+	node = get_page(pager, page_num);
+	if (is_node_root(node)) {
+		unpin_page(pager, page_num);
+		collapse_root(table);
+		return;
+	}
+
+	leaf = get_node_type(node) == NODE_LEAF;
+	parent_page_num = *node_parent(node);
+	unpin_page(pager, page_num);
+
+	parent = get_page(pager, parent_page_num);
+	if (!*internal_node_num_keys(parent)) {
+		unpin_page(pager, parent_page_num);
+		return;
+	}
+
+	/* pair up with the right sibling, the left one for the right child */
+	index = internal_node_child_index(parent, page_num);
+	if (index == *internal_node_num_keys(parent))
+		index--;
+
+	if (leaf)
+		merged = leaf_nodes_rebalance(table, parent, index);
+	else
+		merged = internal_nodes_rebalance(table, parent, index);
+
+	mark_page_dirty(pager, parent_page_num);
+	merged = merged && (is_node_root(parent) ||
+			node_is_underfull(pager, parent));
+	unpin_page(pager, parent_page_num);
+
+	if (merged)
+		node_rebalance(table, parent_page_num);
+}
+
+/*
+ * Delete the cell under the cursor along with the overflow pages of its
+ * profile, rebalancing the tree if the leaf gets underfull.
+ */
+void leaf_node_delete(struct cursor *cursor)
+{
+	struct pager *pager = cursor->table->pager;
+	struct row row;
+	bool underfull;
+	void *node;
+
+	node = get_page(pager, cursor->page_num);
+	deserialize_row(leaf_node_value(node, cursor->cell_num), &row);
+	leaf_node_remove_cell(node, cursor->cell_num);
+	underfull = !is_node_root(node) && node_is_underfull(pager, node);
+	mark_page_dirty(pager, cursor->page_num);
+	unpin_page(pager, cursor->page_num);
+
+	overflow_free(pager, row.profile_overflow);
+	update_row_counts(cursor->table, row.id, -1);
+
+	if (underfull) {
+		/* leaves move and merge, the hint can't be trusted anymore */
+		table_drop_hint(cursor->table);
+		node_rebalance(cursor->table, cursor->page_num);
+	}
+}
+
+struct cursor *leaf_node_find(struct table *table, uint32_t page_num,
+		uint32_t key)
+{
+	struct cursor *cursor;
+	uint32_t num_cells;
+	void *node;
+
+	node = get_page(table->pager, page_num);
+	num_cells = *leaf_node_num_cells(node);
+
+	cursor = malloc(sizeof(*cursor));
+	cursor->page_num = page_num;
+	cursor->table = table;
+	cursor->end = false;
+	cursor->latched = false;
+	cursor->ra_window = 0;
+	cursor->ra_ahead = 0;
+	cursor->cell_num = keys_lower_bound(leaf_node_key(node, 0), num_cells,
+			key);
+
+	unpin_page(table->pager, page_num);
+
+	return cursor;
 }
 
 enum node_type get_node_type(void *node)
@@ -563,12 +1620,17 @@ void set_node_type(void *node, enum node_type type)
 	*((uint8_t *) (node + NODE_TYPE_OFFSET)) = value;
 }
 
+/* The profile is only printed once it has been loaded */
 void print_row(struct row *row)
 {
-	printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+	if (row->profile)
+		printf("(%d, %s, %s, %s)\n", row->id, row->username,
+				row->email, row->profile);
+	else
+		printf("(%d, %s, %s)\n", row->id, row->username, row->email);
 }
 
-void print_constants(void)
+void print_constants(struct pager *pager)
 {
 	printf("%25s: %5lu\n", "ROW_SIZE",
 			ROW_SIZE);
@@ -579,9 +1641,9 @@ void print_constants(void)
 	printf("%25s: %5lu\n", "LEAF_NODE_CELL_SIZE",
 			LEAF_NODE_CELL_SIZE);
 	printf("%25s: %5lu\n", "LEAF_NODE_SPACE_FOR_CELLS",
-			LEAF_NODE_SPACE_FOR_CELLS);
+			LEAF_NODE_SPACE_FOR_CELLS(pager));
 	printf("%25s: %5lu\n", "LEAF_NODE_MAX_CELLS",
-			LEAF_NODE_MAX_CELLS);
+			LEAF_NODE_MAX_CELLS(pager));
 }
 
 void indent(uint32_t level)
@@ -627,4 +1689,6 @@ void print_tree(struct pager *pager, uint32_t page_num, uint32_t level)
 		print_tree(pager, child, level + 1);
 		break;
 	}
+
+	unpin_page(pager, page_num);
 }
@@ -25,40 +25,74 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "pager.h"
+
 struct cursor;
 
 #define COLUMN_USERNAME_SIZE	32
 #define COLUMN_EMAIL_SIZE	255
+#define COLUMN_PROFILE_SIZE	(1 << 20)
 
+/*
+ * The profile can be far larger than a page. It's only loaded by
+ * deserialize_profile(), into memory the row owns, so profile is NULL
+ * until then.
+ */
 struct row {
 	uint32_t id;
 	char username[COLUMN_USERNAME_SIZE + 1];
 	char email[COLUMN_EMAIL_SIZE + 1];
+
+	uint32_t profile_len;
+	uint32_t profile_overflow;
+	char *profile;
 };
 
+/*
+ * Serialized rows only take the room their strings need: each string
+ * is stored after a one byte length. The profile follows with a 32-bit
+ * length and at most PROFILE_INLINE_SIZE bytes of it; longer profiles
+ * continue in a chain of overflow pages whose first page number ends
+ * the row. ROW_SIZE is the largest a row can get.
+ */
 #define attr_size(type, member)	(sizeof(((type *) 0)->member))
 #define ID_SIZE			(attr_size(struct row, id))
-#define USERNAME_SIZE		(attr_size(struct row, username))
-#define EMAIL_SIZE		(attr_size(struct row, email))
-#define ROW_SIZE		(ID_SIZE + USERNAME_SIZE + EMAIL_SIZE)
-#define PAGE_SIZE		4096
+#define STRING_LENGTH_SIZE	(sizeof(uint8_t))
+#define PROFILE_LENGTH_SIZE	(attr_size(struct row, profile_len))
+#define PROFILE_INLINE_SIZE	64
+#define PROFILE_OVERFLOW_SIZE	(attr_size(struct row, profile_overflow))
+#define ROW_SIZE		(ID_SIZE + \
+			STRING_LENGTH_SIZE + COLUMN_USERNAME_SIZE + \
+			STRING_LENGTH_SIZE + COLUMN_EMAIL_SIZE + \
+			PROFILE_LENGTH_SIZE + PROFILE_INLINE_SIZE + \
+			PROFILE_OVERFLOW_SIZE)
 
 #define ID_OFFSET		(0)
 #define USERNAME_OFFSET		(ID_OFFSET + ID_SIZE)
-#define EMAIL_OFFSET		(USERNAME_OFFSET + USERNAME_SIZE)
-
-#define TABLE_MAX_PAGES		100
-
-struct pager {
-	int fd;
-	uint32_t len;
-	uint32_t num_pages;
-	void *pages[TABLE_MAX_PAGES];
-};
 
+/*
+ * The leaf the last lookup ended in, with the range of keys its
+ * ancestors route to it, so runs of nearby keys skip the descent. A
+ * hint_page_num of 0 means there is no hint. Lookups running side by
+ * side share it under hint_lock.
+ *
+ * The tree latch is held shared by lookups and by inserts which fit in
+ * their leaf; those only change leaves, under page latches, and row
+ * counts. Anything which moves keys between nodes holds it exclusively.
+ *
+ * Large scans are split between up to scan_workers threads.
+ */
 struct table {
 	struct pager *pager;
 	uint32_t root_page_num;
+	uint32_t scan_workers;
+
+	pthread_rwlock_t latch;
+
+	pthread_mutex_t hint_lock;
+	uint32_t hint_page_num;
+	uint32_t hint_low;
+	uint32_t hint_high;
 };
 
 enum node_type {
@@ -83,20 +117,46 @@ enum node_type {
 #define LEAF_NODE_NEXT_LEAF_SIZE (sizeof(uint32_t))
 #define LEAF_NODE_NEXT_LEAF_OFFSET (LEAF_NODE_NUM_CELLS_OFFSET + \
 			LEAF_NODE_NUM_CELLS_SIZE)
+#define LEAF_NODE_HEAP_SIZE	(sizeof(uint32_t))
+#define LEAF_NODE_HEAP_OFFSET	(LEAF_NODE_NEXT_LEAF_OFFSET + \
+			LEAF_NODE_NEXT_LEAF_SIZE)
 #define LEAF_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + \
 			LEAF_NODE_NUM_CELLS_SIZE + \
-			LEAF_NODE_NEXT_LEAF_SIZE)
+			LEAF_NODE_NEXT_LEAF_SIZE + \
+			LEAF_NODE_HEAP_SIZE)
 
-/* Leaf Node Body Layout */
+/*
+ * Leaf Node Body Layout: all keys in one array, followed by an array of
+ * slots holding the offset of each value. Values are length-prefixed
+ * and allocated from the end of the page downwards. They don't move
+ * when cells are inserted, the heap is only compacted once the holes
+ * left behind are needed.
+ */
 #define LEAF_NODE_KEY_SIZE	(sizeof(uint32_t))
+#define LEAF_NODE_SLOT_SIZE	(sizeof(uint16_t))
+#define LEAF_NODE_VALUE_LENGTH_SIZE (sizeof(uint16_t))
 #define LEAF_NODE_VALUE_SIZE	(ROW_SIZE)
-#define LEAF_NODE_CELL_SIZE	(LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE)
+#define LEAF_NODE_CELL_BYTES(value_size) (LEAF_NODE_KEY_SIZE + \
+			LEAF_NODE_SLOT_SIZE + LEAF_NODE_VALUE_LENGTH_SIZE + \
+			(value_size))
+#define LEAF_NODE_CELL_SIZE	(LEAF_NODE_CELL_BYTES(LEAF_NODE_VALUE_SIZE))
 
-#define LEAF_NODE_KEY_OFFSET	(0)
-#define LEAF_NODE_VALUE_OFFSET	(LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
+/*
+ * The page size is only known at runtime, it's recorded in the file.
+ * How many cells fit depends on the rows, LEAF_NODE_MAX_CELLS is how
+ * many of the largest possible ones do.
+ */
+#define LEAF_NODE_SPACE_FOR_CELLS(pager) ((pager)->page_size - \
+			LEAF_NODE_HEADER_SIZE)
+#define LEAF_NODE_MAX_CELLS(pager) (LEAF_NODE_SPACE_FOR_CELLS(pager) / \
+			LEAF_NODE_CELL_SIZE)
 
-#define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_HEADER_SIZE)
-#define LEAF_NODE_MAX_CELLS	(LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE)
+/*
+ * Deletes rebalance nodes which drop below a third full. Splits and
+ * rebalancing leave nodes about half full, so there's some slack before
+ * the same nodes have to be touched again.
+ */
+#define LEAF_NODE_MIN_FILL(pager) (LEAF_NODE_SPACE_FOR_CELLS(pager) / 3)
 
 /* Internal Node Header Layout */
 #define INTERNAL_NODE_NUM_KEYS_SIZE (sizeof(uint32_t))
@@ -104,57 +164,94 @@ enum node_type {
 #define INTERNAL_NODE_RIGHT_CHILD_SIZE (sizeof(uint32_t))
 #define INTERNAL_NODE_RIGHT_CHILD_OFFSET (INTERNAL_NODE_NUM_KEYS_OFFSET + \
 			INTERNAL_NODE_NUM_KEYS_SIZE)
+#define INTERNAL_NODE_RIGHT_COUNT_SIZE (sizeof(uint32_t))
+#define INTERNAL_NODE_RIGHT_COUNT_OFFSET (INTERNAL_NODE_RIGHT_CHILD_OFFSET + \
+			INTERNAL_NODE_RIGHT_CHILD_SIZE)
 #define INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + \
 			INTERNAL_NODE_NUM_KEYS_SIZE + \
-			INTERNAL_NODE_RIGHT_CHILD_SIZE)
+			INTERNAL_NODE_RIGHT_CHILD_SIZE + \
+			INTERNAL_NODE_RIGHT_COUNT_SIZE)
 
-/* Internal Node Body Layout */
+/*
+ * Internal Node Body Layout: the keys in one array, followed by the
+ * children to their left, followed by how many rows each of those
+ * children holds in its subtree. The right child and its count live in
+ * the header.
+ */
 #define INTERNAL_NODE_KEY_SIZE	(sizeof(uint32_t))
 #define INTERNAL_NODE_CHILD_SIZE (sizeof(uint32_t))
+#define INTERNAL_NODE_COUNT_SIZE (sizeof(uint32_t))
 #define INTERNAL_NODE_CELL_SIZE	(INTERNAL_NODE_CHILD_SIZE + \
-			INTERNAL_NODE_KEY_SIZE)
-/* keep small for testing */
-#define INTERNAL_NODE_MAX_CELLS	3
-
-#define LEAF_NODE_RIGHT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) / 2)
-#define LEAF_NODE_LEFT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) - \
-			LEAF_NODE_RIGHT_SPLIT_COUNT)
-
-uint32_t get_unused_page_num(struct pager *pager);
-void *get_page(struct pager *pager, uint32_t page_num);
-struct pager *pager_open(const char *filename);
-void serialize_row(struct row *src, void *dst);
+			INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_COUNT_SIZE)
+#define INTERNAL_NODE_SPACE_FOR_CELLS(pager) ((pager)->page_size - \
+			INTERNAL_NODE_HEADER_SIZE)
+#define INTERNAL_NODE_MAX_CELLS(pager) (INTERNAL_NODE_SPACE_FOR_CELLS(pager) / \
+			INTERNAL_NODE_CELL_SIZE)
+#define INTERNAL_NODE_MIN_CELLS(pager) (INTERNAL_NODE_MAX_CELLS(pager) / 3)
+
+uint32_t row_size(struct row *row);
+void row_spill_profile(struct pager *pager, struct row *row);
+uint32_t serialize_row(struct row *src, void *dst);
 void deserialize_row(void *src, struct row *dst);
-struct table *db_open(const char *filename);
+void deserialize_profile(struct pager *pager, void *src, struct row *dst);
+struct table *db_open(const char *filename,
+		const struct pager_options *options);
 void db_close(struct table *table);
+void table_latch(struct table *table, enum latch_mode mode);
+void table_unlatch(struct table *table);
+void table_drop_hint(struct table *table);
 
+uint32_t *node_parent(void *node);
 bool is_node_root(void *node);
 void set_node_root(void *node, bool is_root);
 void create_new_root(struct table *table, uint32_t right_child_page_num);
+void update_row_counts(struct table *table, uint32_t key, int32_t delta);
 
 uint32_t *leaf_node_num_cells(void *node);
-void *leaf_node_cell(void *node, uint32_t cell);
 uint32_t *leaf_node_key(void *node, uint32_t cell);
+uint16_t *leaf_node_slot(void *node, uint32_t cell);
 void *leaf_node_value(void *node, uint32_t cell);
+uint32_t leaf_node_value_size(void *node, uint32_t cell);
 uint32_t *leaf_node_next_leaf(void *node);
+uint32_t *leaf_node_heap(void *node);
+uint32_t leaf_node_free_space(struct pager *pager, void *node);
+void leaf_node_compact(struct pager *pager, void *node);
+void *leaf_node_insert_cell(struct pager *pager, void *node, uint32_t cell,
+		uint32_t key, uint32_t size);
+uint32_t leaf_node_next_siblings(struct table *table, uint32_t page_num,
+		uint32_t *siblings, uint32_t max);
 void initialize_leaf_node(void *node);
 void initialize_internal_node(void *node);
 void leaf_node_split_and_insert(struct cursor *cursor, uint32_t key,
 		struct row *value);
-void leaf_node_insert(struct cursor *cursor, uint32_t key, struct row *value);
+bool leaf_node_insert(struct cursor *cursor, uint32_t key, struct row *value);
+void leaf_node_update(struct cursor *cursor, struct row *value);
+void leaf_node_remove_cell(void *node, uint32_t cell);
+void leaf_node_delete(struct cursor *cursor);
 struct cursor *leaf_node_find(struct table *table, uint32_t page_num,
 		uint32_t key);
+uint32_t *internal_node_num_keys(void *node);
+uint32_t *internal_node_right_child(void *node);
+uint32_t *internal_node_child(void *node, uint32_t child_num);
+uint32_t *internal_node_key(void *node, uint32_t key_num);
+uint32_t *internal_node_count(void *node, uint32_t child_num);
+uint32_t node_row_count(void *node);
+void internal_node_insert_cell(void *node, uint32_t index, uint32_t child,
+		uint32_t key, uint32_t count);
+void internal_node_remove_cell(void *node, uint32_t index);
 uint32_t internal_node_find_child(void *node, uint32_t key);
 struct cursor *internal_node_find(struct table *table, uint32_t page_num,
-		uint32_t key);
+		uint32_t key, enum latch_mode mode);
 void internal_node_insert(struct table *table, uint32_t parent_page_num,
 		uint32_t child_page_num);
+void internal_node_split_and_insert(struct table *table, uint32_t page_num,
+		uint32_t child_page_num);
 
 enum node_type get_node_type(void *node);
 void set_node_type(void *node, enum node_type type);
 
 void print_row(struct row *row);
-void print_constants(void);
+void print_constants(struct pager *pager);
 void print_tree(struct pager *pager, uint32_t page_num, uint32_t level);
 
 #endif /* __DB_H__ */
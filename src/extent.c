@@ -0,0 +1,247 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extent.h"
+
+static void *extent_grow(void *array, uint32_t *capacity, uint32_t needed,
+		size_t size)
+{
+	uint32_t new_capacity = *capacity ? *capacity : 16;
+
+	if (needed <= *capacity)
+		return array;
+
+	while (new_capacity < needed)
+		new_capacity *= 2;
+
+	array = realloc(array, new_capacity * size);
+	if (!array) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(array + *capacity * size, 0,
+			(new_capacity - *capacity) * size);
+	*capacity = new_capacity;
+
+	return array;
+}
+
+static void extent_add_run(struct sector_run **runs, uint32_t *num_runs,
+		uint32_t *capacity, uint32_t index, struct sector_run run)
+{
+	*runs = extent_grow(*runs, capacity, *num_runs + 1, sizeof(**runs));
+	memmove(&(*runs)[index + 1], &(*runs)[index],
+			(*num_runs - index) * sizeof(**runs));
+	(*runs)[index] = run;
+	*num_runs += 1;
+}
+
+void extent_map_init(struct extent_map *map, uint32_t first_sector)
+{
+	memset(map, 0, sizeof(*map));
+	map->end_sector = first_sector;
+}
+
+static int extent_cmp(const void *a, const void *b)
+{
+	const struct extent *ea = a;
+	const struct extent *eb = b;
+
+	if (ea->sector < eb->sector)
+		return -1;
+
+	return ea->sector > eb->sector;
+}
+
+/*
+ * Take over a map read back from disk and work out the holes between
+ * the extents it uses. reserved is in use as well though it isn't a
+ * page, it's the map itself.
+ */
+void extent_map_load(struct extent_map *map, const struct extent *extents,
+		uint32_t num_extents, const struct extent *reserved)
+{
+	struct extent *used = malloc((num_extents + 1) * sizeof(*used));
+	uint32_t num_used = 0;
+	uint32_t sector = map->end_sector;
+
+	if (!used) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	map->extents = extent_grow(map->extents, &map->extents_capacity,
+			num_extents, sizeof(*map->extents));
+	memcpy(map->extents, extents, num_extents * sizeof(*extents));
+	map->num_extents = num_extents;
+
+	for (uint32_t i = 0; i < num_extents; i++)
+		if (extents[i].length)
+			used[num_used++] = extents[i];
+
+	if (reserved->length)
+		used[num_used++] = *reserved;
+
+	qsort(used, num_used, sizeof(*used), extent_cmp);
+
+	for (uint32_t i = 0; i < num_used; i++) {
+		uint32_t end = used[i].sector + EXTENT_SECTORS(used[i].length);
+
+		if (used[i].sector > sector) {
+			struct sector_run hole = {
+				.sector = sector,
+				.count = used[i].sector - sector,
+			};
+
+			extent_add_run(&map->holes, &map->num_holes,
+					&map->holes_capacity, map->num_holes,
+					hole);
+		}
+
+		if (end > sector)
+			sector = end;
+	}
+
+	map->end_sector = sector;
+	free(used);
+}
+
+void extent_map_destroy(struct extent_map *map)
+{
+	free(map->extents);
+	free(map->holes);
+	free(map->pending);
+	memset(map, 0, sizeof(*map));
+}
+
+struct extent *extent_map_get(struct extent_map *map, uint32_t page_num)
+{
+	if (page_num >= map->num_extents)
+		return NULL;
+
+	return &map->extents[page_num];
+}
+
+void extent_map_set(struct extent_map *map, uint32_t page_num,
+		struct extent extent)
+{
+	map->extents = extent_grow(map->extents, &map->extents_capacity,
+			page_num + 1, sizeof(*map->extents));
+
+	if (page_num >= map->num_extents)
+		map->num_extents = page_num + 1;
+
+	map->extents[page_num] = extent;
+}
+
+/* First fit over the holes, extending the file when none is big enough */
+uint32_t extent_alloc(struct extent_map *map, uint32_t sectors)
+{
+	uint32_t sector;
+
+	for (uint32_t i = 0; i < map->num_holes; i++) {
+		struct sector_run *hole = &map->holes[i];
+
+		if (hole->count < sectors)
+			continue;
+
+		sector = hole->sector;
+		hole->sector += sectors;
+		hole->count -= sectors;
+
+		if (!hole->count) {
+			memmove(hole, hole + 1,
+				(map->num_holes - i - 1) * sizeof(*hole));
+			map->num_holes--;
+		}
+
+		return sector;
+	}
+
+	sector = map->end_sector;
+	map->end_sector += sectors;
+
+	return sector;
+}
+
+void extent_release(struct extent_map *map, struct extent extent)
+{
+	struct sector_run run = {
+		.sector = extent.sector,
+		.count = EXTENT_SECTORS(extent.length),
+	};
+
+	if (!run.count)
+		return;
+
+	extent_add_run(&map->pending, &map->num_pending,
+			&map->pending_capacity, map->num_pending, run);
+}
+
+static void extent_free_run(struct extent_map *map, struct sector_run run)
+{
+	uint32_t index = 0;
+
+	while (index < map->num_holes && map->holes[index].sector < run.sector)
+		index++;
+
+	extent_add_run(&map->holes, &map->num_holes, &map->holes_capacity,
+			index, run);
+
+	/* merge with the hole after, then with the one before */
+	if (index + 1 < map->num_holes && run.sector + run.count ==
+			map->holes[index + 1].sector) {
+		map->holes[index].count += map->holes[index + 1].count;
+		memmove(&map->holes[index + 1], &map->holes[index + 2],
+			(map->num_holes - index - 2) * sizeof(*map->holes));
+		map->num_holes--;
+	}
+
+	if (index > 0 && map->holes[index - 1].sector +
+			map->holes[index - 1].count == map->holes[index].sector) {
+		map->holes[index - 1].count += map->holes[index].count;
+		memmove(&map->holes[index], &map->holes[index + 1],
+			(map->num_holes - index - 1) * sizeof(*map->holes));
+		map->num_holes--;
+	}
+}
+
+/* The on-disk map no longer points at pending extents, reuse them. */
+void extent_map_commit(struct extent_map *map)
+{
+	for (uint32_t i = 0; i < map->num_pending; i++)
+		extent_free_run(map, map->pending[i]);
+
+	map->num_pending = 0;
+
+	/* a hole at the very end just means the file can shrink */
+	if (map->num_holes) {
+		struct sector_run *last = &map->holes[map->num_holes - 1];
+
+		if (last->sector + last->count == map->end_sector) {
+			map->end_sector = last->sector;
+			map->num_holes--;
+		}
+	}
+}
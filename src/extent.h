@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __EXTENT_H__
+#define __EXTENT_H__
+
+#include <stdint.h>
+
+#define EXTENT_SECTOR_SIZE	512
+#define EXTENT_SECTORS(len)	(((len) + EXTENT_SECTOR_SIZE - 1) / \
+			EXTENT_SECTOR_SIZE)
+
+/*
+ * Where a compressed page lives in the file: a run of sectors starting
+ * at sector, of which the first length bytes are used. A length of 0
+ * means the page was never written.
+ */
+struct extent {
+	uint32_t sector;
+	uint32_t length;
+};
+
+/* A run of free sectors */
+struct sector_run {
+	uint32_t sector;
+	uint32_t count;
+};
+
+/*
+ * Page-to-extent map plus a first-fit allocator over the sectors of the
+ * file. Extents given up while pages move around are only put back
+ * into holes by extent_map_commit(), once the map which stopped
+ * pointing at them has reached the disk.
+ */
+struct extent_map {
+	struct extent *extents;
+	uint32_t num_extents;
+	uint32_t extents_capacity;
+
+	struct sector_run *holes;
+	uint32_t num_holes;
+	uint32_t holes_capacity;
+
+	struct sector_run *pending;
+	uint32_t num_pending;
+	uint32_t pending_capacity;
+
+	uint32_t end_sector;
+};
+
+void extent_map_init(struct extent_map *map, uint32_t first_sector);
+void extent_map_load(struct extent_map *map, const struct extent *extents,
+		uint32_t num_extents, const struct extent *reserved);
+void extent_map_destroy(struct extent_map *map);
+
+struct extent *extent_map_get(struct extent_map *map, uint32_t page_num);
+void extent_map_set(struct extent_map *map, uint32_t page_num,
+		struct extent extent);
+
+uint32_t extent_alloc(struct extent_map *map, uint32_t sectors);
+void extent_release(struct extent_map *map, struct extent extent);
+void extent_map_commit(struct extent_map *map);
+
+#endif /* __EXTENT_H__ */
@@ -0,0 +1,236 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+
+	return value;
+}
+
+static uint32_t lz_hash(uint32_t value)
+{
+	return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Lengths which don't fit in a token nibble continue in 255-steps */
+static uint8_t *lz_put_length(uint8_t *op, uint8_t *oend, size_t len)
+{
+	while (len >= 255) {
+		if (op >= oend)
+			return NULL;
+
+		*op++ = 255;
+		len -= 255;
+	}
+
+	if (op >= oend)
+		return NULL;
+
+	*op++ = len;
+
+	return op;
+}
+
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *oend,
+		const uint8_t *literals, size_t num_literals,
+		size_t offset, size_t match_len)
+{
+	uint8_t *token;
+
+	if (op >= oend)
+		return NULL;
+
+	token = op++;
+
+	if (num_literals >= 15) {
+		*token = 15 << 4;
+		op = lz_put_length(op, oend, num_literals - 15);
+		if (!op)
+			return NULL;
+	} else {
+		*token = num_literals << 4;
+	}
+
+	if ((size_t) (oend - op) < num_literals)
+		return NULL;
+
+	memcpy(op, literals, num_literals);
+	op += num_literals;
+
+	/* the last sequence carries literals only */
+	if (!match_len)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	match_len -= LZ_MIN_MATCH;
+	if (match_len >= 15) {
+		*token |= 15;
+		op = lz_put_length(op, oend, match_len - 15);
+	} else {
+		*token |= match_len;
+	}
+
+	return op;
+}
+
+/*
+ * Compress src into dst. Returns the compressed size, or 0 when the
+ * result wouldn't fit in dst_cap bytes, in which case the caller should
+ * store the data as is.
+ */
+size_t lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const uint8_t *base = src;
+	const uint8_t *ip = base;
+	const uint8_t *anchor = base;
+	const uint8_t *iend = base + src_len;
+	uint8_t *op = dst;
+	uint8_t *oend = op + dst_cap;
+
+	memset(table, 0xff, sizeof(table));
+
+	if (src_len > LZ_MATCH_LIMIT) {
+		const uint8_t *mflimit = iend - LZ_MATCH_LIMIT;
+
+		while (ip < mflimit) {
+			uint32_t h = lz_hash(lz_read32(ip));
+			uint32_t candidate = table[h];
+			const uint8_t *ref;
+			size_t match_len;
+
+			table[h] = ip - base;
+
+			if (candidate == UINT32_MAX) {
+				ip++;
+				continue;
+			}
+
+			ref = base + candidate;
+			if (ip - ref > LZ_MAX_OFFSET ||
+					lz_read32(ref) != lz_read32(ip)) {
+				ip++;
+				continue;
+			}
+
+			match_len = LZ_MIN_MATCH;
+			while (ip + match_len < iend - LZ_LAST_LITERALS &&
+					ref[match_len] == ip[match_len])
+				match_len++;
+
+			op = lz_put_sequence(op, oend, anchor, ip - anchor,
+					ip - ref, match_len);
+			if (!op)
+				return 0;
+
+			ip += match_len;
+			anchor = ip;
+		}
+	}
+
+	op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (uint8_t *) dst;
+}
+
+static int lz_get_length(const uint8_t **ip, const uint8_t *iend,
+		size_t *len)
+{
+	uint8_t byte;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+
+	return 0;
+}
+
+/*
+ * Decompress exactly dst_len bytes. Returns 0 on success and -1 if the
+ * input is malformed or doesn't decode to dst_len bytes.
+ */
+int lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_len)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + src_len;
+	uint8_t *op = dst;
+	uint8_t *oend = op + dst_len;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t num_literals = token >> 4;
+		size_t match_len = token & 15;
+		size_t offset;
+
+		if (num_literals == 15 &&
+				lz_get_length(&ip, iend, &num_literals) < 0)
+			return -1;
+
+		if ((size_t) (iend - ip) < num_literals ||
+				(size_t) (oend - op) < num_literals)
+			return -1;
+
+		memcpy(op, ip, num_literals);
+		ip += num_literals;
+		op += num_literals;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (match_len == 15 && lz_get_length(&ip, iend, &match_len) < 0)
+			return -1;
+
+		match_len += LZ_MIN_MATCH;
+
+		if (!offset || offset > (size_t) (op - (uint8_t *) dst) ||
+				(size_t) (oend - op) < match_len)
+			return -1;
+
+		/* matches may overlap their own output, copy bytewise */
+		for (size_t i = 0; i < match_len; i++, op++)
+			*op = *(op - offset);
+	}
+
+	return op == oend ? 0 : -1;
+}
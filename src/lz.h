@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stddef.h>
+
+/*
+ * Small LZ77 codec using the LZ4 block format: a token with literal and
+ * match lengths, the literals, then a 16-bit match offset.
+ */
+#define LZ_MIN_MATCH		4
+#define LZ_HASH_BITS		12
+#define LZ_MAX_OFFSET		65535
+#define LZ_LAST_LITERALS	5
+#define LZ_MATCH_LIMIT		12
+
+size_t lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+int lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_len);
+
+#endif /* __LZ_H__ */
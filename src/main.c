@@ -21,28 +21,89 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "buffer.h"
 #include "compiler.h"
+#include "pager.h"
 
 static void print_prompt(void)
 {
 	printf("simpledb > ");
 }
 
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-m] [-u] [-d] [-H] [-z] [-w] [-c frames] "
+			"[-j workers] [-p page_size] "
+			"[-s off|normal|full] <filename>\n", name);
+	exit(EXIT_FAILURE);
+}
+
 int main(int argc, char* argv[])
 {
 	struct input_buffer *input = new_input_buffer();
+	struct pager_options options;
 	struct table *table;
+	uint32_t workers = 0;
 	char *filename;
+	int opt;
+
+	pager_default_options(&options);
+
+	while ((opt = getopt(argc, argv, "c:dHj:mp:s:uwz")) != -1) {
+		switch (opt) {
+		case 'c':
+			options.num_frames = atoi(optarg);
+			break;
+		case 'd':
+			options.direct = true;
+			break;
+		case 'H':
+			options.huge_pages = true;
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			break;
+		case 'm':
+			options.mode = PAGER_MODE_MMAP;
+			break;
+		case 'p':
+			options.page_size = atoi(optarg);
+			break;
+		case 's':
+			if (!strcmp(optarg, "off"))
+				options.durability = PAGER_DURABILITY_OFF;
+			else if (!strcmp(optarg, "normal"))
+				options.durability = PAGER_DURABILITY_NORMAL;
+			else if (!strcmp(optarg, "full"))
+				options.durability = PAGER_DURABILITY_FULL;
+			else
+				usage(argv[0]);
+			break;
+		case 'u':
+			options.io = PAGER_IO_URING;
+			break;
+		case 'w':
+			options.copy_on_write = true;
+			break;
+		case 'z':
+			options.compressed = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
 
-	if (argc < 2) {
+	if (optind >= argc) {
 		fprintf(stderr, "Must supply database filename.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	filename = argv[1];
-        table = db_open(filename);
+	filename = argv[optind];
+        table = db_open(filename, &options);
+	if (workers)
+		table->scan_workers = workers;
 
         while (true) {
 		struct statement statement;
@@ -83,6 +144,9 @@ int main(int argc, char* argv[])
 		case EXECUTE_DUPLICATE_KEY:
 			printf("Error: Duplicate key.\n");
 			break;
+		case EXECUTE_NOT_FOUND:
+			printf("Error: Key not found.\n");
+			break;
 		case EXECUTE_TABLE_FULL:
 			printf("Error: Table full.\n");
 			break;
@@ -90,5 +154,7 @@ int main(int argc, char* argv[])
 			printf("Erro: Unknown error.\n");
 			break;
 		}
+
+		free(statement.row.profile);
 	}
 }
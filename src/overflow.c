@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+
+#include "overflow.h"
+#include "pager.h"
+
+static uint32_t *overflow_next(void *page)
+{
+	return page + OVERFLOW_NEXT_OFFSET;
+}
+
+static void *overflow_data(void *page)
+{
+	return page + OVERFLOW_HEADER_SIZE;
+}
+
+/*
+ * Store len bytes in a chain of freshly allocated pages. Returns the
+ * first page of the chain; len must not be 0.
+ */
+uint32_t overflow_write(struct pager *pager, const void *data, uint32_t len)
+{
+	uint32_t first = get_unused_page_num(pager);
+	uint32_t page_num = first;
+	uint32_t next;
+
+	while (len) {
+		uint32_t chunk = len < OVERFLOW_SPACE(pager) ? len :
+			OVERFLOW_SPACE(pager);
+		void *page = get_page(pager, page_num);
+
+		memcpy(overflow_data(page), data, chunk);
+		data += chunk;
+		len -= chunk;
+
+		next = len ? get_unused_page_num(pager) : 0;
+		*overflow_next(page) = next;
+		mark_page_dirty(pager, page_num);
+		unpin_page(pager, page_num);
+
+		page_num = next;
+	}
+
+	return first;
+}
+
+void overflow_read(struct pager *pager, uint32_t page_num, void *data,
+		uint32_t len)
+{
+	uint32_t next;
+
+	while (len && page_num) {
+		uint32_t chunk = len < OVERFLOW_SPACE(pager) ? len :
+			OVERFLOW_SPACE(pager);
+		void *page = get_page_in_place(pager, page_num);
+
+		memcpy(data, overflow_data(page), chunk);
+		data += chunk;
+		len -= chunk;
+
+		next = *overflow_next(page);
+		unpin_page(pager, page_num);
+		page_num = next;
+	}
+}
+
+void overflow_free(struct pager *pager, uint32_t page_num)
+{
+	while (page_num) {
+		void *page = get_page_in_place(pager, page_num);
+		uint32_t next = *overflow_next(page);
+
+		unpin_page(pager, page_num);
+		pager_free_page(pager, page_num);
+		page_num = next;
+	}
+}
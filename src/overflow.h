@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __OVERFLOW_H__
+#define __OVERFLOW_H__
+
+#include <stdint.h>
+
+#include "pager.h"
+
+/*
+ * Overflow Page Layout: the number of the next page in the chain, 0 for
+ * the last one, followed by as much of the value as fits. The length
+ * of the whole value is kept by whoever points at the chain.
+ */
+#define OVERFLOW_NEXT_SIZE	(sizeof(uint32_t))
+#define OVERFLOW_NEXT_OFFSET	(0)
+#define OVERFLOW_HEADER_SIZE	(OVERFLOW_NEXT_SIZE)
+#define OVERFLOW_SPACE(pager)	((pager)->page_size - OVERFLOW_HEADER_SIZE)
+
+uint32_t overflow_write(struct pager *pager, const void *data, uint32_t len);
+void overflow_read(struct pager *pager, uint32_t page_num, void *data,
+		uint32_t len);
+void overflow_free(struct pager *pager, uint32_t page_num);
+
+#endif /* __OVERFLOW_H__ */
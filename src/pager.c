@@ -0,0 +1,2160 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "extent.h"
+#include "lz.h"
+#include "pager.h"
+#include "uring.h"
+#include "wal.h"
+
+static bool pager_logged(struct pager *pager)
+{
+	return pager->durability != PAGER_DURABILITY_OFF;
+}
+
+static uint32_t pager_hash(struct pager *pager, uint32_t page_num)
+{
+	/* Knuth's multiplicative hash, num_buckets is a power of two */
+	return (page_num * 2654435761u) & (pager->num_buckets - 1);
+}
+
+static struct frame *pager_lookup(struct pager *pager, uint32_t page_num)
+{
+	struct frame *frame = pager->buckets[pager_hash(pager, page_num)];
+
+	while (frame && frame->page_num != page_num)
+		frame = frame->hash_next;
+
+	return frame;
+}
+
+static void pager_hash_insert(struct pager *pager, struct frame *frame)
+{
+	uint32_t bucket = pager_hash(pager, frame->page_num);
+
+	frame->hash_next = pager->buckets[bucket];
+	pager->buckets[bucket] = frame;
+}
+
+static void pager_hash_remove(struct pager *pager, struct frame *frame)
+{
+	struct frame **link = &pager->buckets[pager_hash(pager, frame->page_num)];
+
+	while (*link != frame)
+		link = &(*link)->hash_next;
+
+	*link = frame->hash_next;
+	frame->hash_next = NULL;
+}
+
+/*
+ * Page buffers besides the arena's: shadows, and the old images they
+ * push out. Spares are chained through their first bytes.
+ */
+static void *pager_buffer_get(struct pager *pager)
+{
+	size_t align = pager->page_size > PAGER_DIRECT_ALIGN ?
+		pager->page_size : PAGER_DIRECT_ALIGN;
+	void *buffer = pager->spare;
+
+	if (buffer) {
+		memcpy(&pager->spare, buffer, sizeof(pager->spare));
+		return buffer;
+	}
+
+	if (posix_memalign(&buffer, align, pager->page_size)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return buffer;
+}
+
+static void pager_buffer_put(struct pager *pager, void *buffer)
+{
+	memcpy(buffer, &pager->spare, sizeof(pager->spare));
+	pager->spare = buffer;
+}
+
+static bool pager_in_arena(struct pager *pager, void *buffer)
+{
+	return buffer >= pager->arena &&
+		buffer < pager->arena + pager->arena_size;
+}
+
+/* The oldest image of page_num replaced after version, if any */
+static struct page_version *pager_find_version(struct pager *pager,
+		uint32_t page_num, uint64_t version)
+{
+	struct page_version *found = NULL;
+	struct page_version *v;
+
+	v = pager->version_buckets[pager_hash(pager, page_num)];
+	for (; v; v = v->hash_next)
+		if (v->page_num == page_num && v->until > version &&
+				(!found || v->until < found->until))
+			found = v;
+
+	return found;
+}
+
+static void pager_keep_version(struct pager *pager, uint32_t page_num,
+		void *data)
+{
+	struct page_version *v = malloc(sizeof(*v));
+	uint32_t bucket = pager_hash(pager, page_num);
+
+	if (!v) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	v->page_num = page_num;
+	v->until = pager->version + 1;
+	v->data = data;
+	v->hash_next = pager->version_buckets[bucket];
+	pager->version_buckets[bucket] = v;
+
+	v->next = NULL;
+	if (pager->versions_tail)
+		pager->versions_tail->next = v;
+	else
+		pager->versions = v;
+	pager->versions_tail = v;
+}
+
+/* Drop the old images no open snapshot can ask for anymore */
+static void pager_reclaim_versions(struct pager *pager)
+{
+	uint64_t oldest = UINT64_MAX;
+
+	for (struct snapshot *s = pager->snapshots; s; s = s->next)
+		if (s->version < oldest)
+			oldest = s->version;
+
+	while (pager->versions && pager->versions->until <= oldest) {
+		struct page_version *v = pager->versions;
+		struct page_version **link;
+
+		link = &pager->version_buckets[pager_hash(pager, v->page_num)];
+		while (*link != v)
+			link = &(*link)->hash_next;
+		*link = v->hash_next;
+
+		pager->versions = v->next;
+		pager_buffer_put(pager, v->data);
+		free(v);
+	}
+
+	if (!pager->versions)
+		pager->versions_tail = NULL;
+}
+
+/*
+ * Make room in a pool full of the writer's shadows: the frame takes its
+ * shadow for data, and the image snapshots see moves to an old version
+ * early, as if it had been published. The page isn't copied again for
+ * the rest of the write, pager_spilled() says so.
+ */
+static void pager_spill_shadow(struct pager *pager, struct frame *frame)
+{
+	uint32_t i = 0;
+
+	if (frame->shadow_dirty) {
+		pager_keep_version(pager, frame->page_num, frame->data);
+		frame->data = frame->shadow;
+	} else {
+		pager_buffer_put(pager, frame->shadow);
+	}
+
+	frame->shadow = NULL;
+	frame->shadow_dirty = false;
+
+	while (pager->shadow_frames[i] != frame)
+		i++;
+	pager->shadow_frames[i] =
+		pager->shadow_frames[--pager->num_shadow_frames];
+}
+
+static bool pager_spilled(struct pager *pager, uint32_t page_num)
+{
+	struct page_version *v;
+
+	v = pager->version_buckets[pager_hash(pager, page_num)];
+	for (; v; v = v->hash_next)
+		if (v->page_num == page_num && v->until == pager->version + 1)
+			return true;
+
+	return false;
+}
+
+static void pager_io_sync(struct pager *pager, struct frame **frames,
+		uint32_t n, bool write)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		off_t offset = (off_t) frames[i]->page_num * pager->page_size;
+		ssize_t bytes;
+
+		if (write)
+			bytes = pwrite(pager->fd, frames[i]->data,
+					pager->page_size, offset);
+		else
+			bytes = pread(pager->fd, frames[i]->data,
+					pager->page_size, offset);
+
+		/* a short write means the page never made it whole */
+		if (bytes < 0 || (write &&
+					bytes != (ssize_t) pager->page_size)) {
+			fprintf(stderr, "Error %s file: %s\n",
+					write ? "writing" : "reading",
+					bytes < 0 ? strerror(errno) :
+					"short write");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void pager_io_uring(struct pager *pager, struct frame **frames,
+		uint32_t n, bool write)
+{
+	struct uring_op *ops = malloc(n * sizeof(*ops));
+
+	if (!ops) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < n; i++) {
+		ops[i].write = write;
+		ops[i].buf = frames[i]->data;
+		ops[i].len = pager->page_size;
+		ops[i].offset = (off_t) frames[i]->page_num * pager->page_size;
+		ops[i].res = 0;
+	}
+
+	if (uring_run(&pager->ring, pager->fd, ops, n) < 0) {
+		fprintf(stderr, "Error submitting I/O: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < n; i++) {
+		if (ops[i].res < 0 || (write &&
+					ops[i].res != (ssize_t) ops[i].len)) {
+			fprintf(stderr, "Error %s file: %s\n",
+					write ? "writing" : "reading",
+					ops[i].res < 0 ? strerror(-ops[i].res) :
+					"short write");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(ops);
+}
+
+static void pager_pread(struct pager *pager, void *buf, size_t len,
+		off_t offset)
+{
+	if (pread(pager->fd, buf, len, offset) != (ssize_t) len) {
+		fprintf(stderr, "Error reading file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void pager_pwrite(struct pager *pager, const void *buf, size_t len,
+		off_t offset)
+{
+	if (pwrite(pager->fd, buf, len, offset) != (ssize_t) len) {
+		fprintf(stderr, "Error writing file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void pager_read_compressed(struct pager *pager, struct frame *frame)
+{
+	struct extent *extent = extent_map_get(&pager->extents,
+			frame->page_num);
+	off_t offset;
+
+	/* the header stays uncompressed at the start of the file */
+	if (frame->page_num == HEADER_PAGE_NUM) {
+		ssize_t bytes = pread(pager->fd, frame->data,
+				pager->page_size, 0);
+
+		if (bytes < 0) {
+			fprintf(stderr, "Error reading file: %s\n",
+					strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		memset(frame->data + bytes, 0, pager->page_size - bytes);
+		return;
+	}
+
+	if (!extent || !extent->length) {
+		memset(frame->data, 0, pager->page_size);
+		return;
+	}
+
+	offset = (off_t) extent->sector * EXTENT_SECTOR_SIZE;
+
+	if (extent->length == pager->page_size) {
+		pager_pread(pager, frame->data, pager->page_size, offset);
+		return;
+	}
+
+	pager_pread(pager, pager->zbuf, extent->length, offset);
+	if (lz_decompress(pager->zbuf, extent->length, frame->data,
+				pager->page_size) < 0) {
+		fprintf(stderr, "Page %d is corrupted\n", frame->page_num);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Pages which don't shrink are stored as they are. Every write goes to
+ * a fresh extent; the old one is only reused once the map on disk stops
+ * pointing at it.
+ */
+static void pager_write_compressed(struct pager *pager, struct frame *frame)
+{
+	struct extent *old = extent_map_get(&pager->extents, frame->page_num);
+	struct extent extent;
+	void *src = pager->zbuf;
+
+	if (frame->page_num == HEADER_PAGE_NUM) {
+		pager_pwrite(pager, frame->data, pager->page_size, 0);
+		return;
+	}
+
+	extent.length = lz_compress(frame->data, pager->page_size, pager->zbuf,
+			pager->page_size - 1);
+	if (!extent.length) {
+		extent.length = pager->page_size;
+		src = frame->data;
+	}
+
+	extent.sector = extent_alloc(&pager->extents,
+			EXTENT_SECTORS(extent.length));
+	pager_pwrite(pager, src, extent.length,
+			(off_t) extent.sector * EXTENT_SECTOR_SIZE);
+
+	if (old)
+		extent_release(&pager->extents, *old);
+
+	extent_map_set(&pager->extents, frame->page_num, extent);
+	pager->map_dirty = true;
+}
+
+/*
+ * Read or write a batch of frames. With io_uring the whole batch goes
+ * to the kernel in as few submissions as the ring allows, otherwise we
+ * fall back to one pread()/pwrite() per page. Compressed pages are
+ * always done one at a time since each one needs its own extent.
+ */
+static void pager_io(struct pager *pager, struct frame **frames, uint32_t n,
+		bool write)
+{
+	if (!n)
+		return;
+
+	if (pager->compressed) {
+		for (uint32_t i = 0; i < n; i++) {
+			if (write)
+				pager_write_compressed(pager, frames[i]);
+			else
+				pager_read_compressed(pager, frames[i]);
+		}
+	} else if (pager->io == PAGER_IO_URING)
+		pager_io_uring(pager, frames, n, write);
+	else
+		pager_io_sync(pager, frames, n, write);
+}
+
+static void pager_write_frames(struct pager *pager, struct frame **frames,
+		uint32_t n)
+{
+	pager_io(pager, frames, n, true);
+
+	for (uint32_t i = 0; i < n; i++) {
+		off_t end = ((off_t) frames[i]->page_num + 1) * pager->page_size;
+
+		if (end > pager->len)
+			pager->len = end;
+
+		frames[i]->dirty = false;
+	}
+}
+
+/* Reads are gathered up front, the caller still needs every frame. */
+static void pager_swap_frames(struct frame **frames, uint32_t a, uint32_t b)
+{
+	struct frame *frame = frames[a];
+
+	frames[a] = frames[b];
+	frames[b] = frame;
+}
+
+static void pager_read_frames(struct pager *pager, struct frame **frames,
+		uint32_t n)
+{
+	uint32_t num_reads = 0;
+
+	for (uint32_t i = 0; i < n; i++) {
+		struct frame *frame = frames[i];
+		off_t offset = (off_t) frame->page_num * pager->page_size;
+
+		/* the log has newer images than the file */
+		if (pager_logged(pager) && wal_lookup(&pager->wal,
+					frame->page_num)) {
+			wal_read_page(&pager->wal, frame->page_num, frame->data);
+		/* Pages past the end of the file haven't been written yet */
+		} else if (!pager->compressed && offset >= pager->len) {
+			memset(frame->data, 0, pager->page_size);
+		} else {
+			pager_swap_frames(frames, num_reads++, i);
+			continue;
+		}
+
+		if (pager_logged(pager))
+			memcpy(frame->base, frame->data, pager->page_size);
+	}
+
+	pager_io(pager, frames, num_reads, false);
+
+	for (uint32_t i = 0; pager_logged(pager) && i < num_reads; i++)
+		memcpy(frames[i]->base, frames[i]->data, pager->page_size);
+}
+
+/*
+ * CLOCK replacement: sweep the frames, giving every referenced frame a
+ * second chance, and take the first one which is neither pinned nor
+ * recently referenced. The victim is written back before being reused,
+ * as an image to the log when there is one: the file must only ever see
+ * committed pages, and the log must be able to hand the page back.
+ */
+static struct frame *pager_evict(struct pager *pager)
+{
+	for (uint32_t i = 0; i < 2 * pager->num_frames; i++) {
+		struct frame *frame = &pager->frames[pager->clock_hand];
+
+		pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+		if (!frame->valid)
+			return frame;
+
+		if (frame->pin_count)
+			continue;
+
+		if (frame->referenced) {
+			frame->referenced = false;
+			continue;
+		}
+
+		if (frame->shadow)
+			pager_spill_shadow(pager, frame);
+
+		if (pager_logged(pager) && (frame->dirty || frame->delta)) {
+			wal_append(&pager->wal, frame->page_num, frame->data,
+					NULL);
+			frame->dirty = false;
+			frame->delta = false;
+		} else if (frame->dirty) {
+			pager_write_frames(pager, &frame, 1);
+		}
+
+		pager_hash_remove(pager, frame);
+		frame->valid = false;
+
+		return frame;
+	}
+
+	fprintf(stderr, "All %d frames are pinned\n", pager->num_frames);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Pages smaller than the system's leave the mapped length off a system
+ * page boundary, and mmap() only takes aligned offsets. Remap the
+ * partial system page at the end along with the new ones instead.
+ */
+static void pager_mmap_extend(struct pager *pager, off_t len)
+{
+	off_t sys_page_size = sysconf(_SC_PAGESIZE);
+	off_t start = pager->len & ~(sys_page_size - 1);
+	off_t end = (len + sys_page_size - 1) & ~(sys_page_size - 1);
+	void *addr;
+
+	addr = mmap(pager->map + start, end - start,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			pager->fd, start);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "Error mapping file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	pager->len = len;
+}
+
+static void pager_mmap_open(struct pager *pager)
+{
+	off_t len = pager->len;
+
+	/*
+	 * Reserve the whole window now and map the file over its start,
+	 * so growing the file never moves pages callers still point to.
+	 */
+	pager->map = mmap(NULL, PAGER_MMAP_RESERVE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (pager->map == MAP_FAILED) {
+		fprintf(stderr, "Error reserving address space: %s\n",
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	pager->len = 0;
+	if (len)
+		pager_mmap_extend(pager, len);
+}
+
+static void *pager_mmap_get_page(struct pager *pager, uint32_t page_num)
+{
+	off_t end = ((off_t) page_num + 1) * pager->page_size;
+
+	if (end > pager->len) {
+		/* Grow geometrically so appends don't remap on every page */
+		off_t len = pager->len ? pager->len * 2 : 16 * pager->page_size;
+
+		if (len < end)
+			len = end;
+
+		if ((unsigned long long) len > PAGER_MMAP_RESERVE) {
+			fprintf(stderr, "Page number out of bounds --> %d\n",
+					page_num);
+			exit(EXIT_FAILURE);
+		}
+
+		if (ftruncate(pager->fd, len) < 0) {
+			fprintf(stderr, "Error growing file: %s\n",
+					strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		pager_mmap_extend(pager, len);
+	}
+
+	if (page_num >= pager->num_pages)
+		pager->num_pages = page_num + 1;
+
+	return pager->map + (off_t) page_num * pager->page_size;
+}
+
+static void pager_mmap_sync(struct pager *pager)
+{
+	if (!pager->len)
+		return;
+
+	if (msync(pager->map, pager->len, MS_SYNC) < 0) {
+		fprintf(stderr, "Error syncing file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void pager_mmap_close(struct pager *pager)
+{
+	pager_mmap_sync(pager);
+	munmap(pager->map, PAGER_MMAP_RESERVE);
+
+	/* Drop the slack left over from growing the mapping */
+	if (ftruncate(pager->fd, (off_t) pager->num_pages * pager->page_size) < 0) {
+		fprintf(stderr, "Error truncating file: %s\n",
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Give back whatever the file no longer uses at its end */
+static void pager_compressed_close(struct pager *pager)
+{
+	off_t len = (off_t) pager->extents.end_sector * EXTENT_SECTOR_SIZE;
+
+	if (len < pager->page_size)
+		len = pager->page_size;
+
+	if (ftruncate(pager->fd, len) < 0) {
+		fprintf(stderr, "Error truncating file: %s\n",
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	extent_map_destroy(&pager->extents);
+	free(pager->zbuf);
+}
+
+/* Take a frame for page_num and make it visible to lookups. */
+static struct frame *pager_claim_frame(struct pager *pager, uint32_t page_num)
+{
+	struct frame *frame = pager_evict(pager);
+
+	frame->page_num = page_num;
+	frame->pin_count = 0;
+	frame->referenced = false;
+	frame->dirty = false;
+	frame->delta = false;
+	frame->valid = true;
+	pager_hash_insert(pager, frame);
+
+	if (page_num >= pager->num_pages)
+		pager->num_pages = page_num + 1;
+
+	return frame;
+}
+
+static uint32_t *header_freelist_trunk(void *header)
+{
+	return header + HEADER_FREELIST_TRUNK_OFFSET;
+}
+
+static uint32_t *header_freelist_count(void *header)
+{
+	return header + HEADER_FREELIST_COUNT_OFFSET;
+}
+
+static uint32_t *header_version(void *header)
+{
+	return header + HEADER_VERSION_OFFSET;
+}
+
+static uint32_t *header_page_size(void *header)
+{
+	return header + HEADER_PAGE_SIZE_OFFSET;
+}
+
+static uint32_t *header_root_page(void *header)
+{
+	return header + HEADER_ROOT_PAGE_OFFSET;
+}
+
+static uint32_t *header_flags(void *header)
+{
+	return header + HEADER_FLAGS_OFFSET;
+}
+
+static uint32_t *header_map_sector(void *header)
+{
+	return header + HEADER_MAP_SECTOR_OFFSET;
+}
+
+static uint32_t *header_map_length(void *header)
+{
+	return header + HEADER_MAP_LENGTH_OFFSET;
+}
+
+static uint32_t *freelist_next_trunk(void *trunk)
+{
+	return trunk + FREELIST_NEXT_TRUNK_OFFSET;
+}
+
+static uint32_t *freelist_num_leaves(void *trunk)
+{
+	return trunk + FREELIST_NUM_LEAVES_OFFSET;
+}
+
+static uint32_t *freelist_leaf(void *trunk, uint32_t leaf)
+{
+	return trunk + FREELIST_HEADER_SIZE + leaf * FREELIST_LEAF_SIZE;
+}
+
+/*
+ * Allocate a page, reusing one from the freelist when there is one and
+ * extending the file otherwise. Reused pages keep their old contents,
+ * callers are expected to initialize them.
+ */
+uint32_t get_unused_page_num(struct pager *pager)
+{
+	uint32_t trunk_page_num;
+	uint32_t page_num;
+	void *header;
+	void *trunk;
+
+	/* the header's latch serializes allocations */
+	header = get_page(pager, HEADER_PAGE_NUM);
+	latch_page(pager, HEADER_PAGE_NUM, LATCH_EXCLUSIVE);
+	trunk_page_num = *header_freelist_trunk(header);
+
+	if (!trunk_page_num) {
+		pthread_mutex_lock(&pager->table_lock);
+		page_num = pager->num_pages++;
+		pthread_mutex_unlock(&pager->table_lock);
+		unlatch_page(pager, HEADER_PAGE_NUM);
+		unpin_page(pager, HEADER_PAGE_NUM);
+		return page_num;
+	}
+
+	trunk = get_page(pager, trunk_page_num);
+
+	if (*freelist_num_leaves(trunk)) {
+		*freelist_num_leaves(trunk) -= 1;
+		page_num = *freelist_leaf(trunk, *freelist_num_leaves(trunk));
+		mark_page_dirty(pager, trunk_page_num);
+	} else {
+		/* trunk is empty, hand out the trunk itself */
+		page_num = trunk_page_num;
+		*header_freelist_trunk(header) = *freelist_next_trunk(trunk);
+	}
+
+	*header_freelist_count(header) -= 1;
+	mark_page_dirty(pager, HEADER_PAGE_NUM);
+
+	unpin_page(pager, trunk_page_num);
+	unlatch_page(pager, HEADER_PAGE_NUM);
+	unpin_page(pager, HEADER_PAGE_NUM);
+
+	return page_num;
+}
+
+/* Return a page which is no longer referenced to the freelist. */
+void pager_free_page(struct pager *pager, uint32_t page_num)
+{
+	uint32_t trunk_page_num;
+	void *header;
+	void *trunk;
+
+	header = get_page(pager, HEADER_PAGE_NUM);
+	latch_page(pager, HEADER_PAGE_NUM, LATCH_EXCLUSIVE);
+	trunk_page_num = *header_freelist_trunk(header);
+
+	if (trunk_page_num) {
+		trunk = get_page(pager, trunk_page_num);
+
+		if (*freelist_num_leaves(trunk) < FREELIST_MAX_LEAVES(pager)) {
+			*freelist_leaf(trunk, *freelist_num_leaves(trunk)) =
+				page_num;
+			*freelist_num_leaves(trunk) += 1;
+			mark_page_dirty(pager, trunk_page_num);
+			unpin_page(pager, trunk_page_num);
+			goto out;
+		}
+
+		unpin_page(pager, trunk_page_num);
+	}
+
+	/* no room left in the current trunk, the page becomes a new one */
+	trunk = get_page(pager, page_num);
+	*freelist_next_trunk(trunk) = trunk_page_num;
+	*freelist_num_leaves(trunk) = 0;
+	mark_page_dirty(pager, page_num);
+	unpin_page(pager, page_num);
+
+	*header_freelist_trunk(header) = page_num;
+
+out:
+	*header_freelist_count(header) += 1;
+	mark_page_dirty(pager, HEADER_PAGE_NUM);
+	unlatch_page(pager, HEADER_PAGE_NUM);
+	unpin_page(pager, HEADER_PAGE_NUM);
+}
+
+/* Root page of the tree, 0 until one has been created */
+uint32_t pager_get_root(struct pager *pager)
+{
+	void *header = get_page(pager, HEADER_PAGE_NUM);
+	uint32_t root = *header_root_page(header);
+
+	unpin_page(pager, HEADER_PAGE_NUM);
+
+	return root;
+}
+
+void pager_set_root(struct pager *pager, uint32_t page_num)
+{
+	void *header = get_page(pager, HEADER_PAGE_NUM);
+
+	*header_root_page(header) = page_num;
+	mark_page_dirty(pager, HEADER_PAGE_NUM);
+	unpin_page(pager, HEADER_PAGE_NUM);
+}
+
+static void pager_sync(struct pager *pager)
+{
+	if (fsync(pager->fd) < 0) {
+		fprintf(stderr, "Error syncing file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static bool page_size_valid(uint32_t page_size)
+{
+	if (page_size < PAGER_MIN_PAGE_SIZE || page_size > PAGER_MAX_PAGE_SIZE)
+		return false;
+
+	return !(page_size & (page_size - 1));
+}
+
+/*
+ * Check the header of an existing file and pick up its page size and
+ * flags. This runs before the buffer pool exists, since the pool's
+ * frames have to be sized after it.
+ */
+static void pager_read_header(struct pager *pager)
+{
+	char header[HEADER_SIZE];
+	ssize_t bytes;
+
+	bytes = pread(pager->fd, header, HEADER_SIZE, 0);
+	if (bytes < 0) {
+		fprintf(stderr, "Error reading file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (bytes < (ssize_t) HEADER_SIZE || memcmp(header + HEADER_MAGIC_OFFSET,
+				HEADER_MAGIC, sizeof(HEADER_MAGIC))) {
+		fprintf(stderr, "Not a simpledb file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (*header_version(header) != PAGER_FORMAT_VERSION) {
+		fprintf(stderr, "Unsupported format version %d\n",
+				*header_version(header));
+		exit(EXIT_FAILURE);
+	}
+
+	pager->page_size = *header_page_size(header);
+	if (!page_size_valid(pager->page_size)) {
+		fprintf(stderr, "Invalid page size %d\n", pager->page_size);
+		exit(EXIT_FAILURE);
+	}
+
+	pager->compressed = *header_flags(header) & HEADER_FLAG_COMPRESSED;
+	pager->map_extent.sector = *header_map_sector(header);
+	pager->map_extent.length = *header_map_length(header);
+}
+
+/* Read back the page-to-extent map of a compressed file */
+static void pager_load_extents(struct pager *pager)
+{
+	uint32_t num_extents = pager->map_extent.length /
+		sizeof(struct extent);
+	struct extent *extents = NULL;
+
+	if (num_extents) {
+		extents = malloc(pager->map_extent.length);
+		if (!extents) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		pager_pread(pager, extents, pager->map_extent.length,
+				(off_t) pager->map_extent.sector *
+				EXTENT_SECTOR_SIZE);
+	}
+
+	extent_map_load(&pager->extents, extents, num_extents,
+			&pager->map_extent);
+	free(extents);
+
+	pager->num_pages = num_extents ? num_extents : 1;
+}
+
+/*
+ * Write the map to a fresh extent and point the header at it. Only
+ * then can the extents pages moved away from be handed out again.
+ */
+static void pager_write_extents(struct pager *pager)
+{
+	uint32_t length = pager->num_pages * sizeof(struct extent);
+	struct extent *extents;
+	struct frame *frame;
+	void *header;
+
+	extents = calloc(pager->num_pages, sizeof(*extents));
+	if (!extents) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < pager->num_pages; i++) {
+		struct extent *extent = extent_map_get(&pager->extents, i);
+
+		if (extent)
+			extents[i] = *extent;
+	}
+
+	extent_release(&pager->extents, pager->map_extent);
+	pager->map_extent.sector = extent_alloc(&pager->extents,
+			EXTENT_SECTORS(length));
+	pager->map_extent.length = length;
+	pager_pwrite(pager, extents, length,
+			(off_t) pager->map_extent.sector * EXTENT_SECTOR_SIZE);
+	free(extents);
+
+	header = get_page(pager, HEADER_PAGE_NUM);
+	*header_map_sector(header) = pager->map_extent.sector;
+	*header_map_length(header) = pager->map_extent.length;
+	frame = pager_lookup(pager, HEADER_PAGE_NUM);
+	pager_write_frames(pager, &frame, 1);
+	unpin_page(pager, HEADER_PAGE_NUM);
+
+	extent_map_commit(&pager->extents);
+	pager->map_dirty = false;
+}
+
+/*
+ * Write a fresh header into an empty file. With a log it goes straight
+ * to the file as well, recovery needs the file to say what it is.
+ */
+static void pager_init_header(struct pager *pager)
+{
+	void *header = get_page(pager, HEADER_PAGE_NUM);
+
+	memset(header, 0, pager->page_size);
+	memcpy(header + HEADER_MAGIC_OFFSET, HEADER_MAGIC,
+			sizeof(HEADER_MAGIC));
+	*header_version(header) = PAGER_FORMAT_VERSION;
+	*header_page_size(header) = pager->page_size;
+	if (pager->compressed)
+		*header_flags(header) |= HEADER_FLAG_COMPRESSED;
+	mark_page_dirty(pager, HEADER_PAGE_NUM);
+
+	if (pager_logged(pager)) {
+		struct frame *frame = pager_lookup(pager, HEADER_PAGE_NUM);
+
+		pager_write_frames(pager, &frame, 1);
+		memcpy(frame->base, frame->data, pager->page_size);
+		pager_sync(pager);
+	}
+
+	unpin_page(pager, HEADER_PAGE_NUM);
+}
+
+/* The snapshot the calling thread reads from, if any */
+static __thread struct snapshot *current_snapshot;
+
+/* The writer's copy of a frame, made the first time it asks for it */
+static void *pager_shadow(struct pager *pager, struct frame *frame)
+{
+	if (!frame->shadow) {
+		frame->shadow = pager_buffer_get(pager);
+		memcpy(frame->shadow, frame->data, pager->page_size);
+		pager->shadow_frames[pager->num_shadow_frames++] = frame;
+	}
+
+	return frame->shadow;
+}
+
+/*
+ * Start a write: the caller is the only writer until pager_publish().
+ * Pages past the end of the file as of now are new, no snapshot can
+ * reach them and they are changed in place.
+ */
+void pager_write_begin(struct pager *pager)
+{
+	if (!pager->cow)
+		return;
+
+	pthread_mutex_lock(&pager->table_lock);
+	pager->writing = true;
+	pager->published_pages = pager->num_pages;
+	pthread_mutex_unlock(&pager->table_lock);
+}
+
+/*
+ * Make everything written since pager_write_begin() the next version,
+ * all at once as far as snapshots starting from now are concerned.
+ */
+void pager_publish(struct pager *pager)
+{
+	if (!pager->writing)
+		return;
+
+	pthread_mutex_lock(&pager->table_lock);
+
+	for (uint32_t i = 0; i < pager->num_shadow_frames; i++) {
+		struct frame *frame = pager->shadow_frames[i];
+
+		if (!frame->shadow_dirty) {
+			pager_buffer_put(pager, frame->shadow);
+		} else if (pager->snapshots) {
+			pager_keep_version(pager, frame->page_num, frame->data);
+			frame->data = frame->shadow;
+		} else {
+			pager_buffer_put(pager, frame->data);
+			frame->data = frame->shadow;
+		}
+
+		frame->shadow = NULL;
+		frame->shadow_dirty = false;
+	}
+
+	pager->num_shadow_frames = 0;
+	pager->version++;
+	pager->writing = false;
+
+	/* with no snapshots open, spilled images aren't needed anymore */
+	pager_reclaim_versions(pager);
+
+	pthread_mutex_unlock(&pager->table_lock);
+}
+
+/*
+ * Read from the last published version until pager_snapshot_end(),
+ * whatever the writer does meanwhile. Every page the thread gets is
+ * the snapshot's, it must not change any.
+ */
+static void pager_snapshot_open(struct pager *pager,
+		const struct snapshot *parent)
+{
+	struct snapshot *snapshot = calloc(1, sizeof(*snapshot));
+
+	if (!snapshot) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&pager->table_lock);
+	snapshot->version = parent ? parent->version : pager->version;
+	snapshot->next = pager->snapshots;
+	pager->snapshots = snapshot;
+	pthread_mutex_unlock(&pager->table_lock);
+
+	current_snapshot = snapshot;
+}
+
+void pager_snapshot_begin(struct pager *pager)
+{
+	pager_snapshot_open(pager, NULL);
+}
+
+/*
+ * Read the version another thread's snapshot reads, for as long as that
+ * one stays open. Each thread holds its own pages.
+ */
+void pager_snapshot_join(struct pager *pager, const struct snapshot *snapshot)
+{
+	pager_snapshot_open(pager, snapshot);
+}
+
+void pager_snapshot_end(struct pager *pager)
+{
+	struct snapshot *snapshot = current_snapshot;
+	struct snapshot **link;
+
+	if (snapshot->num_pages) {
+		fprintf(stderr, "Snapshot ended with page %d pinned\n",
+				snapshot->pages[0].page_num);
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&pager->table_lock);
+
+	link = &pager->snapshots;
+	while (*link != snapshot)
+		link = &(*link)->next;
+	*link = snapshot->next;
+
+	pager_reclaim_versions(pager);
+
+	pthread_mutex_unlock(&pager->table_lock);
+
+	current_snapshot = NULL;
+	free(snapshot->pages);
+	free(snapshot);
+}
+
+bool pager_in_snapshot(void)
+{
+	return current_snapshot;
+}
+
+struct snapshot *pager_current_snapshot(void)
+{
+	return current_snapshot;
+}
+
+/*
+ * A page as the snapshot sees it: an old image if the page was replaced
+ * since, the frame's otherwise. Asking again for a page the snapshot
+ * holds gives the same image back.
+ */
+static void *pager_snapshot_get(struct pager *pager, uint32_t page_num)
+{
+	struct snapshot *snapshot = current_snapshot;
+	struct snapshot_page *page;
+	struct page_version *version;
+	struct frame *frame;
+
+	for (uint32_t i = 0; i < snapshot->num_pages; i++) {
+		if (snapshot->pages[i].page_num == page_num) {
+			snapshot->pages[i].pins++;
+			return snapshot->pages[i].data;
+		}
+	}
+
+	if (snapshot->num_pages == snapshot->capacity) {
+		snapshot->capacity = snapshot->capacity ?
+			snapshot->capacity * 2 : 8;
+		snapshot->pages = realloc(snapshot->pages, snapshot->capacity *
+				sizeof(*snapshot->pages));
+		if (!snapshot->pages) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	page = &snapshot->pages[snapshot->num_pages++];
+	page->page_num = page_num;
+	page->pins = 1;
+
+	/* no transaction to keep commits and checkpoints off a miss's I/O */
+	pthread_rwlock_rdlock(&pager->lock);
+	pthread_mutex_lock(&pager->table_lock);
+
+	version = pager_find_version(pager, page_num, snapshot->version);
+	page->pooled = !version;
+
+	if (version) {
+		page->data = version->data;
+	} else {
+		frame = pager_lookup(pager, page_num);
+		if (!frame) {
+			frame = pager_claim_frame(pager, page_num);
+			pager_read_frames(pager, &frame, 1);
+		}
+
+		frame->pin_count++;
+		frame->referenced = true;
+		page->data = frame->data;
+	}
+
+	pthread_mutex_unlock(&pager->table_lock);
+	pthread_rwlock_unlock(&pager->lock);
+
+	return page->data;
+}
+
+static void pager_snapshot_put(struct pager *pager, uint32_t page_num)
+{
+	struct snapshot *snapshot = current_snapshot;
+
+	for (uint32_t i = 0; i < snapshot->num_pages; i++) {
+		struct snapshot_page *page = &snapshot->pages[i];
+
+		if (page->page_num != page_num)
+			continue;
+
+		if (--page->pins)
+			return;
+
+		if (page->pooled) {
+			pthread_rwlock_rdlock(&pager->lock);
+			pthread_mutex_lock(&pager->table_lock);
+			pager_lookup(pager, page_num)->pin_count--;
+			pthread_mutex_unlock(&pager->table_lock);
+			pthread_rwlock_unlock(&pager->lock);
+		}
+
+		*page = snapshot->pages[--snapshot->num_pages];
+		return;
+	}
+
+	fprintf(stderr, "Tried to unpin page %d which isn't pinned\n",
+			page_num);
+	exit(EXIT_FAILURE);
+}
+
+static void *pager_get(struct pager *pager, uint32_t page_num, bool shadow)
+{
+	struct frame *frame;
+	void *data;
+
+	if (pager->mode == PAGER_MODE_MMAP)
+		return pager_mmap_get_page(pager, page_num);
+
+	if (current_snapshot)
+		return pager_snapshot_get(pager, page_num);
+
+	pthread_mutex_lock(&pager->table_lock);
+
+	frame = pager_lookup(pager, page_num);
+	if (!frame) {
+		/* Cache miss: grab a frame and load from file. */
+		frame = pager_claim_frame(pager, page_num);
+		pager_read_frames(pager, &frame, 1);
+	}
+
+	frame->pin_count++;
+	frame->referenced = true;
+
+	data = frame->shadow ? frame->shadow : frame->data;
+	if (shadow && pager->writing && page_num < pager->published_pages &&
+			!pager_spilled(pager, page_num))
+		data = pager_shadow(pager, frame);
+
+	pthread_mutex_unlock(&pager->table_lock);
+
+	return data;
+}
+
+void *get_page(struct pager *pager, uint32_t page_num)
+{
+	return pager_get(pager, page_num, true);
+}
+
+/*
+ * For pages the writer only reads, or changes in what snapshots never
+ * read, like the parent of a node: there's no need to copy the page
+ * for those. Moving half the children of a node would copy all of them
+ * otherwise.
+ */
+void *get_page_in_place(struct pager *pager, uint32_t page_num)
+{
+	return pager_get(pager, page_num, false);
+}
+
+void unpin_page(struct pager *pager, uint32_t page_num)
+{
+	struct frame *frame;
+
+	if (pager->mode == PAGER_MODE_MMAP)
+		return;
+
+	if (current_snapshot) {
+		pager_snapshot_put(pager, page_num);
+		return;
+	}
+
+	pthread_mutex_lock(&pager->table_lock);
+
+	frame = pager_lookup(pager, page_num);
+	if (!frame || !frame->pin_count) {
+		fprintf(stderr, "Tried to unpin page %d which isn't pinned\n",
+				page_num);
+		exit(EXIT_FAILURE);
+	}
+
+	frame->pin_count--;
+
+	pthread_mutex_unlock(&pager->table_lock);
+}
+
+/* The frame of a page the caller has pinned, for latching it */
+static struct frame *pager_pinned_frame(struct pager *pager,
+		uint32_t page_num)
+{
+	struct frame *frame;
+
+	pthread_mutex_lock(&pager->table_lock);
+
+	frame = pager_lookup(pager, page_num);
+	if (!frame || !frame->pin_count) {
+		fprintf(stderr, "Tried to latch page %d which isn't pinned\n",
+				page_num);
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_unlock(&pager->table_lock);
+
+	return frame;
+}
+
+/*
+ * Latch a pinned page, shared to read it or exclusive to change it. A
+ * latch is dropped with unlatch_page() before the page is unpinned.
+ * Mapped files have no frames to latch, their callers serialize on
+ * their own, and snapshots have nothing to fear from writers.
+ */
+void latch_page(struct pager *pager, uint32_t page_num, enum latch_mode mode)
+{
+	struct frame *frame;
+
+	if (pager->mode == PAGER_MODE_MMAP || current_snapshot)
+		return;
+
+	frame = pager_pinned_frame(pager, page_num);
+
+	if (mode == LATCH_EXCLUSIVE)
+		pthread_rwlock_wrlock(&frame->latch);
+	else
+		pthread_rwlock_rdlock(&frame->latch);
+}
+
+void unlatch_page(struct pager *pager, uint32_t page_num)
+{
+	if (pager->mode == PAGER_MODE_MMAP || current_snapshot)
+		return;
+
+	pthread_rwlock_unlock(&pager_pinned_frame(pager, page_num)->latch);
+}
+
+/*
+ * Latches which let writers in ahead of readers queued after them, a
+ * steady stream of readers would starve them otherwise.
+ */
+void pager_latch_init(pthread_rwlock_t *latch)
+{
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(latch, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+void mark_page_dirty(struct pager *pager, uint32_t page_num)
+{
+	struct frame *frame;
+
+	/* The kernel tracks dirty pages of a shared mapping for us */
+	if (pager->mode == PAGER_MODE_MMAP)
+		return;
+
+	pthread_mutex_lock(&pager->table_lock);
+
+	frame = pager_lookup(pager, page_num);
+	if (!frame || !frame->pin_count) {
+		fprintf(stderr, "Tried to dirty page %d which isn't pinned\n",
+				page_num);
+		exit(EXIT_FAILURE);
+	}
+
+	frame->dirty = true;
+	if (frame->shadow)
+		frame->shadow_dirty = true;
+
+	/* so commits don't have to sweep the whole pool for dirty frames */
+	if (pager_logged(pager) && !frame->in_txn) {
+		frame->in_txn = true;
+		pager->txn_frames[pager->num_txn_frames++] = frame;
+	}
+
+	pthread_mutex_unlock(&pager->table_lock);
+}
+
+static int page_num_cmp(const void *a, const void *b)
+{
+	uint32_t pa = *(const uint32_t *) a;
+	uint32_t pb = *(const uint32_t *) b;
+
+	if (pa < pb)
+		return -1;
+
+	return pa > pb;
+}
+
+static int frame_cmp(const void *a, const void *b)
+{
+	const struct frame *fa = *(struct frame * const *) a;
+	const struct frame *fb = *(struct frame * const *) b;
+
+	if (fa->page_num < fb->page_num)
+		return -1;
+
+	return fa->page_num > fb->page_num;
+}
+
+/* Start a transaction, waiting for any commit or checkpoint to finish */
+void pager_begin(struct pager *pager)
+{
+	pthread_rwlock_rdlock(&pager->lock);
+}
+
+/*
+ * Log every page the transaction dirtied which hasn't been evicted to
+ * the log already, followed by a commit frame.
+ */
+static void pager_log_commit(struct pager *pager)
+{
+	struct wal *wal = &pager->wal;
+
+	qsort(pager->txn_frames, pager->num_txn_frames,
+			sizeof(*pager->txn_frames), frame_cmp);
+
+	for (uint32_t i = 0; i < pager->num_txn_frames; i++) {
+		struct frame *frame = pager->txn_frames[i];
+
+		/* evicted since, its image is in the log already */
+		frame->in_txn = false;
+		if (!frame->valid || !frame->dirty)
+			continue;
+
+		switch (wal_append(wal, frame->page_num, frame->data,
+					frame->base)) {
+		case WAL_RECORD_NONE:
+			break;
+		case WAL_RECORD_DELTA:
+			frame->delta = true;
+			break;
+		case WAL_RECORD_IMAGE:
+			frame->delta = false;
+			break;
+		}
+
+		memcpy(frame->base, frame->data, pager->page_size);
+		frame->dirty = false;
+	}
+
+	pager->num_txn_frames = 0;
+
+	if (!wal->pending)
+		return;
+
+	wal_commit(wal, pager->num_pages,
+			pager->durability == PAGER_DURABILITY_FULL);
+
+	/* the checkpointer fell behind, catch up in one go */
+	if (wal->num_frames >= WAL_CHECKPOINT_FRAMES)
+		pager_checkpoint(pager);
+	else if (wal->num_frames >= WAL_CHECKPOINT_FRAMES / 2)
+		pthread_cond_signal(&pager->cond);
+}
+
+/*
+ * End the transaction started by pager_begin(). Without a log the
+ * pages reach the file on their own. With one, whoever gets to log
+ * first commits what every statement finished so far dirtied, the
+ * others find nothing left to do.
+ */
+void pager_commit(struct pager *pager)
+{
+	pthread_rwlock_unlock(&pager->lock);
+
+	if (!pager_logged(pager))
+		return;
+
+	pthread_rwlock_wrlock(&pager->lock);
+	pager_log_commit(pager);
+	pthread_rwlock_unlock(&pager->lock);
+}
+
+/*
+ * Copy up to max pages the file is behind on from the log, in page
+ * order, and once there are none left sync the file and start the log
+ * over. Has to run between transactions, when cached pages hold what
+ * was last committed. The log is made durable first so the file never
+ * gets ahead of it: a crash halfway through redoes the whole log.
+ */
+static void pager_backfill(struct pager *pager, uint32_t max)
+{
+	struct wal *wal = &pager->wal;
+	uint32_t page_nums[CHECKPOINT_MIN_BATCH];
+	uint32_t n;
+
+	if (wal->len == WAL_HEADER_SIZE && !pager->map_dirty)
+		return;
+
+	wal_sync(wal);
+
+	while (max && (n = wal_take_backlog(wal, page_nums,
+				max < CHECKPOINT_MIN_BATCH ?
+				max : CHECKPOINT_MIN_BATCH))) {
+		qsort(page_nums, n, sizeof(*page_nums), page_num_cmp);
+
+		for (uint32_t i = 0; i < n; i++) {
+			struct frame *frame = pager_lookup(pager, page_nums[i]);
+			struct frame copy;
+
+			if (!frame) {
+				copy.page_num = page_nums[i];
+				copy.data = pager->scratch;
+				wal_read_page(wal, page_nums[i], pager->scratch);
+				frame = &copy;
+			}
+
+			pager_write_frames(pager, &frame, 1);
+		}
+
+		max -= n;
+	}
+
+	if (wal_backlog(wal))
+		return;
+
+	if (pager->map_dirty)
+		pager_write_extents(pager);
+
+	pager_sync(pager);
+	wal_reset(wal, pager->page_size);
+
+	for (uint32_t i = 0; i < pager->num_frames; i++)
+		pager->frames[i].delta = false;
+}
+
+/* Bring the file up to date with the log and start the log over. */
+void pager_checkpoint(struct pager *pager)
+{
+	if (pager_logged(pager))
+		pager_backfill(pager, UINT32_MAX);
+}
+
+static uint32_t pager_count_dirty(struct pager *pager)
+{
+	uint32_t num_dirty = 0;
+
+	for (uint32_t i = 0; i < pager->num_frames; i++)
+		if (pager->frames[i].valid && pager->frames[i].dirty)
+			num_dirty++;
+
+	return num_dirty;
+}
+
+/*
+ * Without a log: write back up to max dirty frames, picking up the
+ * sweep where the last one stopped, as a single batch.
+ */
+static void pager_write_dirty(struct pager *pager, uint32_t max)
+{
+	struct frame **dirty = pager->txn_frames;
+	uint32_t num_dirty = 0;
+
+	for (uint32_t i = 0; i < pager->num_frames && num_dirty < max; i++) {
+		struct frame *frame = &pager->frames[pager->flush_hand];
+
+		pager->flush_hand = (pager->flush_hand + 1) % pager->num_frames;
+
+		if (frame->valid && frame->dirty && !frame->pin_count)
+			dirty[num_dirty++] = frame;
+	}
+
+	qsort(dirty, num_dirty, sizeof(*dirty), frame_cmp);
+	pager_write_frames(pager, dirty, num_dirty);
+}
+
+/*
+ * One round of background checkpointing: copy a share of the backlog,
+ * the log's or the dirty frames', to the file. Returns how long to
+ * wait before the next round, less the fuller the log or the pool.
+ */
+static uint32_t pager_trickle(struct pager *pager)
+{
+	uint32_t backlog;
+	uint32_t batch;
+	uint32_t fill;
+
+	if (pager_logged(pager)) {
+		backlog = wal_backlog(&pager->wal);
+		fill = pager->wal.num_frames * 100 / WAL_CHECKPOINT_FRAMES;
+	} else {
+		backlog = pager_count_dirty(pager);
+		fill = backlog * 100 / pager->num_frames;
+	}
+
+	if (fill > 100)
+		fill = 100;
+
+	batch = backlog / CHECKPOINT_SLICES;
+	if (batch < CHECKPOINT_MIN_BATCH)
+		batch = CHECKPOINT_MIN_BATCH;
+
+	if (pager_logged(pager))
+		pager_backfill(pager, batch);
+	else if (backlog)
+		pager_write_dirty(pager, batch);
+
+	return CHECKPOINT_MIN_INTERVAL_MS + (CHECKPOINT_MAX_INTERVAL_MS -
+			CHECKPOINT_MIN_INTERVAL_MS) * (100 - fill) / 100;
+}
+
+static void *pager_checkpointer(void *arg)
+{
+	struct pager *pager = arg;
+	uint32_t wait_ms = CHECKPOINT_MAX_INTERVAL_MS;
+
+	pthread_mutex_lock(&pager->cond_lock);
+
+	while (!pager->stop) {
+		struct timespec deadline;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += wait_ms / 1000;
+		deadline.tv_nsec += (long) (wait_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait(&pager->cond, &pager->cond_lock,
+				&deadline);
+		if (pager->stop)
+			break;
+
+		pthread_mutex_unlock(&pager->cond_lock);
+		pthread_rwlock_wrlock(&pager->lock);
+
+		/* statements which ended but haven't logged yet go first */
+		if (pager_logged(pager))
+			pager_log_commit(pager);
+
+		wait_ms = pager_trickle(pager);
+		pthread_rwlock_unlock(&pager->lock);
+		pthread_mutex_lock(&pager->cond_lock);
+	}
+
+	pthread_mutex_unlock(&pager->cond_lock);
+
+	return NULL;
+}
+
+/* Write back every dirty frame in ascending page order. */
+void pager_flush_all(struct pager *pager)
+{
+	struct frame **dirty;
+	uint32_t num_dirty = 0;
+
+	if (pager->mode == PAGER_MODE_MMAP) {
+		pager_mmap_sync(pager);
+		return;
+	}
+
+	if (pager_logged(pager)) {
+		pager_log_commit(pager);
+		pager_checkpoint(pager);
+		return;
+	}
+
+	dirty = malloc(pager->num_frames * sizeof(*dirty));
+	if (!dirty) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < pager->num_frames; i++) {
+		struct frame *frame = &pager->frames[i];
+
+		if (frame->valid && frame->dirty)
+			dirty[num_dirty++] = frame;
+	}
+
+	qsort(dirty, num_dirty, sizeof(*dirty), frame_cmp);
+	pager_write_frames(pager, dirty, num_dirty);
+
+	if (pager->map_dirty)
+		pager_write_extents(pager);
+
+	free(dirty);
+}
+
+/* Ask the kernel to start reading pages we'll want soon. */
+static void pager_advise(struct pager *pager, const uint32_t *page_nums,
+		uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		off_t offset = (off_t) page_nums[i] * pager->page_size;
+
+		if (pager->compressed) {
+			struct extent *extent = extent_map_get(&pager->extents,
+					page_nums[i]);
+
+			if (extent && extent->length &&
+					!pager_lookup(pager, page_nums[i]))
+				posix_fadvise(pager->fd, (off_t) extent->sector *
+						EXTENT_SECTOR_SIZE,
+						extent->length,
+						POSIX_FADV_WILLNEED);
+			continue;
+		}
+
+		if (offset >= pager->len)
+			continue;
+
+		if (pager->mode == PAGER_MODE_MMAP)
+			madvise(pager->map + offset, pager->page_size, MADV_WILLNEED);
+		else if (!pager_lookup(pager, page_nums[i]))
+			posix_fadvise(pager->fd, offset, pager->page_size,
+					POSIX_FADV_WILLNEED);
+	}
+}
+
+/*
+ * Start loading whichever of the given pages aren't cached yet. With
+ * io_uring they are read into frames as a single batch, left unpinned;
+ * at most half of the pool is handed over so prefetching can't starve
+ * the pinned working set. Otherwise we only hint the kernel so the
+ * reads happen in the background.
+ */
+void pager_prefetch(struct pager *pager, const uint32_t *page_nums,
+		uint32_t n)
+{
+	struct frame **frames;
+	uint32_t num_reads = 0;
+
+	if (pager->mode == PAGER_MODE_MMAP || pager->io != PAGER_IO_URING) {
+		if (current_snapshot)
+			pthread_rwlock_rdlock(&pager->lock);
+		pthread_mutex_lock(&pager->table_lock);
+		pager_advise(pager, page_nums, n);
+		pthread_mutex_unlock(&pager->table_lock);
+		if (current_snapshot)
+			pthread_rwlock_unlock(&pager->lock);
+		return;
+	}
+
+	if (n > pager->num_frames / 2)
+		n = pager->num_frames / 2;
+
+	frames = malloc(n * sizeof(*frames));
+	if (!frames) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* like pager_snapshot_get(), from outside a transaction */
+	if (current_snapshot)
+		pthread_rwlock_rdlock(&pager->lock);
+	pthread_mutex_lock(&pager->table_lock);
+
+	for (uint32_t i = 0; i < n; i++) {
+		struct frame *frame;
+
+		if (pager_lookup(pager, page_nums[i]))
+			continue;
+
+		/* keep the frames we already took away from pager_evict() */
+		frame = pager_claim_frame(pager, page_nums[i]);
+		frame->pin_count = 1;
+		frames[num_reads++] = frame;
+	}
+
+	pager_read_frames(pager, frames, num_reads);
+
+	for (uint32_t i = 0; i < num_reads; i++) {
+		frames[i]->pin_count = 0;
+		frames[i]->referenced = true;
+	}
+
+	pthread_mutex_unlock(&pager->table_lock);
+	if (current_snapshot)
+		pthread_rwlock_unlock(&pager->lock);
+
+	free(frames);
+}
+
+/*
+ * All frames live in one page-aligned arena, which is what O_DIRECT
+ * needs. With huge_pages we first try explicit hugetlb pages and then
+ * settle for asking for transparent huge pages.
+ */
+static void pager_arena_alloc(struct pager *pager, bool huge_pages)
+{
+	size_t size = (size_t) pager->num_frames * pager->page_size;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	pager->arena = MAP_FAILED;
+
+	if (huge_pages) {
+		size_t huge_size = (size + PAGER_HUGE_PAGE_SIZE - 1) &
+			~((size_t) PAGER_HUGE_PAGE_SIZE - 1);
+
+		pager->arena = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+				flags | MAP_HUGETLB, -1, 0);
+		if (pager->arena != MAP_FAILED)
+			size = huge_size;
+	}
+
+	if (pager->arena == MAP_FAILED) {
+		pager->arena = mmap(NULL, size, PROT_READ | PROT_WRITE, flags,
+				-1, 0);
+		if (pager->arena == MAP_FAILED) {
+			fprintf(stderr, "Error allocating buffer pool: %s\n",
+					strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		if (huge_pages)
+			madvise(pager->arena, size, MADV_HUGEPAGE);
+	}
+
+	pager->arena_size = size;
+}
+
+/*
+ * Bypass the kernel's page cache so pages are only cached once, in our
+ * frames. Filesystems which can't do O_DIRECT (tmpfs, for one) keep
+ * using buffered I/O.
+ */
+static void pager_direct_open(struct pager *pager)
+{
+	int flags = fcntl(pager->fd, F_GETFL);
+
+	if (pager->page_size % PAGER_DIRECT_ALIGN) {
+		fprintf(stderr, "O_DIRECT needs pages of at least %d bytes\n",
+				PAGER_DIRECT_ALIGN);
+		exit(EXIT_FAILURE);
+	}
+
+	if (flags >= 0)
+		fcntl(pager->fd, F_SETFL, flags | O_DIRECT);
+}
+
+static void pager_frames_open(struct pager *pager,
+		const struct pager_options *options)
+{
+	/* Fall back to pread()/pwrite() where io_uring isn't available */
+	if (pager->io == PAGER_IO_URING &&
+			uring_init(&pager->ring, URING_ENTRIES) < 0)
+		pager->io = PAGER_IO_SYNC;
+
+	if (options->direct)
+		pager_direct_open(pager);
+
+	pager->num_frames = options->num_frames;
+	pager->frames = calloc(pager->num_frames, sizeof(*pager->frames));
+	pager->clock_hand = 0;
+
+	pager_arena_alloc(pager, options->huge_pages);
+	for (uint32_t i = 0; pager->frames && i < pager->num_frames; i++) {
+		pager->frames[i].data = pager->arena +
+			(size_t) i * pager->page_size;
+		pager_latch_init(&pager->frames[i].latch);
+	}
+
+	/* deltas are taken against a second copy of every frame */
+	pager->base_arena = NULL;
+	if (pager_logged(pager) && posix_memalign(&pager->base_arena,
+				sizeof(uint64_t), (size_t) pager->num_frames *
+				pager->page_size)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; pager->base_arena && pager->frames &&
+			i < pager->num_frames; i++)
+		pager->frames[i].base = pager->base_arena +
+			(size_t) i * pager->page_size;
+
+	pager->txn_frames = calloc(pager->num_frames,
+			sizeof(*pager->txn_frames));
+	pager->num_txn_frames = 0;
+
+	pager->shadow_frames = calloc(pager->num_frames,
+			sizeof(*pager->shadow_frames));
+	pager->num_shadow_frames = 0;
+
+	/* log images on their way to the file, aligned for O_DIRECT */
+	pager->scratch = NULL;
+	if (pager_logged(pager) && posix_memalign(&pager->scratch,
+				pager->page_size, pager->page_size)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pager->num_buckets = 1;
+	while (pager->num_buckets < pager->num_frames)
+		pager->num_buckets <<= 1;
+	pager->buckets = calloc(pager->num_buckets, sizeof(*pager->buckets));
+	pager->version_buckets = calloc(pager->num_buckets,
+			sizeof(*pager->version_buckets));
+
+	if (!pager->frames || !pager->buckets || !pager->txn_frames ||
+			!pager->shadow_frames || !pager->version_buckets) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void *pager_recover_get(void *arg, uint32_t page_num)
+{
+	struct pager *pager = arg;
+
+	if (page_num >= pager->num_pages)
+		pager->num_pages = page_num + 1;
+
+	return get_page(pager, page_num);
+}
+
+static void pager_recover_put(void *arg, uint32_t page_num)
+{
+	struct pager *pager = arg;
+
+	mark_page_dirty(pager, page_num);
+	unpin_page(pager, page_num);
+}
+
+/*
+ * Redo the committed part of a log left behind by a crash. The pages
+ * are written back as if there were no log, then the file is synced
+ * before the log may be started over.
+ */
+static void pager_recover(struct pager *pager)
+{
+	enum pager_durability durability = pager->durability;
+	struct wal *wal = &pager->wal;
+
+	if (!wal->page_size || wal->committed <= (off_t) WAL_HEADER_SIZE)
+		return;
+
+	if (wal->page_size != pager->page_size) {
+		fprintf(stderr, "Log doesn't match the database\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (wal->db_pages > pager->num_pages)
+		pager->num_pages = wal->db_pages;
+
+	pager->durability = PAGER_DURABILITY_OFF;
+	wal_replay(wal, pager_recover_get, pager_recover_put, pager);
+	pager_flush_all(pager);
+	pager_sync(pager);
+	pager->durability = durability;
+
+	for (uint32_t i = 0; pager_logged(pager) && i < pager->num_frames; i++)
+		memcpy(pager->frames[i].base, pager->frames[i].data,
+				pager->page_size);
+}
+
+void pager_default_options(struct pager_options *options)
+{
+	options->mode = PAGER_MODE_READ_WRITE;
+	options->io = PAGER_IO_SYNC;
+	options->num_frames = PAGER_DEFAULT_FRAMES;
+	options->page_size = PAGER_DEFAULT_PAGE_SIZE;
+	options->direct = false;
+	options->huge_pages = false;
+	options->compressed = false;
+	options->durability = PAGER_DURABILITY_NORMAL;
+	options->copy_on_write = false;
+}
+
+struct pager *pager_open(const char *filename,
+		const struct pager_options *options)
+{
+	struct pager *pager;
+	bool has_log;
+	off_t len;
+	int fd;
+
+	/* a split pins a handful of pages at once */
+	if (options->num_frames < PAGER_MIN_FRAMES) {
+		fprintf(stderr, "Buffer pool needs at least %d frames\n",
+				PAGER_MIN_FRAMES);
+		exit(EXIT_FAILURE);
+	}
+
+	fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+	if (fd == -1) {
+		fprintf(stderr, "Unable to open file %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	len = lseek(fd, 0, SEEK_END);
+	pager = malloc(sizeof(*pager));
+	pthread_mutex_init(&pager->table_lock, NULL);
+	pager_latch_init(&pager->lock);
+	pthread_mutex_init(&pager->cond_lock, NULL);
+	pthread_cond_init(&pager->cond, NULL);
+	pager->mode = options->mode;
+	pager->io = options->io;
+	pager->fd = fd;
+	pager->len = len;
+	pager->map = NULL;
+	pager->frames = NULL;
+	pager->num_frames = 0;
+	pager->buckets = NULL;
+	pager->txn_frames = NULL;
+	pager->scratch = NULL;
+	pager->compressed = options->compressed;
+	pager->map_extent.sector = 0;
+	pager->map_extent.length = 0;
+	pager->zbuf = NULL;
+	pager->map_dirty = false;
+	pager->cow = options->copy_on_write &&
+		options->mode != PAGER_MODE_MMAP;
+	pager->writing = false;
+	pager->version = 0;
+	pager->published_pages = 0;
+	pager->shadow_frames = NULL;
+	pager->version_buckets = NULL;
+	pager->versions = NULL;
+	pager->versions_tail = NULL;
+	pager->snapshots = NULL;
+	pager->spare = NULL;
+
+	/* the mapping writes pages back behind our back, it can't log */
+	pager->durability = options->mode == PAGER_MODE_MMAP ?
+		PAGER_DURABILITY_OFF : options->durability;
+
+	if (len) {
+		pager_read_header(pager);
+	} else if (page_size_valid(options->page_size)) {
+		pager->page_size = options->page_size;
+	} else {
+		fprintf(stderr, "Page size must be a power of two between "
+				"%d and %d\n", PAGER_MIN_PAGE_SIZE,
+				PAGER_MAX_PAGE_SIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	if (pager->compressed && (pager->mode == PAGER_MODE_MMAP ||
+				options->direct)) {
+		fprintf(stderr, "Compressed files can't be mapped or "
+				"opened with O_DIRECT\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * A log left by a crash is recovered whatever the durability. It's
+	 * only opened once there's nothing left to refuse the file for, so
+	 * rejected files never gain a log.
+	 */
+	has_log = pager_logged(pager) || wal_exists(filename);
+	if (has_log)
+		wal_open(&pager->wal, filename);
+
+	if (pager->compressed) {
+		pager->zbuf = malloc(pager->page_size);
+		if (!pager->zbuf) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		extent_map_init(&pager->extents,
+				EXTENT_SECTORS(pager->page_size));
+		pager->num_pages = 0;
+
+		if (len)
+			pager_load_extents(pager);
+	} else {
+		pager->num_pages = len / pager->page_size;
+
+		if (len % pager->page_size) {
+			printf("Db file is not aligned to PAGE_SIZE\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (pager->mode == PAGER_MODE_MMAP) {
+		pager_mmap_open(pager);
+	} else {
+		pager_frames_open(pager, options);
+	}
+
+	if (!pager->num_pages)
+		pager_init_header(pager);
+	else if (has_log)
+		pager_recover(pager);
+
+	if (pager_logged(pager))
+		wal_reset(&pager->wal, pager->page_size);
+	else if (has_log)
+		wal_close(&pager->wal, true);
+
+	pager->stop = false;
+	pager->checkpointing = false;
+	pager->flush_hand = 0;
+
+	if (pager->mode != PAGER_MODE_MMAP) {
+		if (pthread_create(&pager->checkpointer, NULL,
+					pager_checkpointer, pager)) {
+			fprintf(stderr, "Unable to start checkpointer\n");
+			exit(EXIT_FAILURE);
+		}
+
+		pager->checkpointing = true;
+	}
+
+	return pager;
+}
+
+/*
+ * Publishing swaps buffers in and out of the frames, free those which
+ * aren't part of the arena wherever they ended up.
+ */
+static void pager_cow_close(struct pager *pager)
+{
+	while (pager->versions) {
+		struct page_version *v = pager->versions;
+
+		pager->versions = v->next;
+		if (!pager_in_arena(pager, v->data))
+			free(v->data);
+		free(v);
+	}
+
+	for (uint32_t i = 0; i < pager->num_frames; i++)
+		if (!pager_in_arena(pager, pager->frames[i].data))
+			free(pager->frames[i].data);
+
+	while (pager->spare) {
+		void *buffer = pager->spare;
+
+		memcpy(&pager->spare, buffer, sizeof(pager->spare));
+		if (!pager_in_arena(pager, buffer))
+			free(buffer);
+	}
+}
+
+void pager_close(struct pager *pager)
+{
+	int ret;
+
+	if (pager->checkpointing) {
+		pthread_mutex_lock(&pager->cond_lock);
+		pager->stop = true;
+		pthread_cond_signal(&pager->cond);
+		pthread_mutex_unlock(&pager->cond_lock);
+		pthread_join(pager->checkpointer, NULL);
+	}
+
+	if (pager->mode == PAGER_MODE_MMAP) {
+		pager_mmap_close(pager);
+	} else {
+		pager_flush_all(pager);
+		pager_cow_close(pager);
+		munmap(pager->arena, pager->arena_size);
+		free(pager->base_arena);
+
+		if (pager->compressed)
+			pager_compressed_close(pager);
+
+		if (pager->io == PAGER_IO_URING)
+			uring_exit(&pager->ring);
+	}
+
+	ret = close(pager->fd);
+	if (ret < 0) {
+		fprintf(stderr, "Error closing db file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* everything was checkpointed by pager_flush_all() */
+	if (pager_logged(pager))
+		wal_close(&pager->wal, true);
+
+	pthread_cond_destroy(&pager->cond);
+	pthread_mutex_destroy(&pager->cond_lock);
+	pthread_rwlock_destroy(&pager->lock);
+	pthread_mutex_destroy(&pager->table_lock);
+
+	free(pager->buckets);
+	free(pager->version_buckets);
+	free(pager->shadow_frames);
+	free(pager->txn_frames);
+	free(pager->scratch);
+	free(pager->frames);
+	free(pager);
+}
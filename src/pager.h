@@ -0,0 +1,323 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PAGER_H__
+#define __PAGER_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "extent.h"
+#include "uring.h"
+#include "wal.h"
+
+#define PAGER_DEFAULT_PAGE_SIZE	4096
+#define PAGER_MIN_PAGE_SIZE	1024
+#define PAGER_MAX_PAGE_SIZE	65536
+#define PAGER_FORMAT_VERSION	5
+#define PAGER_DEFAULT_FRAMES	1024
+#define PAGER_MIN_FRAMES	8
+
+/*
+ * The background checkpointer copies a share of the pages the file is
+ * behind on at a time, at least CHECKPOINT_MIN_BATCH, so a backlog is
+ * gone after about CHECKPOINT_SLICES rounds. Rounds come closer
+ * together as the log fills up.
+ */
+#define CHECKPOINT_MIN_BATCH	16
+#define CHECKPOINT_SLICES	8
+#define CHECKPOINT_MIN_INTERVAL_MS 1
+#define CHECKPOINT_MAX_INTERVAL_MS 100
+
+/* Page 0 holds the file header */
+#define HEADER_PAGE_NUM		0
+#define HEADER_MAGIC		"simpledb format"
+#define HEADER_MAGIC_SIZE	16
+#define HEADER_MAGIC_OFFSET	(0)
+#define HEADER_FREELIST_TRUNK_SIZE (sizeof(uint32_t))
+#define HEADER_FREELIST_TRUNK_OFFSET (HEADER_MAGIC_OFFSET + HEADER_MAGIC_SIZE)
+#define HEADER_FREELIST_COUNT_SIZE (sizeof(uint32_t))
+#define HEADER_FREELIST_COUNT_OFFSET (HEADER_FREELIST_TRUNK_OFFSET + \
+			HEADER_FREELIST_TRUNK_SIZE)
+#define HEADER_VERSION_SIZE	(sizeof(uint32_t))
+#define HEADER_VERSION_OFFSET	(HEADER_FREELIST_COUNT_OFFSET + \
+			HEADER_FREELIST_COUNT_SIZE)
+#define HEADER_PAGE_SIZE_SIZE	(sizeof(uint32_t))
+#define HEADER_PAGE_SIZE_OFFSET	(HEADER_VERSION_OFFSET + HEADER_VERSION_SIZE)
+#define HEADER_ROOT_PAGE_SIZE	(sizeof(uint32_t))
+#define HEADER_ROOT_PAGE_OFFSET	(HEADER_PAGE_SIZE_OFFSET + \
+			HEADER_PAGE_SIZE_SIZE)
+#define HEADER_FLAGS_SIZE	(sizeof(uint32_t))
+#define HEADER_FLAGS_OFFSET	(HEADER_ROOT_PAGE_OFFSET + \
+			HEADER_ROOT_PAGE_SIZE)
+#define HEADER_MAP_SECTOR_SIZE	(sizeof(uint32_t))
+#define HEADER_MAP_SECTOR_OFFSET (HEADER_FLAGS_OFFSET + HEADER_FLAGS_SIZE)
+#define HEADER_MAP_LENGTH_SIZE	(sizeof(uint32_t))
+#define HEADER_MAP_LENGTH_OFFSET (HEADER_MAP_SECTOR_OFFSET + \
+			HEADER_MAP_SECTOR_SIZE)
+#define HEADER_SIZE		(HEADER_MAP_LENGTH_OFFSET + \
+			HEADER_MAP_LENGTH_SIZE)
+
+/*
+ * Compressed files keep every page but the header in a variable-sized
+ * extent; the page-to-extent map is stored in an extent of its own.
+ */
+#define HEADER_FLAG_COMPRESSED	(1 << 0)
+
+/*
+ * Freelist trunk page: a chain of trunks, each listing free "leaf"
+ * pages. The trunk page itself is free as well and is handed out last.
+ */
+#define FREELIST_NEXT_TRUNK_SIZE (sizeof(uint32_t))
+#define FREELIST_NEXT_TRUNK_OFFSET (0)
+#define FREELIST_NUM_LEAVES_SIZE (sizeof(uint32_t))
+#define FREELIST_NUM_LEAVES_OFFSET (FREELIST_NEXT_TRUNK_OFFSET + \
+			FREELIST_NEXT_TRUNK_SIZE)
+#define FREELIST_HEADER_SIZE	(FREELIST_NEXT_TRUNK_SIZE + \
+			FREELIST_NUM_LEAVES_SIZE)
+#define FREELIST_LEAF_SIZE	(sizeof(uint32_t))
+#define FREELIST_MAX_LEAVES(pager) (((pager)->page_size - \
+			FREELIST_HEADER_SIZE) / FREELIST_LEAF_SIZE)
+
+#define PAGER_DIRECT_ALIGN	4096
+#define PAGER_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+/* Address space reserved up front so the mapping never has to move */
+#define PAGER_MMAP_RESERVE	(1ULL << 36)
+
+enum pager_mode {
+	PAGER_MODE_READ_WRITE,
+	PAGER_MODE_MMAP,
+};
+
+enum pager_io {
+	PAGER_IO_SYNC,
+	PAGER_IO_URING,
+};
+
+/*
+ * off: pages go straight back to the file and nothing is fsynced.
+ * normal: commits go through the log and survive the process dying;
+ * the log is only fsynced when checkpointed into the file.
+ * full: every commit is fsynced before it returns.
+ */
+enum pager_durability {
+	PAGER_DURABILITY_OFF,
+	PAGER_DURABILITY_NORMAL,
+	PAGER_DURABILITY_FULL,
+};
+
+enum latch_mode {
+	LATCH_SHARED,
+	LATCH_EXCLUSIVE,
+};
+
+/*
+ * A frame is one slot of the buffer pool. While pin_count is non-zero
+ * the frame can't be evicted and the pointer returned by get_page()
+ * stays valid. Only frames marked dirty are ever written back. Pinning
+ * only keeps the page in memory, threads reading or changing what's in
+ * it hold its latch as well.
+ *
+ * When there is a log, base holds the page as of its last log record
+ * and commits only log how data differs from it. A frame with delta
+ * set has been logged as deltas since its last image, so it needs an
+ * image written before it can be evicted. in_txn frames are on the
+ * pager's list of frames the open transaction dirtied.
+ *
+ * In copy-on-write mode the writer gets shadow instead of data, and
+ * data only changes when the shadow is published, or spilled to make
+ * room in the pool.
+ */
+struct frame {
+	uint32_t page_num;
+	uint32_t pin_count;
+	bool referenced;
+	bool dirty;
+	bool valid;
+	bool delta;
+	bool in_txn;
+	void *data;
+	void *base;
+	void *shadow;
+	bool shadow_dirty;
+	struct frame *hash_next;
+	pthread_rwlock_t latch;
+};
+
+/*
+ * The image a page had before the write which published version until
+ * replaced it, kept while snapshots older than that are open.
+ */
+struct page_version {
+	uint32_t page_num;
+	uint64_t until;
+	void *data;
+	struct page_version *hash_next;
+	struct page_version *next;
+};
+
+/* A page a snapshot holds, from a frame or from an old version */
+struct snapshot_page {
+	uint32_t page_num;
+	uint32_t pins;
+	bool pooled;
+	void *data;
+};
+
+/*
+ * A reader's view of the file as of a version. It reads without any
+ * latches: what it sees never changes, writers only ever replace pages.
+ */
+struct snapshot {
+	uint64_t version;
+	struct snapshot *next;
+	struct snapshot_page *pages;
+	uint32_t num_pages;
+	uint32_t capacity;
+};
+
+struct pager_options {
+	enum pager_mode mode;
+	enum pager_io io;
+	uint32_t num_frames;
+	/* only used when creating a new file */
+	uint32_t page_size;
+	/* O_DIRECT and a hugepage-backed pool, ignored in mmap mode */
+	bool direct;
+	bool huge_pages;
+	/* only used when creating a new file, needs PAGER_MODE_READ_WRITE */
+	bool compressed;
+	/* mapped files are always PAGER_DURABILITY_OFF */
+	enum pager_durability durability;
+	/* snapshot reads next to a single writer, ignored in mmap mode */
+	bool copy_on_write;
+};
+
+struct pager {
+	enum pager_mode mode;
+	enum pager_io io;
+	struct uring ring;
+	int fd;
+	off_t len;
+	uint32_t page_size;
+	uint32_t num_pages;
+
+	/* PAGER_MODE_MMAP: the file is mapped at map, len bytes of it */
+	void *map;
+
+	struct frame *frames;
+	uint32_t num_frames;
+	uint32_t clock_hand;
+	void *arena;
+	size_t arena_size;
+	void *base_arena;
+
+	struct frame **buckets;
+	uint32_t num_buckets;
+
+	/*
+	 * The page table: guards the buckets, the clock, pin counts and
+	 * dirty flags, and with them every read and write of a frame.
+	 */
+	pthread_mutex_t table_lock;
+
+	/* compressed files: where each page and the map itself live */
+	bool compressed;
+	struct extent_map extents;
+	struct extent map_extent;
+	bool map_dirty;
+	void *zbuf;
+
+	/*
+	 * Unless durability is off, dirty pages only ever go to the log;
+	 * the file itself is written by pager_checkpoint().
+	 */
+	enum pager_durability durability;
+	struct wal wal;
+	struct frame **txn_frames;
+	uint32_t num_txn_frames;
+
+	/*
+	 * Shared from pager_begin() to pager_commit(), so statements run
+	 * side by side. Logging a commit and checkpointing take it
+	 * exclusively, which only ever happens between statements.
+	 */
+	pthread_rwlock_t lock;
+	pthread_mutex_t cond_lock;
+	pthread_cond_t cond;
+	/* not started for mapped files */
+	pthread_t checkpointer;
+	bool checkpointing;
+	bool stop;
+	uint32_t flush_hand;
+	void *scratch;
+
+	/*
+	 * Copy-on-write: while writing, pages which existed when the write
+	 * began are shadowed, and pager_publish() swaps them all in as the
+	 * next version. The images they replace go to versions, oldest
+	 * first, for as long as an older snapshot is open.
+	 */
+	bool cow;
+	bool writing;
+	uint64_t version;
+	uint32_t published_pages;
+	struct frame **shadow_frames;
+	uint32_t num_shadow_frames;
+	struct page_version **version_buckets;
+	struct page_version *versions;
+	struct page_version *versions_tail;
+	struct snapshot *snapshots;
+	void *spare;
+};
+
+void pager_default_options(struct pager_options *options);
+struct pager *pager_open(const char *filename,
+		const struct pager_options *options);
+void pager_close(struct pager *pager);
+
+uint32_t get_unused_page_num(struct pager *pager);
+void pager_free_page(struct pager *pager, uint32_t page_num);
+uint32_t pager_get_root(struct pager *pager);
+void pager_set_root(struct pager *pager, uint32_t page_num);
+void *get_page(struct pager *pager, uint32_t page_num);
+void *get_page_in_place(struct pager *pager, uint32_t page_num);
+void unpin_page(struct pager *pager, uint32_t page_num);
+void mark_page_dirty(struct pager *pager, uint32_t page_num);
+void latch_page(struct pager *pager, uint32_t page_num, enum latch_mode mode);
+void unlatch_page(struct pager *pager, uint32_t page_num);
+void pager_latch_init(pthread_rwlock_t *latch);
+void pager_flush_all(struct pager *pager);
+void pager_begin(struct pager *pager);
+void pager_commit(struct pager *pager);
+void pager_write_begin(struct pager *pager);
+void pager_publish(struct pager *pager);
+void pager_snapshot_begin(struct pager *pager);
+void pager_snapshot_join(struct pager *pager, const struct snapshot *snapshot);
+void pager_snapshot_end(struct pager *pager);
+bool pager_in_snapshot(void);
+struct snapshot *pager_current_snapshot(void);
+void pager_checkpoint(struct pager *pager);
+void pager_prefetch(struct pager *pager, const uint32_t *page_nums,
+		uint32_t n);
+
+#endif /* __PAGER_H__ */
@@ -0,0 +1,373 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cursor.h"
+#include "scan.h"
+
+struct scan;
+
+/*
+ * The ids from low to high, read by a worker of their own. Rows are
+ * handed over through a ring, half of it at a time so neither side
+ * wakes the other for every row.
+ */
+struct scan_partition {
+	struct scan *scan;
+	uint32_t low;
+	uint32_t high;
+	pthread_t thread;
+	pthread_cond_t room;
+
+	struct row rows[SCAN_QUEUE_ROWS];
+	uint32_t head;
+	uint32_t num_rows;
+	bool done;
+};
+
+/*
+ * Workers read inside whatever the caller holds: its tree latch and
+ * transaction, or the version of its snapshot, which they join.
+ */
+struct scan {
+	struct table *table;
+	struct snapshot *snapshot;
+	bool all_columns;
+	scan_fn fn;
+	void *arg;
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	bool stop;
+
+	struct scan_partition *parts;
+	uint32_t num_parts;
+	uint32_t turn;
+};
+
+enum scan_result {
+	SCAN_CONTINUE,
+	SCAN_FULL,
+	SCAN_STOP,
+};
+
+/* Hand a row over, straight to fn when there are no workers */
+static enum scan_result scan_put(struct scan_partition *part, struct row *row)
+{
+	struct scan *scan = part->scan;
+	enum scan_result result = SCAN_CONTINUE;
+
+	if (scan->num_parts == 1) {
+		if (!scan->fn(row, scan->arg))
+			result = SCAN_STOP;
+
+		free(row->profile);
+		return result;
+	}
+
+	pthread_mutex_lock(&scan->lock);
+
+	if (scan->stop) {
+		free(row->profile);
+		result = SCAN_STOP;
+	} else {
+		part->rows[(part->head + part->num_rows) % SCAN_QUEUE_ROWS] =
+			*row;
+		if (++part->num_rows == SCAN_QUEUE_ROWS / 2)
+			pthread_cond_signal(&scan->ready);
+		if (part->num_rows == SCAN_QUEUE_ROWS)
+			result = SCAN_FULL;
+	}
+
+	pthread_mutex_unlock(&scan->lock);
+
+	return result;
+}
+
+/* Wait for a full ring to drain to half, false if the scan stopped */
+static bool scan_wait(struct scan_partition *part)
+{
+	struct scan *scan = part->scan;
+	bool stop;
+
+	pthread_mutex_lock(&scan->lock);
+	while (part->num_rows > SCAN_QUEUE_ROWS / 2 && !scan->stop)
+		pthread_cond_wait(&part->room, &scan->lock);
+	stop = scan->stop;
+	pthread_mutex_unlock(&scan->lock);
+
+	return !stop;
+}
+
+static void scan_partition(struct scan_partition *part)
+{
+	struct scan *scan = part->scan;
+	struct table *table = scan->table;
+	struct cursor *cursor = table_seek(table, part->low);
+	struct row row;
+
+	while (!cursor->end) {
+		void *value = cursor_value(cursor);
+		enum scan_result result;
+
+		deserialize_row(value, &row);
+		if (row.id > part->high) {
+			unpin_page(table->pager, cursor->page_num);
+			break;
+		}
+
+		if (scan->all_columns)
+			deserialize_profile(table->pager, value, &row);
+		unpin_page(table->pager, cursor->page_num);
+
+		result = scan_put(part, &row);
+		if (result == SCAN_STOP)
+			break;
+
+		/*
+		 * Writers may be waiting for the leaf, and other workers
+		 * for them: let go of it while waiting, then seek back.
+		 */
+		if (result == SCAN_FULL) {
+			cursor_close(cursor);
+			if (row.id == part->high || !scan_wait(part))
+				return;
+
+			cursor = table_seek(table, row.id + 1);
+			continue;
+		}
+
+		cursor_advance(cursor);
+	}
+
+	cursor_close(cursor);
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_partition *part = arg;
+	struct scan *scan = part->scan;
+
+	if (scan->snapshot)
+		pager_snapshot_join(scan->table->pager, scan->snapshot);
+
+	scan_partition(part);
+
+	if (scan->snapshot)
+		pager_snapshot_end(scan->table->pager);
+
+	pthread_mutex_lock(&scan->lock);
+	part->done = true;
+	pthread_cond_signal(&scan->ready);
+	pthread_mutex_unlock(&scan->lock);
+
+	return NULL;
+}
+
+/*
+ * Take the rows of part, or of whichever partition has some when part
+ * is NULL. Returns how many, 0 once there are no more.
+ */
+static uint32_t scan_take(struct scan *scan, struct scan_partition *part,
+		struct row *rows)
+{
+	struct scan_partition *ready = NULL;
+	uint32_t num_rows = 0;
+
+	pthread_mutex_lock(&scan->lock);
+
+	while (true) {
+		bool done = true;
+
+		for (uint32_t i = 0; i < scan->num_parts && !ready; i++) {
+			struct scan_partition *p = part ? part :
+				&scan->parts[(scan->turn + i) % scan->num_parts];
+
+			if (p->num_rows)
+				ready = p;
+			done = done && p->done;
+			if (part)
+				break;
+		}
+
+		if (ready || done)
+			break;
+
+		pthread_cond_wait(&scan->ready, &scan->lock);
+	}
+
+	if (ready) {
+		bool full = ready->num_rows > SCAN_QUEUE_ROWS / 2;
+
+		for (; ready->num_rows; ready->num_rows--) {
+			rows[num_rows++] = ready->rows[ready->head];
+			ready->head = (ready->head + 1) % SCAN_QUEUE_ROWS;
+		}
+
+		if (full)
+			pthread_cond_signal(&ready->room);
+		scan->turn++;
+	}
+
+	pthread_mutex_unlock(&scan->lock);
+
+	return num_rows;
+}
+
+static void scan_stop(struct scan *scan)
+{
+	pthread_mutex_lock(&scan->lock);
+	scan->stop = true;
+	for (uint32_t i = 0; i < scan->num_parts; i++)
+		pthread_cond_signal(&scan->parts[i].room);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+/* Pass rows to fn, freeing those left once it stops the scan */
+static void scan_deliver(struct scan *scan, struct row *rows,
+		uint32_t num_rows)
+{
+	for (uint32_t i = 0; i < num_rows; i++) {
+		if (!scan->stop && !scan->fn(&rows[i], scan->arg))
+			scan_stop(scan);
+
+		free(rows[i].profile);
+	}
+}
+
+/* How many rows have ids from low to high */
+static uint32_t scan_row_count(struct table *table, uint32_t low,
+		uint32_t high)
+{
+	uint32_t count = high < UINT32_MAX ? table_rank(table, high + 1) :
+		table_row_count(table);
+
+	return count - table_rank(table, low);
+}
+
+/*
+ * Call fn with every row whose id is from low to high. Large ranges are
+ * split at the tree's separators between up to table->scan_workers
+ * threads; the rows still come in id order, unless ordered is false,
+ * in which case they come as the workers read them. The caller holds
+ * the table latched shared, and fn runs on the caller's thread.
+ */
+void table_scan(struct table *table, uint32_t low, uint32_t high,
+		bool all_columns, bool ordered, scan_fn fn, void *arg)
+{
+	uint32_t max = table->scan_workers;
+	uint32_t cuts[SCAN_WORKERS_MAX];
+	struct scan scan = {
+		.table = table,
+		.snapshot = pager_current_snapshot(),
+		.all_columns = all_columns,
+		.fn = fn,
+		.arg = arg,
+	};
+	struct row rows[SCAN_QUEUE_ROWS];
+	uint32_t num_rows;
+
+	if (low > high)
+		return;
+
+	if (max > SCAN_WORKERS_MAX)
+		max = SCAN_WORKERS_MAX;
+
+	/* leave the pool to the statements running next to us */
+	if (table->pager->mode != PAGER_MODE_MMAP &&
+			max > table->pager->num_frames / SCAN_WORKER_FRAMES)
+		max = table->pager->num_frames / SCAN_WORKER_FRAMES;
+
+	/* threads only pay off once each has enough rows to read */
+	if (max > 1) {
+		uint32_t parts = scan_row_count(table, low, high) /
+			SCAN_PARTITION_ROWS;
+
+		if (max > parts)
+			max = parts;
+	}
+
+	if (max > 1) {
+		scan.num_parts = table_partition(table, low, high, cuts, max);
+	} else {
+		scan.num_parts = 1;
+		cuts[0] = high;
+	}
+
+	scan.parts = calloc(scan.num_parts, sizeof(*scan.parts));
+	if (!scan.parts) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < scan.num_parts; i++) {
+		scan.parts[i].scan = &scan;
+		scan.parts[i].low = i ? cuts[i - 1] + 1 : low;
+		scan.parts[i].high = cuts[i];
+	}
+
+	if (scan.num_parts == 1) {
+		scan_partition(&scan.parts[0]);
+		free(scan.parts);
+		return;
+	}
+
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.ready, NULL);
+
+	for (uint32_t i = 0; i < scan.num_parts; i++) {
+		pthread_cond_init(&scan.parts[i].room, NULL);
+		if (pthread_create(&scan.parts[i].thread, NULL, scan_worker,
+					&scan.parts[i])) {
+			fprintf(stderr, "Failed to start scan worker\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (ordered) {
+		for (uint32_t i = 0; i < scan.num_parts && !scan.stop; i++)
+			while (!scan.stop && (num_rows = scan_take(&scan,
+							&scan.parts[i], rows)))
+				scan_deliver(&scan, rows, num_rows);
+	} else {
+		while (!scan.stop && (num_rows = scan_take(&scan, NULL, rows)))
+			scan_deliver(&scan, rows, num_rows);
+	}
+
+	/* workers still reading after fn stopped us have to let go */
+	scan_stop(&scan);
+
+	for (uint32_t i = 0; i < scan.num_parts; i++) {
+		struct scan_partition *part = &scan.parts[i];
+
+		pthread_join(part->thread, NULL);
+		pthread_cond_destroy(&part->room);
+
+		for (uint32_t j = 0; j < part->num_rows; j++)
+			free(part->rows[(part->head + j) %
+					SCAN_QUEUE_ROWS].profile);
+	}
+
+	pthread_cond_destroy(&scan.ready);
+	pthread_mutex_destroy(&scan.lock);
+	free(scan.parts);
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "db.h"
+
+#define SCAN_WORKERS_MAX	16
+#define SCAN_PARTITION_ROWS	256
+#define SCAN_QUEUE_ROWS		64
+#define SCAN_WORKER_FRAMES	16
+
+/*
+ * Called with each row a scan reads. The scan frees the row's profile
+ * afterwards. Returning false stops the scan.
+ */
+typedef bool (*scan_fn)(struct row *row, void *arg);
+
+void table_scan(struct table *table, uint32_t low, uint32_t high,
+		bool all_columns, bool ordered, scan_fn fn, void *arg);
+
+#endif /* __SCAN_H__ */
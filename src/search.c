@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "search.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEARCH_X86
+#endif
+
+static uint32_t count_below_scalar(const uint32_t *keys, uint32_t n,
+		uint32_t key)
+{
+	uint32_t count = 0;
+
+	for (uint32_t i = 0; i < n; i++)
+		count += keys[i] < key;
+
+	return count;
+}
+
+#ifdef SEARCH_X86
+/*
+ * SSE2 and AVX2 only compare signed integers, flipping the top bit of
+ * both sides gives the unsigned order.
+ */
+__attribute__((target("sse2")))
+static uint32_t count_below_sse2(const uint32_t *keys, uint32_t n,
+		uint32_t key)
+{
+	const __m128i bias = _mm_set1_epi32(INT32_MIN);
+	const __m128i needle = _mm_xor_si128(_mm_set1_epi32(key), bias);
+	uint32_t count = 0;
+	uint32_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) &keys[i]);
+		__m128i lt = _mm_cmplt_epi32(_mm_xor_si128(v, bias), needle);
+
+		count += __builtin_popcount(_mm_movemask_ps(
+					_mm_castsi128_ps(lt)));
+	}
+
+	return count + count_below_scalar(keys + i, n - i, key);
+}
+
+__attribute__((target("avx2")))
+static uint32_t count_below_avx2(const uint32_t *keys, uint32_t n,
+		uint32_t key)
+{
+	const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+	const __m256i needle = _mm256_xor_si256(_mm256_set1_epi32(key), bias);
+	uint32_t count = 0;
+	uint32_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) &keys[i]);
+		__m256i lt = _mm256_cmpgt_epi32(needle,
+				_mm256_xor_si256(v, bias));
+
+		count += __builtin_popcount(_mm256_movemask_ps(
+					_mm256_castsi256_ps(lt)));
+	}
+
+	return count + count_below_sse2(keys + i, n - i, key);
+}
+#endif
+
+static uint32_t count_below(const uint32_t *keys, uint32_t n, uint32_t key)
+{
+#ifdef SEARCH_X86
+	static int avx2 = -1;
+
+	if (avx2 < 0)
+		avx2 = __builtin_cpu_supports("avx2");
+
+	if (avx2)
+		return count_below_avx2(keys, n, key);
+
+	return count_below_sse2(keys, n, key);
+#else
+	return count_below_scalar(keys, n, key);
+#endif
+}
+
+/*
+ * Index of the first of the n sorted keys that isn't smaller than key,
+ * n if there is none. Large arrays are bisected down to a few cache
+ * lines, which are then compared all at once.
+ */
+uint32_t keys_lower_bound(const uint32_t *keys, uint32_t n, uint32_t key)
+{
+	uint32_t low = 0;
+
+	while (n > SEARCH_SCAN_KEYS) {
+		uint32_t half = n / 2;
+
+		if (keys[low + half] < key) {
+			low += half + 1;
+			n -= half + 1;
+		} else {
+			n = half;
+		}
+	}
+
+	return low + count_below(keys + low, n, key);
+}
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SEARCH_H__
+#define __SEARCH_H__
+
+#include <stdint.h>
+
+/* Below this many keys a vector scan beats bisecting any further */
+#define SEARCH_SCAN_KEYS	32
+
+uint32_t keys_lower_bound(const uint32_t *keys, uint32_t n, uint32_t key);
+
+#endif /* __SEARCH_H__ */
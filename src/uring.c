@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+int uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = io_uring_setup(entries, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->entries = params.sq_entries;
+	ring->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+			ring->sqes == MAP_FAILED) {
+		uring_exit(ring);
+		return -1;
+	}
+
+	ring->sq_head = ring->sq_ring + params.sq_off.head;
+	ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + params.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + params.sq_off.array;
+
+	ring->cq_head = ring->cq_ring + params.cq_off.head;
+	ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + params.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + params.cq_off.cqes;
+
+	return 0;
+}
+
+void uring_exit(struct uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	ring->fd = -1;
+}
+
+static void uring_queue(struct uring *ring, int fd, struct uring_op *op,
+		uint32_t index)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned slot = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) op->buf;
+	sqe->len = op->len;
+	sqe->off = op->offset;
+	sqe->user_data = index;
+
+	ring->sq_array[slot] = slot;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t uring_reap(struct uring *ring, struct uring_op *ops)
+{
+	unsigned head = *ring->cq_head;
+	uint32_t reaped = 0;
+
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+		ops[cqe->user_data].res = cqe->res;
+		head++;
+		reaped++;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return reaped;
+}
+
+/*
+ * Submit all n operations, a ring's worth at a time, and wait for every
+ * one of them. Per-operation results land in ops[i].res, a negative
+ * errno on failure.
+ */
+int uring_run(struct uring *ring, int fd, struct uring_op *ops, uint32_t n)
+{
+	uint32_t done = 0;
+
+	while (done < n) {
+		uint32_t batch = n - done;
+		uint32_t to_submit;
+		uint32_t reaped = 0;
+
+		if (batch > ring->entries)
+			batch = ring->entries;
+
+		for (uint32_t i = 0; i < batch; i++)
+			uring_queue(ring, fd, &ops[done + i], done + i);
+
+		to_submit = batch;
+		while (reaped < batch) {
+			int ret = io_uring_enter(ring->fd, to_submit,
+					batch - reaped, IORING_ENTER_GETEVENTS);
+
+			if (ret < 0 && errno != EINTR)
+				return -1;
+
+			if (ret > 0)
+				to_submit -= ret;
+
+			reaped += uring_reap(ring, ops);
+		}
+
+		done += batch;
+	}
+
+	return 0;
+}
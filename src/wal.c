@@ -0,0 +1,659 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "lz.h"
+#include "wal.h"
+
+static uint32_t *wal_u32(void *p, size_t offset)
+{
+	return p + offset;
+}
+
+static uint16_t *wal_u16(void *p, size_t offset)
+{
+	return p + offset;
+}
+
+/* Fletcher-style sum a word at a time, chained through seed */
+static uint32_t wal_checksum(uint32_t seed, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t s1 = seed;
+	uint64_t s2 = 0;
+	size_t i;
+
+	for (i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t word;
+
+		memcpy(&word, p + i, sizeof(word));
+		s1 += word;
+		s2 += s1;
+	}
+
+	for (; i < len; i++) {
+		s1 += p[i];
+		s2 += s1;
+	}
+
+	return s1 ^ (s1 >> 32) ^ s2 ^ (s2 >> 32);
+}
+
+static uint32_t frame_checksum(const void *frame, uint32_t length)
+{
+	uint32_t sum = wal_checksum(0, frame, FRAME_CHECKSUM_OFFSET);
+
+	return wal_checksum(sum, frame + FRAME_HEADER_SIZE, length);
+}
+
+static bool wal_pread(struct wal *wal, void *buf, size_t len, off_t offset)
+{
+	ssize_t bytes = pread(wal->fd, buf, len, offset);
+
+	if (bytes < 0) {
+		fprintf(stderr, "Error reading log: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return bytes == (ssize_t) len;
+}
+
+static void wal_pwrite(struct wal *wal, const void *buf, size_t len,
+		off_t offset)
+{
+	if (pwrite(wal->fd, buf, len, offset) != (ssize_t) len) {
+		fprintf(stderr, "Error writing log: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void *wal_alloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return ptr;
+}
+
+static void wal_index_grow(struct wal *wal, uint32_t page_num)
+{
+	uint32_t capacity = wal->index_capacity ? wal->index_capacity : 64;
+
+	if (page_num < wal->index_capacity)
+		return;
+
+	while (capacity <= page_num)
+		capacity *= 2;
+
+	wal->index = wal_alloc(wal->index, capacity * sizeof(off_t));
+	memset(wal->index + wal->index_capacity, 0,
+			(capacity - wal->index_capacity) * sizeof(off_t));
+	wal->queued = wal_alloc(wal->queued, capacity * sizeof(bool));
+	memset(wal->queued + wal->index_capacity, 0,
+			(capacity - wal->index_capacity) * sizeof(bool));
+	wal->queue = wal_alloc(wal->queue, capacity * sizeof(uint32_t));
+	wal->index_capacity = capacity;
+}
+
+static void wal_index_set(struct wal *wal, uint32_t page_num, off_t offset)
+{
+	wal_index_grow(wal, page_num);
+
+	if (page_num >= wal->index_len)
+		wal->index_len = page_num + 1;
+
+	wal->index[page_num] = offset;
+}
+
+/* Remember the file is behind on page_num, once */
+static void wal_queue(struct wal *wal, uint32_t page_num)
+{
+	wal_index_grow(wal, page_num);
+
+	if (wal->queued[page_num])
+		return;
+
+	/* every page is queued at most once, so this always fits */
+	if (wal->queue_tail == wal->index_capacity) {
+		memmove(wal->queue, wal->queue + wal->queue_head,
+				(wal->queue_tail - wal->queue_head) *
+				sizeof(uint32_t));
+		wal->queue_tail -= wal->queue_head;
+		wal->queue_head = 0;
+	}
+
+	wal->queued[page_num] = true;
+	wal->queue[wal->queue_tail++] = page_num;
+}
+
+/* Read the frame at offset into buf, false if it's torn or stale */
+static bool wal_read_frame(struct wal *wal, off_t offset, void *buf)
+{
+	uint32_t length;
+
+	if (!wal_pread(wal, buf, FRAME_HEADER_SIZE, offset))
+		return false;
+
+	length = *wal_u32(buf, FRAME_LENGTH_OFFSET);
+	if (*wal_u32(buf, FRAME_SALT_OFFSET) != wal->salt ||
+			length > wal->page_size)
+		return false;
+
+	if (!wal_pread(wal, buf + FRAME_HEADER_SIZE, length,
+				offset + FRAME_HEADER_SIZE))
+		return false;
+
+	return *wal_u32(buf, FRAME_CHECKSUM_OFFSET) ==
+		frame_checksum(buf, length);
+}
+
+static off_t wal_frame_end(void *frame, off_t offset)
+{
+	return offset + FRAME_HEADER_SIZE + *wal_u32(frame, FRAME_LENGTH_OFFSET);
+}
+
+/*
+ * Find the end of the last complete transaction and cut off whatever
+ * follows it, so new frames go right after. wal_replay() redoes it.
+ */
+static void wal_recover(struct wal *wal)
+{
+	char header[WAL_HEADER_SIZE];
+	void *frame;
+	off_t offset;
+
+	if (!wal_pread(wal, header, WAL_HEADER_SIZE, 0) ||
+			memcmp(header + WAL_MAGIC_OFFSET, WAL_MAGIC,
+				sizeof(WAL_MAGIC)) ||
+			*wal_u32(header, WAL_CHECKSUM_OFFSET) !=
+			wal_checksum(0, header, WAL_CHECKSUM_OFFSET))
+		return;
+
+	wal->page_size = *wal_u32(header, WAL_PAGE_SIZE_OFFSET);
+	wal->salt = *wal_u32(header, WAL_SALT_OFFSET);
+	if (!wal->page_size || wal->page_size & (wal->page_size - 1)) {
+		wal->page_size = 0;
+		return;
+	}
+
+	frame = wal_alloc(NULL, FRAME_HEADER_SIZE + wal->page_size);
+	wal->committed = WAL_HEADER_SIZE;
+
+	for (offset = WAL_HEADER_SIZE; wal_read_frame(wal, offset, frame); ) {
+		offset = wal_frame_end(frame, offset);
+
+		if (*wal_u32(frame, FRAME_TYPE_OFFSET) == WAL_FRAME_COMMIT) {
+			wal->committed = offset;
+			wal->db_pages = *wal_u32(frame, FRAME_COMMIT_OFFSET);
+		}
+	}
+
+	free(frame);
+
+	if (ftruncate(wal->fd, wal->committed) < 0) {
+		fprintf(stderr, "Error truncating log: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	wal->len = wal->committed;
+	wal->written = wal->committed;
+	wal->zbuf = wal_alloc(NULL, wal->page_size);
+}
+
+/*
+ * Open the log of db_filename and find out how much of it committed.
+ * page_size is left at 0 when there's no usable log, the caller then
+ * starts a new one with wal_reset().
+ */
+void wal_open(struct wal *wal, const char *db_filename)
+{
+	memset(wal, 0, sizeof(*wal));
+
+	wal->filename = wal_alloc(NULL, strlen(db_filename) +
+			sizeof(WAL_SUFFIX));
+	sprintf(wal->filename, "%s%s", db_filename, WAL_SUFFIX);
+
+	wal->fd = open(wal->filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+	if (wal->fd == -1) {
+		fprintf(stderr, "Unable to open log %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_cond_init(&wal->cond, NULL);
+	wal->salt = time(NULL) ^ getpid();
+
+	wal_recover(wal);
+}
+
+/* Whether db_filename has a log which might need recovering */
+bool wal_exists(const char *db_filename)
+{
+	char *filename = wal_alloc(NULL, strlen(db_filename) +
+			sizeof(WAL_SUFFIX));
+	struct stat st;
+	bool exists;
+
+	sprintf(filename, "%s%s", db_filename, WAL_SUFFIX);
+	exists = !stat(filename, &st) && st.st_size;
+	free(filename);
+
+	return exists;
+}
+
+void wal_close(struct wal *wal, bool remove)
+{
+	if (close(wal->fd) < 0) {
+		fprintf(stderr, "Error closing log: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (remove)
+		unlink(wal->filename);
+
+	pthread_cond_destroy(&wal->cond);
+	pthread_mutex_destroy(&wal->lock);
+	free(wal->filename);
+	free(wal->index);
+	free(wal->queued);
+	free(wal->queue);
+	free(wal->buf);
+	free(wal->zbuf);
+}
+
+/*
+ * Start the log over once everything in it has reached the database.
+ * A new salt keeps frames of the old log from being mistaken for ours
+ * should the truncation not make it to disk.
+ */
+void wal_reset(struct wal *wal, uint32_t page_size)
+{
+	char header[WAL_HEADER_SIZE];
+
+	if (ftruncate(wal->fd, 0) < 0) {
+		fprintf(stderr, "Error truncating log: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	wal->page_size = page_size;
+	wal->salt++;
+
+	memset(header, 0, sizeof(header));
+	memcpy(header + WAL_MAGIC_OFFSET, WAL_MAGIC, sizeof(WAL_MAGIC));
+	*wal_u32(header, WAL_PAGE_SIZE_OFFSET) = page_size;
+	*wal_u32(header, WAL_SALT_OFFSET) = wal->salt;
+	*wal_u32(header, WAL_CHECKSUM_OFFSET) = wal_checksum(0, header,
+			WAL_CHECKSUM_OFFSET);
+	wal_pwrite(wal, header, WAL_HEADER_SIZE, 0);
+
+	wal->len = WAL_HEADER_SIZE;
+	wal->written = WAL_HEADER_SIZE;
+	wal->committed = WAL_HEADER_SIZE;
+	wal->synced = 0;
+	wal->num_frames = 0;
+	wal->pending = 0;
+	wal->db_pages = 0;
+	wal->buf_len = 0;
+
+	/* pages logged only as deltas are queued past index_len */
+	if (wal->index) {
+		memset(wal->index, 0, wal->index_len * sizeof(off_t));
+		memset(wal->queued, 0, wal->index_capacity * sizeof(bool));
+	}
+
+	wal->index_len = 0;
+	wal->queue_head = 0;
+	wal->queue_tail = 0;
+
+	wal->zbuf = wal_alloc(wal->zbuf, page_size);
+}
+
+static void wal_decode_image(struct wal *wal, uint32_t page_num,
+		const void *src, uint32_t length, void *data)
+{
+	if (length == wal->page_size) {
+		memcpy(data, src, length);
+		return;
+	}
+
+	if (lz_decompress(src, length, data, wal->page_size) < 0) {
+		fprintf(stderr, "Log frame of page %d is corrupted\n",
+				page_num);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void wal_apply_delta(const void *src, uint32_t length, void *data)
+{
+	const void *end = src + length;
+
+	while (src < end) {
+		uint16_t offset = *wal_u16((void *) src, 0);
+		uint16_t run = *wal_u16((void *) src, DELTA_OFFSET_SIZE);
+
+		memcpy(data + offset, src + DELTA_RUN_HEADER_SIZE, run);
+		src += DELTA_RUN_HEADER_SIZE + run;
+	}
+}
+
+/*
+ * Redo every committed frame in log order. Images overwrite the page
+ * and deltas only set the bytes they carry, so replaying on top of a
+ * file a crashed checkpoint got halfway through ends up the same.
+ */
+void wal_replay(struct wal *wal, wal_get_page_fn get, wal_put_page_fn put,
+		void *arg)
+{
+	void *frame = wal_alloc(NULL, FRAME_HEADER_SIZE + wal->page_size);
+	off_t offset = WAL_HEADER_SIZE;
+
+	while (offset < wal->committed) {
+		uint32_t page_num;
+		uint32_t length;
+		void *data;
+
+		if (!wal_read_frame(wal, offset, frame)) {
+			fprintf(stderr, "Log is corrupted\n");
+			exit(EXIT_FAILURE);
+		}
+
+		page_num = *wal_u32(frame, FRAME_PAGE_NUM_OFFSET);
+		length = *wal_u32(frame, FRAME_LENGTH_OFFSET);
+
+		switch (*wal_u32(frame, FRAME_TYPE_OFFSET)) {
+		case WAL_FRAME_IMAGE:
+			data = get(arg, page_num);
+			wal_decode_image(wal, page_num,
+					frame + FRAME_HEADER_SIZE, length, data);
+			put(arg, page_num);
+			break;
+		case WAL_FRAME_DELTA:
+			data = get(arg, page_num);
+			wal_apply_delta(frame + FRAME_HEADER_SIZE, length, data);
+			put(arg, page_num);
+			break;
+		}
+
+		offset = wal_frame_end(frame, offset);
+	}
+
+	free(frame);
+}
+
+/* Whether the log has an image of the page */
+bool wal_lookup(struct wal *wal, uint32_t page_num)
+{
+	return page_num < wal->index_len && wal->index[page_num];
+}
+
+/* Load the newest image of page_num, which has to be in the log */
+void wal_read_page(struct wal *wal, uint32_t page_num, void *data)
+{
+	off_t offset = wal->index[page_num];
+	char header[FRAME_HEADER_SIZE];
+	const void *src = wal->zbuf;
+	uint32_t length;
+
+	if (offset >= wal->written) {
+		/* still sitting in the buffer */
+		void *frame = wal->buf + (offset - wal->written);
+
+		length = *wal_u32(frame, FRAME_LENGTH_OFFSET);
+		src = frame + FRAME_HEADER_SIZE;
+	} else {
+		wal_pread(wal, header, FRAME_HEADER_SIZE, offset);
+		length = *wal_u32(header, FRAME_LENGTH_OFFSET);
+		wal_pread(wal, wal->zbuf, length, offset + FRAME_HEADER_SIZE);
+	}
+
+	wal_decode_image(wal, page_num, src, length, data);
+}
+
+/* Write out the buffered frames */
+static void wal_flush(struct wal *wal)
+{
+	if (!wal->buf_len)
+		return;
+
+	pthread_mutex_lock(&wal->lock);
+	wal_pwrite(wal, wal->buf, wal->buf_len, wal->written);
+	wal->written += wal->buf_len;
+	pthread_mutex_unlock(&wal->lock);
+
+	wal->buf_len = 0;
+}
+
+static void *wal_add_frame(struct wal *wal, uint32_t page_num,
+		enum wal_frame_type type, uint32_t commit)
+{
+	size_t needed = wal->buf_len + FRAME_HEADER_SIZE + wal->page_size;
+	void *frame;
+
+	if (needed > wal->buf_capacity) {
+		wal->buf_capacity = needed > WAL_BUFFER_SIZE ?
+			needed : WAL_BUFFER_SIZE;
+		wal->buf = wal_alloc(wal->buf, wal->buf_capacity);
+	}
+
+	frame = wal->buf + wal->buf_len;
+	*wal_u32(frame, FRAME_PAGE_NUM_OFFSET) = page_num;
+	*wal_u32(frame, FRAME_TYPE_OFFSET) = type;
+	*wal_u32(frame, FRAME_LENGTH_OFFSET) = 0;
+	*wal_u32(frame, FRAME_COMMIT_OFFSET) = commit;
+	*wal_u32(frame, FRAME_SALT_OFFSET) = wal->salt;
+
+	return frame;
+}
+
+static void wal_seal_frame(struct wal *wal, void *frame, uint32_t length)
+{
+	*wal_u32(frame, FRAME_LENGTH_OFFSET) = length;
+	*wal_u32(frame, FRAME_CHECKSUM_OFFSET) = frame_checksum(frame, length);
+
+	wal->buf_len += FRAME_HEADER_SIZE + length;
+	wal->len += FRAME_HEADER_SIZE + length;
+	wal->num_frames++;
+	wal->pending++;
+}
+
+/*
+ * Encode the words of data which differ from base as runs into dst.
+ * Returns the encoded length, 0 if nothing changed, or -1 if it would
+ * take more than cap bytes.
+ */
+static ssize_t wal_diff(const void *base, const void *data,
+		uint32_t page_size, void *dst, size_t cap)
+{
+	const uint64_t *old = base;
+	const uint64_t *new = data;
+	uint32_t num_words = page_size / sizeof(uint64_t);
+	size_t len = 0;
+
+	for (uint32_t i = 0; i < num_words; ) {
+		uint32_t end;
+		uint16_t run;
+
+		if (old[i] == new[i]) {
+			i++;
+			continue;
+		}
+
+		end = i + 1;
+		for (uint32_t j = end; j < num_words &&
+				j < end + DELTA_MIN_GAP; j++)
+			if (old[j] != new[j])
+				end = j + 1;
+
+		run = (end - i) * sizeof(uint64_t);
+		if (len + DELTA_RUN_HEADER_SIZE + run > cap)
+			return -1;
+
+		*wal_u16(dst + len, 0) = i * sizeof(uint64_t);
+		*wal_u16(dst + len, DELTA_OFFSET_SIZE) = run;
+		memcpy(dst + len + DELTA_RUN_HEADER_SIZE, &new[i], run);
+		len += DELTA_RUN_HEADER_SIZE + run;
+		i = end;
+	}
+
+	return len;
+}
+
+/*
+ * Log the current contents of a page as part of the open transaction.
+ * base is what the page held at its previous record (or in the file),
+ * only the difference is logged then. Pages which changed too much, or
+ * have no base, get an image.
+ */
+enum wal_record wal_append(struct wal *wal, uint32_t page_num,
+		const void *data, const void *base)
+{
+	enum wal_record record = WAL_RECORD_DELTA;
+	void *frame;
+	ssize_t length;
+
+	if (base) {
+		frame = wal_add_frame(wal, page_num, WAL_FRAME_DELTA, 0);
+		length = wal_diff(base, data, wal->page_size,
+				frame + FRAME_HEADER_SIZE, wal->page_size / 2);
+
+		if (!length)
+			return WAL_RECORD_NONE;
+
+		if (length > 0) {
+			wal_queue(wal, page_num);
+			wal_seal_frame(wal, frame, length);
+			goto out;
+		}
+	}
+
+	record = WAL_RECORD_IMAGE;
+	frame = wal_add_frame(wal, page_num, WAL_FRAME_IMAGE, 0);
+	length = lz_compress(data, wal->page_size, frame + FRAME_HEADER_SIZE,
+			wal->page_size - 1);
+	if (!length) {
+		length = wal->page_size;
+		memcpy(frame + FRAME_HEADER_SIZE, data, length);
+	}
+
+	wal_index_set(wal, page_num, wal->len);
+	wal_queue(wal, page_num);
+	wal_seal_frame(wal, frame, length);
+
+out:
+	if (wal->buf_len >= WAL_BUFFER_SIZE)
+		wal_flush(wal);
+
+	return record;
+}
+
+/* Pages logged since they were last copied to the database */
+uint32_t wal_backlog(struct wal *wal)
+{
+	return wal->queue_tail - wal->queue_head;
+}
+
+/*
+ * Take up to max pages off the backlog, oldest first. The caller is
+ * expected to copy them to the database before the log is reset.
+ */
+uint32_t wal_take_backlog(struct wal *wal, uint32_t *page_nums, uint32_t max)
+{
+	uint32_t n = 0;
+
+	while (n < max && wal->queue_head < wal->queue_tail) {
+		uint32_t page_num = wal->queue[wal->queue_head++];
+
+		wal->queued[page_num] = false;
+		page_nums[n++] = page_num;
+	}
+
+	return n;
+}
+
+/*
+ * Close the open transaction with a commit frame and hand it to the
+ * kernel. With sync it's also on disk by the time we return.
+ */
+void wal_commit(struct wal *wal, uint32_t db_pages, bool sync)
+{
+	void *frame = wal_add_frame(wal, 0, WAL_FRAME_COMMIT, db_pages);
+
+	wal_seal_frame(wal, frame, 0);
+	wal->committed = wal->len;
+	wal->db_pages = db_pages;
+	wal->pending = 0;
+
+	wal_flush(wal);
+
+	if (sync)
+		wal_sync(wal);
+}
+
+/*
+ * Make everything written so far durable. Commits arriving while an
+ * fsync is running queue up behind it and the next one covers all of
+ * them, so concurrent committers share fsyncs instead of paying one
+ * each.
+ */
+void wal_sync(struct wal *wal)
+{
+	off_t target;
+
+	pthread_mutex_lock(&wal->lock);
+	target = wal->written;
+
+	while (wal->synced < target) {
+		off_t end;
+
+		if (wal->syncing) {
+			pthread_cond_wait(&wal->cond, &wal->lock);
+			continue;
+		}
+
+		wal->syncing = true;
+		end = wal->written;
+		pthread_mutex_unlock(&wal->lock);
+
+		if (fdatasync(wal->fd) < 0) {
+			fprintf(stderr, "Error syncing log: %s\n",
+					strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_mutex_lock(&wal->lock);
+		wal->synced = end;
+		wal->syncing = false;
+		pthread_cond_broadcast(&wal->cond);
+	}
+
+	pthread_mutex_unlock(&wal->lock);
+}
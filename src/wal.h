@@ -0,0 +1,162 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * This file is part of simpledb
+ *
+ * simpledb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * simpledb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with simpledb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Write-ahead log, kept next to the database as <filename>-wal. Frames
+ * are redo records for one page each: either a full image, LZ
+ * compressed when that makes it smaller, or a delta against the
+ * page's previous record holding only the byte ranges which changed. A
+ * transaction is the run of frames up to a commit frame, which records
+ * how many pages the database has. Frames after the last commit frame
+ * are thrown away on recovery.
+ */
+#define WAL_SUFFIX		"-wal"
+#define WAL_MAGIC		"simpledb wal"
+#define WAL_MAGIC_SIZE		16
+#define WAL_MAGIC_OFFSET	(0)
+#define WAL_PAGE_SIZE_SIZE	(sizeof(uint32_t))
+#define WAL_PAGE_SIZE_OFFSET	(WAL_MAGIC_OFFSET + WAL_MAGIC_SIZE)
+#define WAL_SALT_SIZE		(sizeof(uint32_t))
+#define WAL_SALT_OFFSET		(WAL_PAGE_SIZE_OFFSET + WAL_PAGE_SIZE_SIZE)
+#define WAL_CHECKSUM_SIZE	(sizeof(uint32_t))
+#define WAL_CHECKSUM_OFFSET	(WAL_SALT_OFFSET + WAL_SALT_SIZE)
+#define WAL_HEADER_SIZE		(WAL_CHECKSUM_OFFSET + WAL_CHECKSUM_SIZE)
+
+/*
+ * Frame header: the page, its type, how many bytes of data follow, the
+ * page count of the database on commit frames, the salt of the log it
+ * was written to and a checksum over the header and data. An image
+ * of page_size bytes is stored as is.
+ */
+#define FRAME_PAGE_NUM_SIZE	(sizeof(uint32_t))
+#define FRAME_PAGE_NUM_OFFSET	(0)
+#define FRAME_TYPE_SIZE		(sizeof(uint32_t))
+#define FRAME_TYPE_OFFSET	(FRAME_PAGE_NUM_OFFSET + FRAME_PAGE_NUM_SIZE)
+#define FRAME_LENGTH_SIZE	(sizeof(uint32_t))
+#define FRAME_LENGTH_OFFSET	(FRAME_TYPE_OFFSET + FRAME_TYPE_SIZE)
+#define FRAME_COMMIT_SIZE	(sizeof(uint32_t))
+#define FRAME_COMMIT_OFFSET	(FRAME_LENGTH_OFFSET + FRAME_LENGTH_SIZE)
+#define FRAME_SALT_SIZE		(sizeof(uint32_t))
+#define FRAME_SALT_OFFSET	(FRAME_COMMIT_OFFSET + FRAME_COMMIT_SIZE)
+#define FRAME_CHECKSUM_SIZE	(sizeof(uint32_t))
+#define FRAME_CHECKSUM_OFFSET	(FRAME_SALT_OFFSET + FRAME_SALT_SIZE)
+#define FRAME_HEADER_SIZE	(FRAME_CHECKSUM_OFFSET + FRAME_CHECKSUM_SIZE)
+
+/* Delta data: runs of a 16-bit offset and length followed by the bytes */
+#define DELTA_OFFSET_SIZE	(sizeof(uint16_t))
+#define DELTA_LENGTH_SIZE	(sizeof(uint16_t))
+#define DELTA_RUN_HEADER_SIZE	(DELTA_OFFSET_SIZE + DELTA_LENGTH_SIZE)
+
+/* Equal words it takes to end a run, shorter gaps are cheaper to copy */
+#define DELTA_MIN_GAP		2
+
+enum wal_frame_type {
+	WAL_FRAME_IMAGE,
+	WAL_FRAME_DELTA,
+	WAL_FRAME_COMMIT,
+};
+
+/* What wal_append() wrote: nothing when the page hadn't changed */
+enum wal_record {
+	WAL_RECORD_NONE,
+	WAL_RECORD_DELTA,
+	WAL_RECORD_IMAGE,
+};
+
+/* Frames the log may grow to before it is checkpointed */
+#define WAL_CHECKPOINT_FRAMES	1000
+
+/* Appended frames are written out once this many bytes are buffered */
+#define WAL_BUFFER_SIZE		(256 * 1024)
+
+struct wal {
+	int fd;
+	char *filename;
+	uint32_t page_size;
+	uint32_t salt;
+
+	/* end of the log, of what reached the file and of the last commit */
+	off_t len;
+	off_t written;
+	off_t committed;
+	uint32_t num_frames;
+	uint32_t pending;
+	uint32_t db_pages;
+
+	/*
+	 * Offset of the newest image of each page logged since the last
+	 * reset, 0 when there is none. Pages whose newer deltas haven't
+	 * been followed by an image must stay cached.
+	 */
+	off_t *index;
+	uint32_t index_len;
+	uint32_t index_capacity;
+
+	/* backlog: pages logged since they were last copied to the file */
+	bool *queued;
+	uint32_t *queue;
+	uint32_t queue_head;
+	uint32_t queue_tail;
+
+	/* frames appended since the last write, starting at written */
+	void *buf;
+	size_t buf_len;
+	size_t buf_capacity;
+	void *zbuf;
+
+	/*
+	 * Group commit: whoever finds no fsync running starts one which
+	 * covers everything written so far, the others wait for it.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	off_t synced;
+	bool syncing;
+};
+
+/* Hands recovery the page to redo a frame into, and takes it back */
+typedef void *(*wal_get_page_fn)(void *arg, uint32_t page_num);
+typedef void (*wal_put_page_fn)(void *arg, uint32_t page_num);
+
+bool wal_exists(const char *db_filename);
+void wal_open(struct wal *wal, const char *db_filename);
+void wal_close(struct wal *wal, bool remove);
+void wal_reset(struct wal *wal, uint32_t page_size);
+void wal_replay(struct wal *wal, wal_get_page_fn get, wal_put_page_fn put,
+		void *arg);
+
+bool wal_lookup(struct wal *wal, uint32_t page_num);
+void wal_read_page(struct wal *wal, uint32_t page_num, void *data);
+enum wal_record wal_append(struct wal *wal, uint32_t page_num,
+		const void *data, const void *base);
+void wal_commit(struct wal *wal, uint32_t db_pages, bool sync);
+uint32_t wal_backlog(struct wal *wal);
+uint32_t wal_take_backlog(struct wal *wal, uint32_t *page_nums, uint32_t max);
+void wal_sync(struct wal *wal);
+
+#endif /* __WAL_H__ */
@@ -22,18 +22,37 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include "compiler.h"
+#include "cursor.h"
+#include "db.h"
+#include "pager.h"
+#include "search.h"
+
 #define OUTPUT_MAX 4096
 #define SIMPLEDB "./simpledb"
 
-static pid_t start_child(int rpipes[2], int wpipes[2], char *filename)
+/* Rows of the largest size, 13 of them fill a 4 KiB leaf */
+#define LONG_USERNAME "abcdefghijklmnopqrstuvwxyz012345"
+#define LONG_EMAIL "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx" \
+	"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx" \
+	"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx" \
+	"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx" \
+	"xxx@example.com"
+
+static pid_t start_child(int rpipes[2], int wpipes[2], char *filename,
+		char **options)
 {
 	pid_t child;
 	int ret;
@@ -59,7 +78,14 @@ static pid_t start_child(int rpipes[2], int wpipes[2], char *filename)
 	}
 
         if (child == 0) { /* child */
-		char *exe[] = { SIMPLEDB, filename, NULL };
+		char *exe[16] = { SIMPLEDB };
+		int argc = 1;
+
+		while (options && *options)
+			exe[argc++] = *options++;
+
+		exe[argc++] = filename;
+		exe[argc] = NULL;
 
 		close(wpipes[1]);
 		close(rpipes[0]);
@@ -85,16 +111,31 @@ static void send_cmd(int pipe, char *cmd)
 
 static void recv_response(int pipe, char *output, size_t len)
 {
-	read(pipe, output, len);
+	size_t done = 0;
+	ssize_t bytes;
+
+	/* the child exits on .exit, read until it's gone */
+	while (done < len) {
+		bytes = read(pipe, output + done, len - done);
+		if (bytes <= 0)
+			break;
+
+		done += bytes;
+	}
 }
 
-static void run_script(char **cmds, char *output, char *filename, size_t len)
+/*
+ * With hang_up the child's input is closed once the commands are sent,
+ * so it dies on end of file without ever closing the database.
+ */
+static void run_child(char **cmds, char **options, char *output,
+		char *filename, size_t len, bool hang_up)
 {
 	int rpipes[2];
 	int wpipes[2];
         pid_t child;
 
-	child = start_child(rpipes, wpipes, filename);
+	child = start_child(rpipes, wpipes, filename, options);
 
 	if (child > 0) { /* parent */
 		close(wpipes[0]);
@@ -105,8 +146,84 @@ static void run_script(char **cmds, char *output, char *filename, size_t len)
 			cmds++;
 		}
 
+		if (hang_up)
+			close(wpipes[1]);
+
                 recv_response(rpipes[0], output, len);
+		if (!hang_up)
+			close(wpipes[1]);
+		close(rpipes[0]);
+		waitpid(child, NULL, 0);
+	}
+}
+
+static void run_script_with_options(char **cmds, char **options,
+		char *output, char *filename, size_t len)
+{
+	run_child(cmds, options, output, filename, len, false);
+}
+
+static void run_script(char **cmds, char *output, char *filename, size_t len)
+{
+	run_script_with_options(cmds, NULL, output, filename, len);
+}
+
+/*
+ * Insert num_rows of the largest rows out of order, exit, then reopen
+ * the file with the same options and check every row comes back.
+ * num_rows must be coprime with 101.
+ */
+static void check_round_trip(char **options, char *filename, int num_rows)
+{
+	size_t len = 1 << 20;
+	char *expected;
+	char *output;
+	char **cmds;
+	char *p;
+
+	cmds = calloc(num_rows + 2, sizeof(*cmds));
+	output = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	for (int i = 0; i < num_rows; i++) {
+		cmds[i] = malloc(512);
+		sprintf(cmds[i], "insert %d %s %s\n", (i * 101) % num_rows + 1,
+				LONG_USERNAME, LONG_EMAIL);
 	}
+
+	cmds[num_rows] = ".exit\n";
+
+	p = expected;
+	for (int i = 0; i < num_rows; i++)
+		p += sprintf(p, "simpledb > Executed.\n");
+
+	sprintf(p, "simpledb > ");
+
+	run_script_with_options(cmds, options, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	for (int i = 0; i < num_rows; i++)
+		free(cmds[i]);
+
+	cmds[0] = "select\n";
+	cmds[1] = ".exit\n";
+	cmds[2] = NULL;
+
+	p = expected;
+	p += sprintf(p, "simpledb > ");
+	for (int i = 1; i <= num_rows; i++)
+		p += sprintf(p, "(%d, %s, %s)\n", i, LONG_USERNAME,
+				LONG_EMAIL);
+
+	sprintf(p, "Executed.\nsimpledb > ");
+
+	memset(output, 0x00, len);
+	run_script_with_options(cmds, options, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	free(cmds);
+	free(output);
+	free(expected);
 }
 
 Test(database, simply_exits)
@@ -311,14 +428,10 @@ Test(database, persists_data_to_disk)
 	remove(filename);
 }
 
-Test(database, prints_expected_constants)
+Test(database, evicts_frames_from_small_buffer_pool)
 {
-	char output[OUTPUT_MAX];
-	char *cmds[] = {
-		".constants\n",
-		".exit\n",
-		NULL
-	};
+	/* 3 rows per leaf, so the tree is many times the size of the pool */
+	char *options[] = { "-c", "8", "-p", "1024", NULL };
 	char filename[] = "XXXXXX.db";
 	int ret;
 
@@ -328,34 +441,23 @@ Test(database, prints_expected_constants)
 		exit(EXIT_FAILURE);
 	}
 
-	memset(output, 0x00, OUTPUT_MAX);
-	run_script(cmds, output, filename, OUTPUT_MAX);
-	cr_assert(eq(str, output, "simpledb > "
-					"Constants:\n"
-					"                 ROW_SIZE:   293\n"
-					"  COMMON_NODE_HEADER_SIZE:     6\n"
-					"    LEAF_NODE_HEADER_SIZE:    14\n"
-					"      LEAF_NODE_CELL_SIZE:   297\n"
-					"LEAF_NODE_SPACE_FOR_CELLS:  4082\n"
-					"      LEAF_NODE_MAX_CELLS:    13\n"
-					"simpledb > "));
+	check_round_trip(options, filename, 300);
 
 	remove(filename);
-	
 }
 
-Test(database, prints_expected_tree)
+Test(database, writes_back_only_dirty_pages)
 {
-	char output[OUTPUT_MAX];
 	char *cmds[] = {
-		"insert 3 user3 user3@example.com\n",
-		"insert 2 user2 user2@example.com\n",
-		"insert 1 user1 user1@example.com\n",
-		".btree\n",
+		"select\n",
 		".exit\n",
 		NULL
 	};
 	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 20;
+	struct stat before;
+	struct stat after;
+	char *output;
 	int ret;
 
 	ret = mkstemps(filename, 3);
@@ -364,44 +466,24 @@ Test(database, prints_expected_tree)
 		exit(EXIT_FAILURE);
 	}
 
-	memset(output, 0x00, OUTPUT_MAX);
-	run_script(cmds, output, filename, OUTPUT_MAX);
-	cr_assert(eq(str, output, "simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Tree:\n"
-					" - leaf (size 3)\n"
-					" - 1\n"
-					" - 2\n"
-					" - 3\n"
-					"simpledb > "));
+	check_round_trip(NULL, filename, 100);
+	stat(filename, &before);
+
+	/* nothing is dirtied by reading, so the file is never written */
+	output = calloc(len, 1);
+	run_script(cmds, output, filename, len - 1);
+	stat(filename, &after);
 
+	cr_assert(eq(int, before.st_mtim.tv_sec, after.st_mtim.tv_sec));
+	cr_assert(eq(int, before.st_mtim.tv_nsec, after.st_mtim.tv_nsec));
+
+	free(output);
 	remove(filename);
-	
 }
 
-Test(database, prints_expected_tree_with_internal_node)
+Test(database, persists_data_through_mmap)
 {
-	char output[OUTPUT_MAX];
-	char *cmds[] = {
-		"insert 14 user14 user14@example.com\n",
-		"insert 13 user13 user13@example.com\n",
-		"insert 12 user12 user12@example.com\n",
-		"insert 11 user11 user11@example.com\n",
-		"insert 10 user10 user10@example.com\n",
-		"insert 9 user9 user9@example.com\n",
-		"insert 8 user8 user8@example.com\n",
-		"insert 7 user7 user7@example.com\n",
-		"insert 6 user6 user6@example.com\n",
-		"insert 5 user5 user5@example.com\n",
-		"insert 4 user4 user4@example.com\n",
-		"insert 3 user3 user3@example.com\n",
-		"insert 2 user2 user2@example.com\n",
-		"insert 1 user1 user1@example.com\n",
-		".btree\n",
-		".exit\n",
-		NULL
-	};
+	char *options[] = { "-m", NULL };
 	char filename[] = "XXXXXX.db";
 	int ret;
 
@@ -411,71 +493,62 @@ Test(database, prints_expected_tree_with_internal_node)
 		exit(EXIT_FAILURE);
 	}
 
-	memset(output, 0x00, OUTPUT_MAX);
-	run_script(cmds, output, filename, OUTPUT_MAX);
-	cr_assert(eq(str, output, "simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Tree:\n"
-					" - internal (size 1)\n"
-					" - leaf (size 7)\n"
-					"  - 1\n"
-					"  - 2\n"
-					"  - 3\n"
-					"  - 4\n"
-					"  - 5\n"
-					"  - 6\n"
-					"  - 7\n"
-					" - key 7\n"
-					" - leaf (size 7)\n"
-					"  - 8\n"
-					"  - 9\n"
-					"  - 10\n"
-					"  - 11\n"
-					"  - 12\n"
-					"  - 13\n"
-					"  - 14\n"
-					"simpledb > "));
+	check_round_trip(options, filename, 300);
 
 	remove(filename);
-	
 }
 
-Test(database, traverses_internal_nodes)
+Test(database, persists_data_through_io_uring)
 {
-	char output[OUTPUT_MAX];
+	/* a small pool, so read-ahead batches go through the ring too */
+	char *options[] = { "-u", "-c", "8", "-p", "1024", NULL };
+	char filename[] = "XXXXXX.db";
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	check_round_trip(options, filename, 300);
+
+	remove(filename);
+}
+
+Test(database, persists_data_with_direct_io)
+{
+	char *options[] = { "-d", "-H", "-c", "8", NULL };
+	char filename[] = "XXXXXX.db";
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	check_round_trip(options, filename, 300);
+
+	remove(filename);
+}
+
+Test(database, persists_compressed_pages)
+{
+	/* 600 rows take ~200 pages, so the extent map outgrows a page */
+	char *options[] = { "-z", "-p", "1024", NULL };
 	char *cmds[] = {
-		"insert 1 user1 user1@example.com\n",
-		"insert 2 user2 user2@example.com\n",
-		"insert 5 user5 user5@example.com\n",
-		"insert 3 user3 user3@example.com\n",
-		"insert 4 user4 user4@example.com\n",
-		"insert 6 user6 user6@example.com\n",
-		"insert 7 user7 user7@example.com\n",
-		"insert 8 user8 user8@example.com\n",
-		"insert 9 user9 user9@example.com\n",
-		"insert 10 user10 user10@example.com\n",
-		"insert 11 user11 user11@example.com\n",
-		"insert 12 user12 user12@example.com\n",
-		"insert 13 user13 user13@example.com\n",
-		"insert 14 user14 user14@example.com\n",
-		"insert 15 user15 user15@example.com\n",
-		"select\n",
+		"select count(*)\n",
+		"select where id between 299 and 301\n",
 		".exit\n",
 		NULL
 	};
 	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 16;
+	char *expected;
+	char *output;
+	char **deletes;
+	char *p;
 	int ret;
 
 	ret = mkstemps(filename, 3);
@@ -484,83 +557,62 @@ Test(database, traverses_internal_nodes)
 		exit(EXIT_FAILURE);
 	}
 
-	memset(output, 0x00, OUTPUT_MAX);
-	run_script(cmds, output, filename, OUTPUT_MAX);
-	cr_assert(eq(str, output, "simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > (1, user1, user1@example.com)\n"
-					"(2, user2, user2@example.com)\n"
-					"(3, user3, user3@example.com)\n"
-					"(4, user4, user4@example.com)\n"
-					"(5, user5, user5@example.com)\n"
-					"(6, user6, user6@example.com)\n"
-					"(7, user7, user7@example.com)\n"
-					"(8, user8, user8@example.com)\n"
-					"(9, user9, user9@example.com)\n"
-					"(10, user10, user10@example.com)\n"
-					"(11, user11, user11@example.com)\n"
-					"(12, user12, user12@example.com)\n"
-					"(13, user13, user13@example.com)\n"
-					"(14, user14, user14@example.com)\n"
-					"(15, user15, user15@example.com)\n"
-					"Executed.\n"
-					"simpledb > "));
+	check_round_trip(options, filename, 600);
 
+	/* rewriting pages moves them to new extents */
+	deletes = calloc(300 + 2, sizeof(*deletes));
+	output = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	for (int i = 0; i < 300; i++) {
+		deletes[i] = malloc(32);
+		sprintf(deletes[i], "delete %d\n", i * 2 + 1);
+	}
+
+	deletes[300] = ".exit\n";
+
+	run_script_with_options(deletes, options, output, filename, len - 1);
+
+	p = expected;
+	p += sprintf(p, "simpledb > (300)\nExecuted.\n");
+	p += sprintf(p, "simpledb > (300, %s, %s)\nExecuted.\n",
+			LONG_USERNAME, LONG_EMAIL);
+	sprintf(p, "simpledb > ");
+
+	memset(output, 0x00, len);
+	run_script_with_options(cmds, options, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	for (int i = 0; i < 300; i++)
+		free(deletes[i]);
+
+	free(deletes);
+	free(output);
+	free(expected);
 	remove(filename);
 }
 
-Test(database, allows_printing_structure_f_leaf_node_btree)
+Test(database, stores_incompressible_pages_raw)
 {
-	char output[OUTPUT_MAX];
+	char *options[] = { "-z", NULL };
+	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 16;
+	uint32_t seed = 1;
+	struct stat st;
+	char *profile;
+	char *expected;
+	char *output;
+	char *insert;
 	char *cmds[] = {
-		"insert 1 user1 user1@example.com\n",
-		"insert 2 user2 user2@example.com\n",
-		"insert 5 user5 user5@example.com\n",
-		"insert 3 user3 user3@example.com\n",
-		"insert 4 user4 user4@example.com\n",
-		"insert 6 user6 user6@example.com\n",
-		"insert 7 user7 user7@example.com\n",
-		"insert 8 user8 user8@example.com\n",
-		"insert 9 user9 user9@example.com\n",
-		"insert 10 user10 user10@example.com\n",
-		"insert 11 user11 user11@example.com\n",
-		"insert 12 user12 user12@example.com\n",
-		"insert 13 user13 user13@example.com\n",
-		"insert 14 user14 user14@example.com\n",
-		"insert 15 user15 user15@example.com\n",
-		"insert 16 user16 user16@example.com\n",
-		"insert 17 user17 user17@example.com\n",
-		"insert 18 user18 user18@example.com\n",
-		"insert 19 user19 user19@example.com\n",
-		"insert 20 user20 user20@example.com\n",
-		"insert 21 user21 user21@example.com\n",
-		"insert 22 user22 user22@example.com\n",
-		"insert 23 user23 user23@example.com\n",
-		"insert 24 user24 user24@example.com\n",
-		"insert 25 user25 user25@example.com\n",
-		"insert 26 user26 user26@example.com\n",
-		"insert 27 user27 user27@example.com\n",
-		"insert 28 user28 user28@example.com\n",
-		"insert 29 user29 user29@example.com\n",
-		"insert 30 user30 user30@example.com\n",
-		".btree\n",
+		NULL,
+		".exit\n",
+		NULL
+	};
+	char *reopen[] = {
+		"select *\n",
 		".exit\n",
 		NULL
 	};
-	char filename[] = "XXXXXX.db";
 	int ret;
 
 	ret = mkstemps(filename, 3);
@@ -569,25 +621,386 @@ Test(database, allows_printing_structure_f_leaf_node_btree)
 		exit(EXIT_FAILURE);
 	}
 
-	memset(output, 0x00, OUTPUT_MAX);
-	run_script(cmds, output, filename, OUTPUT_MAX);
-	cr_assert(eq(str, output, "simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
-					"simpledb > Executed.\n"
+	/* xorshift noise leaves LZ nothing to match */
+	profile = calloc(10000 + 1, 1);
+	for (int i = 0; i < 10000; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		profile[i] = '!' + seed % 94;
+	}
+
+	insert = malloc(10000 + 64);
+	sprintf(insert, "insert 1 user1 person1@example.com %s\n", profile);
+	cmds[0] = insert;
+
+	output = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	run_script_with_options(cmds, options, output, filename, len - 1);
+	cr_assert(eq(str, output, "simpledb > Executed.\nsimpledb > "));
+
+	sprintf(expected, "simpledb > (1, user1, person1@example.com, %s)\n"
+			"Executed.\n"
+			"simpledb > ", profile);
+
+	memset(output, 0x00, len);
+	run_script_with_options(reopen, options, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	stat(filename, &st);
+	cr_assert(gt(sz, (size_t) st.st_size, 10000));
+
+	free(insert);
+	free(profile);
+	free(output);
+	free(expected);
+	remove(filename);
+}
+
+Test(database, reuses_freed_pages_after_reopen)
+{
+	char output[OUTPUT_MAX];
+	char filename[] = "XXXXXX.db";
+	struct stat before;
+	struct stat after;
+	char **cmds;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	check_round_trip(NULL, filename, 300);
+	stat(filename, &before);
+
+	cmds = calloc(300 + 2, sizeof(*cmds));
+	for (int i = 0; i < 300; i++) {
+		cmds[i] = malloc(32);
+		sprintf(cmds[i], "delete %d\n", i + 1);
+	}
+
+	cmds[300] = ".exit\n";
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX - 1);
+
+	for (int i = 0; i < 300; i++)
+		free(cmds[i]);
+
+	free(cmds);
+
+	/* the freed pages come off the freelist instead of growing the file */
+	check_round_trip(NULL, filename, 300);
+	stat(filename, &after);
+
+	cr_assert(eq(sz, (size_t) after.st_size, (size_t) before.st_size));
+
+	remove(filename);
+}
+
+Test(database, keeps_page_size_from_header)
+{
+	char *options1[] = { "-p", "1024", NULL };
+	char *options2[] = { "-p", "4096", NULL };
+	char output[OUTPUT_MAX];
+	char *cmds1[] = {
+		"insert 1 user1 person1@example.com\n",
+		".exit\n",
+		NULL
+	};
+	char *cmds2[] = {
+		".constants\n",
+		"select\n",
+		".exit\n",
+		NULL
+	};
+	char filename[] = "XXXXXX.db";
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script_with_options(cmds1, options1, output, filename, OUTPUT_MAX);
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script_with_options(cmds2, options2, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, "simpledb > "
+					"Constants:\n"
+					"                 ROW_SIZE:   365\n"
+					"  COMMON_NODE_HEADER_SIZE:     6\n"
+					"    LEAF_NODE_HEADER_SIZE:    18\n"
+					"      LEAF_NODE_CELL_SIZE:   373\n"
+					"LEAF_NODE_SPACE_FOR_CELLS:  1006\n"
+					"      LEAF_NODE_MAX_CELLS:     2\n"
+					"simpledb > "
+					"(1, user1, person1@example.com)\n"
+					"Executed.\n"
+					"simpledb > "));
+
+	remove(filename);
+}
+
+Test(database, rejects_file_with_bad_magic)
+{
+	char output[OUTPUT_MAX];
+	char *cmds[] = {
+		"select\n",
+		".exit\n",
+		NULL
+	};
+	char garbage[4096];
+	char filename[] = "XXXXXX.db";
+	char log[sizeof(filename) + 4];
+	struct stat st;
+	int fd;
+
+	fd = mkstemps(filename, 3);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	sprintf(log, "%s-wal", filename);
+
+	memset(garbage, 'x', sizeof(garbage));
+	write(fd, garbage, sizeof(garbage));
+	close(fd);
+
+	/* refused before the prompt, and the file is left alone */
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, ""));
+	cr_assert(eq(int, access(log, F_OK), -1));
+
+	stat(filename, &st);
+	cr_assert(eq(sz, (size_t) st.st_size, sizeof(garbage)));
+
+	remove(filename);
+}
+
+Test(database, rejects_unsupported_format_version)
+{
+	char output[OUTPUT_MAX];
+	char *cmds[] = {
+		"select\n",
+		".exit\n",
+		NULL
+	};
+	char filename[] = "XXXXXX.db";
+	char log[sizeof(filename) + 4];
+	uint32_t version = 0xdead;
+	int fd;
+
+	fd = mkstemps(filename, 3);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	sprintf(log, "%s-wal", filename);
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX);
+
+	/* the version follows the magic and the two freelist words */
+	pwrite(fd, &version, sizeof(version), 16 + 2 * sizeof(uint32_t));
+	close(fd);
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, ""));
+	cr_assert(eq(int, access(log, F_OK), -1));
+
+	remove(filename);
+}
+
+Test(database, grows_reopened_mapping_with_small_pages)
+{
+	/* 1 KiB pages leave the file off a system page boundary on close */
+	char *options[] = { "-m", "-p", "1024", NULL };
+	char output[OUTPUT_MAX];
+	char *cmds1[] = {
+		"insert 1 user1 person1@example.com\n",
+		".exit\n",
+		NULL
+	};
+	char *cmds3[] = {
+		"select count(*)\n",
+		"select where id = 1\n",
+		".exit\n",
+		NULL
+	};
+	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 16;
+	char *expected;
+	char *results;
+	char **cmds;
+	char *p;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script_with_options(cmds1, options, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, "simpledb > "
+					"Executed.\n"
+					"simpledb > "));
+
+	cmds = calloc(300 + 1, sizeof(*cmds));
+	results = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	/* 3 rows per leaf, so the mapping is extended several times */
+	for (int i = 0; i < 299; i++) {
+		cmds[i] = malloc(512);
+		sprintf(cmds[i], "insert %d %s %s\n", i + 2, LONG_USERNAME,
+				LONG_EMAIL);
+	}
+
+	cmds[299] = ".exit\n";
+
+	p = expected;
+	for (int i = 0; i < 299; i++)
+		p += sprintf(p, "simpledb > Executed.\n");
+
+	sprintf(p, "simpledb > ");
+
+	run_script_with_options(cmds, options, results, filename, len - 1);
+	cr_assert(eq(str, results, expected));
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script_with_options(cmds3, options, output, filename,
+			OUTPUT_MAX - 1);
+	cr_assert(eq(str, output, "simpledb > (300)\n"
+					"Executed.\n"
+					"simpledb > "
+					"(1, user1, person1@example.com)\n"
+					"Executed.\n"
+					"simpledb > "));
+
+	for (int i = 0; i < 299; i++)
+		free(cmds[i]);
+
+	free(cmds);
+	free(results);
+	free(expected);
+	remove(filename);
+}
+
+Test(database, prints_expected_constants)
+{
+	char output[OUTPUT_MAX];
+	char *cmds[] = {
+		".constants\n",
+		".exit\n",
+		NULL
+	};
+	char filename[] = "XXXXXX.db";
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, "simpledb > "
+					"Constants:\n"
+					"                 ROW_SIZE:   365\n"
+					"  COMMON_NODE_HEADER_SIZE:     6\n"
+					"    LEAF_NODE_HEADER_SIZE:    18\n"
+					"      LEAF_NODE_CELL_SIZE:   373\n"
+					"LEAF_NODE_SPACE_FOR_CELLS:  4078\n"
+					"      LEAF_NODE_MAX_CELLS:    10\n"
+					"simpledb > "));
+
+	remove(filename);
+	
+}
+
+Test(database, prints_expected_tree)
+{
+	char output[OUTPUT_MAX];
+	char *cmds[] = {
+		"insert 3 user3 user3@example.com\n",
+		"insert 2 user2 user2@example.com\n",
+		"insert 1 user1 user1@example.com\n",
+		".btree\n",
+		".exit\n",
+		NULL
+	};
+	char filename[] = "XXXXXX.db";
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, "simpledb > Executed.\n"
 					"simpledb > Executed.\n"
 					"simpledb > Executed.\n"
+					"simpledb > Tree:\n"
+					" - leaf (size 3)\n"
+					" - 1\n"
+					" - 2\n"
+					" - 3\n"
+					"simpledb > "));
+
+	remove(filename);
+	
+}
+
+Test(database, prints_expected_tree_with_internal_node)
+{
+	char output[OUTPUT_MAX];
+	char *cmds[] = {
+		"insert 14 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 13 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 12 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 11 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 10 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 9 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 8 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 7 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 6 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 5 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 4 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 3 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 2 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 1 " LONG_USERNAME " " LONG_EMAIL "\n",
+		".btree\n",
+		".exit\n",
+		NULL
+	};
+	char filename[] = "XXXXXX.db";
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, "simpledb > Executed.\n"
 					"simpledb > Executed.\n"
 					"simpledb > Executed.\n"
 					"simpledb > Executed.\n"
@@ -602,7 +1015,7 @@ Test(database, allows_printing_structure_f_leaf_node_btree)
 					"simpledb > Executed.\n"
 					"simpledb > Executed.\n"
 					"simpledb > Tree:\n"
-					" - internal (size 3)\n"
+					" - internal (size 1)\n"
 					" - leaf (size 7)\n"
 					"  - 1\n"
 					"  - 2\n"
@@ -612,7 +1025,7 @@ Test(database, allows_printing_structure_f_leaf_node_btree)
 					"  - 6\n"
 					"  - 7\n"
 					" - key 7\n"
-					" - leaf (size 8)\n"
+					" - leaf (size 7)\n"
 					"  - 8\n"
 					"  - 9\n"
 					"  - 10\n"
@@ -620,22 +1033,194 @@ Test(database, allows_printing_structure_f_leaf_node_btree)
 					"  - 12\n"
 					"  - 13\n"
 					"  - 14\n"
-					"  - 15\n"
-					" - key 15\n"
-					" - leaf (size 7)\n"
-					"  - 16\n"
-					"  - 17\n"
-					"  - 18\n"
-					"  - 19\n"
-					"  - 20\n"
-					"  - 21\n"
-					"  - 22\n"
-					" - key 22\n"
-					" - leaf (size 8)\n"
-					"  - 23\n"
-					"  - 24\n"
-					"  - 25\n"
-					"  - 26\n"
+					"simpledb > "));
+
+	remove(filename);
+	
+}
+
+Test(database, traverses_internal_nodes)
+{
+	char output[OUTPUT_MAX];
+	char *cmds[] = {
+		"insert 1 user1 user1@example.com\n",
+		"insert 2 user2 user2@example.com\n",
+		"insert 5 user5 user5@example.com\n",
+		"insert 3 user3 user3@example.com\n",
+		"insert 4 user4 user4@example.com\n",
+		"insert 6 user6 user6@example.com\n",
+		"insert 7 user7 user7@example.com\n",
+		"insert 8 user8 user8@example.com\n",
+		"insert 9 user9 user9@example.com\n",
+		"insert 10 user10 user10@example.com\n",
+		"insert 11 user11 user11@example.com\n",
+		"insert 12 user12 user12@example.com\n",
+		"insert 13 user13 user13@example.com\n",
+		"insert 14 user14 user14@example.com\n",
+		"insert 15 user15 user15@example.com\n",
+		"select\n",
+		".exit\n",
+		NULL
+	};
+	char filename[] = "XXXXXX.db";
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, "simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > (1, user1, user1@example.com)\n"
+					"(2, user2, user2@example.com)\n"
+					"(3, user3, user3@example.com)\n"
+					"(4, user4, user4@example.com)\n"
+					"(5, user5, user5@example.com)\n"
+					"(6, user6, user6@example.com)\n"
+					"(7, user7, user7@example.com)\n"
+					"(8, user8, user8@example.com)\n"
+					"(9, user9, user9@example.com)\n"
+					"(10, user10, user10@example.com)\n"
+					"(11, user11, user11@example.com)\n"
+					"(12, user12, user12@example.com)\n"
+					"(13, user13, user13@example.com)\n"
+					"(14, user14, user14@example.com)\n"
+					"(15, user15, user15@example.com)\n"
+					"Executed.\n"
+					"simpledb > "));
+
+	remove(filename);
+}
+
+Test(database, allows_printing_structure_f_leaf_node_btree)
+{
+	char output[OUTPUT_MAX];
+	char *cmds[] = {
+		"insert 1 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 2 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 5 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 3 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 4 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 6 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 7 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 8 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 9 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 10 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 11 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 12 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 13 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 14 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 15 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 16 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 17 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 18 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 19 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 20 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 21 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 22 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 23 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 24 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 25 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 26 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 27 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 28 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 29 " LONG_USERNAME " " LONG_EMAIL "\n",
+		"insert 30 " LONG_USERNAME " " LONG_EMAIL "\n",
+		".btree\n",
+		".exit\n",
+		NULL
+	};
+	char filename[] = "XXXXXX.db";
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, "simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Tree:\n"
+					" - internal (size 2)\n"
+					" - leaf (size 13)\n"
+					"  - 1\n"
+					"  - 2\n"
+					"  - 3\n"
+					"  - 4\n"
+					"  - 5\n"
+					"  - 6\n"
+					"  - 7\n"
+					"  - 8\n"
+					"  - 9\n"
+					"  - 10\n"
+					"  - 11\n"
+					"  - 12\n"
+					"  - 13\n"
+					" - key 13\n"
+					" - leaf (size 13)\n"
+					"  - 14\n"
+					"  - 15\n"
+					"  - 16\n"
+					"  - 17\n"
+					"  - 18\n"
+					"  - 19\n"
+					"  - 20\n"
+					"  - 21\n"
+					"  - 22\n"
+					"  - 23\n"
+					"  - 24\n"
+					"  - 25\n"
+					"  - 26\n"
+					" - key 26\n"
+					" - leaf (size 4)\n"
 					"  - 27\n"
 					"  - 28\n"
 					"  - 29\n"
@@ -645,6 +1230,1025 @@ Test(database, allows_printing_structure_f_leaf_node_btree)
 	remove(filename);
 }
 
+Test(database, packs_short_rows_into_one_leaf)
+{
+	char output[OUTPUT_MAX];
+	char *cmds[] = {
+		"insert 1 user1 person1@example.com\n",
+		"insert 2 user2 person2@example.com\n",
+		"insert 3 user3 person3@example.com\n",
+		"insert 4 user4 person4@example.com\n",
+		"insert 5 user5 person5@example.com\n",
+		"insert 6 user6 person6@example.com\n",
+		"insert 7 user7 person7@example.com\n",
+		"insert 8 user8 person8@example.com\n",
+		"insert 9 user9 person9@example.com\n",
+		"insert 10 user10 person10@example.com\n",
+		"insert 11 user11 person11@example.com\n",
+		"insert 12 user12 person12@example.com\n",
+		"insert 13 user13 person13@example.com\n",
+		"insert 14 user14 person14@example.com\n",
+		"insert 15 user15 person15@example.com\n",
+		"insert 16 user16 person16@example.com\n",
+		"insert 17 user17 person17@example.com\n",
+		"insert 18 user18 person18@example.com\n",
+		"insert 19 user19 person19@example.com\n",
+		"insert 20 user20 person20@example.com\n",
+		".btree\n",
+		".exit\n",
+		NULL
+	};
+	char filename[] = "XXXXXX.db";
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, "simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Tree:\n"
+					" - leaf (size 20)\n"
+					" - 1\n"
+					" - 2\n"
+					" - 3\n"
+					" - 4\n"
+					" - 5\n"
+					" - 6\n"
+					" - 7\n"
+					" - 8\n"
+					" - 9\n"
+					" - 10\n"
+					" - 11\n"
+					" - 12\n"
+					" - 13\n"
+					" - 14\n"
+					" - 15\n"
+					" - 16\n"
+					" - 17\n"
+					" - 18\n"
+					" - 19\n"
+					" - 20\n"
+					"simpledb > "));
+
+	remove(filename);
+}
+
+Test(database, splits_internal_nodes)
+{
+	/* 3 rows per leaf, so 1500 rows overflow a single internal node */
+	char *options[] = { "-p", "1024", NULL };
+	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 20;
+	char *expected;
+	char *output;
+	char **cmds;
+	char *p;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	cmds = calloc(1500 + 3, sizeof(*cmds));
+	output = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	for (int i = 0; i < 1500; i++) {
+		int id = (i * 601) % 1500 + 1;
+
+		cmds[i] = malloc(512);
+		sprintf(cmds[i], "insert %d %s %s\n", id, LONG_USERNAME,
+				LONG_EMAIL);
+	}
+
+	cmds[1500] = "select\n";
+	cmds[1501] = ".exit\n";
+
+	p = expected;
+	for (int i = 0; i < 1500; i++)
+		p += sprintf(p, "simpledb > Executed.\n");
+
+	p += sprintf(p, "simpledb > ");
+	for (int i = 1; i <= 1500; i++)
+		p += sprintf(p, "(%d, %s, %s)\n", i, LONG_USERNAME,
+				LONG_EMAIL);
+
+	sprintf(p, "Executed.\nsimpledb > ");
+
+	run_script_with_options(cmds, options, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	for (int i = 0; i < 1500; i++)
+		free(cmds[i]);
+
+	free(cmds);
+	free(output);
+	free(expected);
+	remove(filename);
+}
+
+Test(database, bulk_loads_sorted_rows)
+{
+	char output[OUTPUT_MAX];
+	char datafile[] = "XXXXXX.txt";
+	char filename[] = "XXXXXX.db";
+	char load[64];
+	char *cmds[] = {
+		load,
+		".btree\n",
+		".exit\n",
+		NULL
+	};
+	FILE *data;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	ret = mkstemps(datafile, 4);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	data = fdopen(ret, "w");
+	for (int i = 1; i <= 30; i++)
+		fprintf(data, "%d %s %s\n", i, LONG_USERNAME, LONG_EMAIL);
+	fclose(data);
+
+	sprintf(load, ".load %s\n", datafile);
+
+	/* leaves are packed full instead of split in half */
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, "simpledb > Loaded 30 rows.\n"
+					"simpledb > Tree:\n"
+					" - internal (size 2)\n"
+					" - leaf (size 13)\n"
+					"  - 1\n"
+					"  - 2\n"
+					"  - 3\n"
+					"  - 4\n"
+					"  - 5\n"
+					"  - 6\n"
+					"  - 7\n"
+					"  - 8\n"
+					"  - 9\n"
+					"  - 10\n"
+					"  - 11\n"
+					"  - 12\n"
+					"  - 13\n"
+					" - key 13\n"
+					" - leaf (size 13)\n"
+					"  - 14\n"
+					"  - 15\n"
+					"  - 16\n"
+					"  - 17\n"
+					"  - 18\n"
+					"  - 19\n"
+					"  - 20\n"
+					"  - 21\n"
+					"  - 22\n"
+					"  - 23\n"
+					"  - 24\n"
+					"  - 25\n"
+					"  - 26\n"
+					" - key 26\n"
+					" - leaf (size 4)\n"
+					"  - 27\n"
+					"  - 28\n"
+					"  - 29\n"
+					"  - 30\n"
+					"simpledb > "));
+
+	remove(datafile);
+	remove(filename);
+}
+
+Test(database, stores_large_profiles_in_overflow_pages)
+{
+	/* the profile spans three overflow pages */
+	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 16;
+	char *profile;
+	char *expected;
+	char *output;
+	char *insert;
+	char *p;
+	char *cmds[] = {
+		NULL,
+		"insert 2 user2 person2@example.com short\n",
+		"select\n",
+		"select *\n",
+		".exit\n",
+		NULL
+	};
+	char *reopen[] = {
+		"select *\n",
+		".exit\n",
+		NULL
+	};
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	profile = calloc(10000 + 1, 1);
+	for (int i = 0; i < 10000; i++)
+		profile[i] = 'a' + i % 26;
+
+	insert = malloc(10000 + 64);
+	sprintf(insert, "insert 1 user1 person1@example.com %s\n", profile);
+	cmds[0] = insert;
+
+	output = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	p = expected;
+	p += sprintf(p, "simpledb > Executed.\n"
+			"simpledb > Executed.\n"
+			"simpledb > (1, user1, person1@example.com)\n"
+			"(2, user2, person2@example.com)\n"
+			"Executed.\n");
+	p += sprintf(p, "simpledb > (1, user1, person1@example.com, %s)\n"
+			"(2, user2, person2@example.com, short)\n"
+			"Executed.\n"
+			"simpledb > ", profile);
+
+	run_script(cmds, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	p = expected;
+	p += sprintf(p, "simpledb > (1, user1, person1@example.com, %s)\n"
+			"(2, user2, person2@example.com, short)\n"
+			"Executed.\n"
+			"simpledb > ", profile);
+
+	memset(output, 0x00, len);
+	run_script(reopen, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	free(insert);
+	free(profile);
+	free(output);
+	free(expected);
+	remove(filename);
+}
+
+Test(database, deletes_rows_and_shrinks_tree)
+{
+	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 16;
+	char *expected;
+	char *output;
+	char **cmds;
+	char *p;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	cmds = calloc(30 + 20 + 4, sizeof(*cmds));
+	output = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	for (int i = 0; i < 30; i++) {
+		cmds[i] = malloc(512);
+		sprintf(cmds[i], "insert %d %s %s\n", i + 1, LONG_USERNAME,
+				LONG_EMAIL);
+	}
+
+	/* the leaves merge back into the root one by one */
+	for (int i = 0; i < 20; i++) {
+		cmds[30 + i] = malloc(32);
+		sprintf(cmds[30 + i], "delete %d\n", i + 11);
+	}
+
+	cmds[50] = "delete 30\n";
+	cmds[51] = ".btree\n";
+	cmds[52] = ".exit\n";
+
+	p = expected;
+	for (int i = 0; i < 50; i++)
+		p += sprintf(p, "simpledb > Executed.\n");
+
+	p += sprintf(p, "simpledb > Error: Key not found.\n"
+			"simpledb > Tree:\n"
+			" - leaf (size 10)\n");
+	for (int i = 1; i <= 10; i++)
+		p += sprintf(p, " - %d\n", i);
+
+	sprintf(p, "simpledb > ");
+
+	run_script(cmds, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	for (int i = 0; i < 50; i++)
+		free(cmds[i]);
+
+	free(cmds);
+	free(output);
+	free(expected);
+	remove(filename);
+}
+
+Test(database, drops_leaf_hint_when_leaves_merge)
+{
+	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 16;
+	char *expected;
+	char *output;
+	char **cmds;
+	char *p;
+	int n = 0;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	cmds = calloc(60 + 20 + 6 + 2 * 20 + 3, sizeof(*cmds));
+	output = calloc(len, 1);
+	expected = calloc(len, 1);
+	p = expected;
+
+	for (int i = 0; i < 60; i++) {
+		cmds[n] = malloc(512);
+		sprintf(cmds[n++], "insert %d %s %s\n", i + 1, LONG_USERNAME,
+				LONG_EMAIL);
+		p += sprintf(p, "simpledb > Executed.\n");
+	}
+
+	/*
+	 * Leaves of 13 rows. Emptying the last ones starts a freelist
+	 * trunk and leaves 27-35 and 36-40 as the last two leaves.
+	 */
+	for (int i = 41; i <= 60; i++) {
+		cmds[n] = malloc(32);
+		sprintf(cmds[n++], "delete %d\n", i);
+		p += sprintf(p, "simpledb > Executed.\n");
+	}
+
+	/* hint the last leaf, then merge it into the one before */
+	cmds[n] = malloc(32);
+	sprintf(cmds[n++], "select where id = 38\n");
+	p += sprintf(p, "simpledb > (38, %s, %s)\nExecuted.\n",
+			LONG_USERNAME, LONG_EMAIL);
+
+	cmds[n] = malloc(32);
+	sprintf(cmds[n++], "delete 36\n");
+	p += sprintf(p, "simpledb > Executed.\n");
+
+	/* a stale hint would find the freed leaf, empty */
+	cmds[n] = malloc(32);
+	sprintf(cmds[n++], "select where id = 38\n");
+	p += sprintf(p, "simpledb > (38, %s, %s)\nExecuted.\n",
+			LONG_USERNAME, LONG_EMAIL);
+
+	cmds[n] = malloc(64);
+	sprintf(cmds[n++], "update 39 user39 person39@example.com\n");
+	p += sprintf(p, "simpledb > Executed.\n");
+
+	/* splitting again takes the freed leaves back off the freelist */
+	for (int i = 41; i <= 60; i++) {
+		cmds[n] = malloc(32);
+		sprintf(cmds[n++], "select where id = %d\n", i % 2 ? 35 : 37);
+		p += sprintf(p, "simpledb > (%d, %s, %s)\nExecuted.\n",
+				i % 2 ? 35 : 37, LONG_USERNAME, LONG_EMAIL);
+
+		cmds[n] = malloc(512);
+		sprintf(cmds[n++], "insert %d %s %s\n", i, LONG_USERNAME,
+				LONG_EMAIL);
+		p += sprintf(p, "simpledb > Executed.\n");
+	}
+
+	cmds[n] = malloc(64);
+	sprintf(cmds[n++], "select where id between 33 and 42\n");
+	p += sprintf(p, "simpledb > ");
+	for (int i = 33; i <= 42; i++) {
+		if (i == 39)
+			p += sprintf(p, "(39, user39, person39@example.com)\n");
+		else if (i != 36)
+			p += sprintf(p, "(%d, %s, %s)\n", i, LONG_USERNAME,
+					LONG_EMAIL);
+	}
+
+	p += sprintf(p, "Executed.\n");
+
+	cmds[n] = malloc(32);
+	sprintf(cmds[n++], ".exit\n");
+	sprintf(p, "simpledb > ");
+
+	run_script(cmds, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	for (int i = 0; i < n; i++)
+		free(cmds[i]);
+
+	free(cmds);
+	free(output);
+	free(expected);
+	remove(filename);
+}
+
+Test(database, updates_rows_in_place)
+{
+	char output[OUTPUT_MAX];
+	char *cmds[] = {
+		"insert 1 user1 person1@example.com about-me\n",
+		"insert 2 user2 person2@example.com\n",
+		"update 1 alice alice@example.com\n",
+		"update 2 bob b@example.com new-profile\n",
+		"update 3 carol carol@example.com\n",
+		"select *\n",
+		".exit\n",
+		NULL
+	};
+	char filename[] = "XXXXXX.db";
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	/* leaving the profile out keeps the old one */
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds, output, filename, OUTPUT_MAX);
+	cr_assert(eq(str, output, "simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Error: Key not found.\n"
+					"simpledb > (1, alice, alice@example.com, about-me)\n"
+					"(2, bob, b@example.com, new-profile)\n"
+					"Executed.\n"
+					"simpledb > "));
+
+	remove(filename);
+}
+
+Test(database, selects_rows_by_id_and_range)
+{
+	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 16;
+	char *expected;
+	char *output;
+	char **cmds;
+	char *p;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	cmds = calloc(30 + 5, sizeof(*cmds));
+	output = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	for (int i = 0; i < 30; i++) {
+		cmds[i] = malloc(512);
+		sprintf(cmds[i], "insert %d %s %s\n", i + 1, LONG_USERNAME,
+				LONG_EMAIL);
+	}
+
+	/* 13 rows per leaf, so the range crosses into the second leaf */
+	cmds[30] = "select where id = 27\n";
+	cmds[31] = "select where id = 31\n";
+	cmds[32] = "select where id between 12 and 15\n";
+	cmds[33] = ".exit\n";
+
+	p = expected;
+	for (int i = 0; i < 30; i++)
+		p += sprintf(p, "simpledb > Executed.\n");
+
+	p += sprintf(p, "simpledb > (27, %s, %s)\nExecuted.\n",
+			LONG_USERNAME, LONG_EMAIL);
+	p += sprintf(p, "simpledb > Executed.\n");
+	p += sprintf(p, "simpledb > ");
+	for (int i = 12; i <= 15; i++)
+		p += sprintf(p, "(%d, %s, %s)\n", i, LONG_USERNAME,
+				LONG_EMAIL);
+
+	sprintf(p, "Executed.\nsimpledb > ");
+
+	run_script(cmds, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	for (int i = 0; i < 30; i++)
+		free(cmds[i]);
+
+	free(cmds);
+	free(output);
+	free(expected);
+	remove(filename);
+}
+
+Test(database, counts_and_pages_rows_from_subtree_counts)
+{
+	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 16;
+	char *expected;
+	char *output;
+	char **cmds;
+	char *p;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	cmds = calloc(30 + 5, sizeof(*cmds));
+	output = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	for (int i = 0; i < 30; i++) {
+		cmds[i] = malloc(512);
+		sprintf(cmds[i], "insert %d %s %s\n", i + 1, LONG_USERNAME,
+				LONG_EMAIL);
+	}
+
+	cmds[30] = "select count(*)\n";
+	cmds[31] = "select count(*) where id between 10 and 20\n";
+	cmds[32] = "select limit 2 offset 25\n";
+	cmds[33] = ".exit\n";
+
+	p = expected;
+	for (int i = 0; i < 30; i++)
+		p += sprintf(p, "simpledb > Executed.\n");
+
+	p += sprintf(p, "simpledb > (30)\nExecuted.\n");
+	p += sprintf(p, "simpledb > (11)\nExecuted.\n");
+	p += sprintf(p, "simpledb > ");
+	for (int i = 26; i <= 27; i++)
+		p += sprintf(p, "(%d, %s, %s)\n", i, LONG_USERNAME,
+				LONG_EMAIL);
+
+	sprintf(p, "Executed.\nsimpledb > ");
+
+	run_script(cmds, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	for (int i = 0; i < 30; i++)
+		free(cmds[i]);
+
+	free(cmds);
+	free(output);
+	free(expected);
+	remove(filename);
+}
+
+Test(database, recovers_committed_statements_from_log)
+{
+	char output[OUTPUT_MAX];
+	char *cmds1[] = {
+		"insert 1 user1 person1@example.com\n",
+		"insert 2 user2 person2@example.com\n",
+		"delete 1\n",
+		NULL
+	};
+	char *cmds2[] = {
+		"select\n",
+		".exit\n",
+		NULL
+	};
+	char *options[] = { "-s", "full", NULL };
+	char filename[] = "XXXXXX.db";
+	char log[sizeof(filename) + 4];
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	sprintf(log, "%s-wal", filename);
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_child(cmds1, options, output, filename, OUTPUT_MAX - 1, true);
+
+	cr_assert(eq(str, output, "simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Executed.\n"
+					"simpledb > Error reading input\n"));
+	cr_assert(eq(int, access(log, F_OK), 0));
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds2, output, filename, OUTPUT_MAX - 1);
+
+	cr_assert(eq(str, output, "simpledb > "
+					"(2, user2, person2@example.com)\n"
+					"Executed.\n"
+					"simpledb > "));
+	cr_assert(eq(int, access(log, F_OK), -1));
+
+	remove(filename);
+}
+
+Test(database, checkpoints_log_while_running)
+{
+	char output[OUTPUT_MAX];
+	char *cmds2[] = {
+		"select count(*)\n",
+		".exit\n",
+		NULL
+	};
+	char filename[] = "XXXXXX.db";
+	size_t len = 1000 * 32 + OUTPUT_MAX;
+	char *expected;
+	char *results;
+	struct stat st;
+	char **cmds;
+	char *p;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	cmds = calloc(1000 + 1, sizeof(*cmds));
+	results = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	for (int i = 0; i < 1000; i++) {
+		cmds[i] = malloc(512);
+		sprintf(cmds[i], "insert %d %s %s\n", i + 1, LONG_USERNAME,
+				LONG_EMAIL);
+	}
+
+	p = expected;
+	for (int i = 0; i < 1000; i++)
+		p += sprintf(p, "simpledb > Executed.\n");
+
+	sprintf(p, "simpledb > Error reading input\n");
+
+	/* never closed, only checkpoints can have written the rows */
+	run_child(cmds, NULL, results, filename, len - 1, true);
+	cr_assert(eq(str, results, expected));
+
+	stat(filename, &st);
+	cr_assert(gt(sz, (size_t) st.st_size, 30 * 4096));
+
+	memset(output, 0x00, OUTPUT_MAX);
+	run_script(cmds2, output, filename, OUTPUT_MAX - 1);
+
+	cr_assert(eq(str, output, "simpledb > (1000)\n"
+					"Executed.\n"
+					"simpledb > "));
+
+	for (int i = 0; i < 1000; i++)
+		free(cmds[i]);
+
+	free(cmds);
+	free(results);
+	free(expected);
+	remove(filename);
+}
+
+Test(database, reads_snapshots_in_copy_on_write_mode)
+{
+	/* small pages, so writes split and publish new node images */
+	char *options[] = { "-w", "-p", "1024", NULL };
+	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 16;
+	char *expected;
+	char *output;
+	char **cmds;
+	char *p;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	cmds = calloc(400 + 4, sizeof(*cmds));
+	output = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	for (int i = 0; i < 300; i++) {
+		cmds[i] = malloc(512);
+		sprintf(cmds[i], "insert %d %s %s\n", (i * 101) % 300 + 1,
+				LONG_USERNAME, LONG_EMAIL);
+	}
+
+	for (int i = 0; i < 100; i++) {
+		cmds[300 + i] = malloc(32);
+		sprintf(cmds[300 + i], "delete %d\n", i * 3 + 1);
+	}
+
+	cmds[400] = "select count(*)\n";
+	cmds[401] = "select where id between 148 and 152\n";
+	cmds[402] = ".exit\n";
+
+	p = expected;
+	for (int i = 0; i < 400; i++)
+		p += sprintf(p, "simpledb > Executed.\n");
+
+	p += sprintf(p, "simpledb > (200)\nExecuted.\n");
+	p += sprintf(p, "simpledb > ");
+	for (int i = 148; i <= 152; i++)
+		if (i % 3 != 1)
+			p += sprintf(p, "(%d, %s, %s)\n", i, LONG_USERNAME,
+					LONG_EMAIL);
+
+	sprintf(p, "Executed.\nsimpledb > ");
+
+	run_script_with_options(cmds, options, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	for (int i = 0; i < 400; i++)
+		free(cmds[i]);
+
+	free(cmds);
+	free(output);
+	free(expected);
+	remove(filename);
+}
+
+Test(database, scans_partitions_in_parallel)
+{
+	/* 3 rows per leaf, so the tree has plenty of separators to cut at */
+	char *options[] = { "-j", "4", "-p", "1024", NULL };
+	char filename[] = "XXXXXX.db";
+	size_t len = 1 << 20;
+	bool seen[1500] = { false };
+	char *expected;
+	char *output;
+	char **cmds;
+	char *p;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	cmds = calloc(1500 + 3, sizeof(*cmds));
+	output = calloc(len, 1);
+	expected = calloc(len, 1);
+
+	for (int i = 0; i < 1500; i++) {
+		cmds[i] = malloc(512);
+		sprintf(cmds[i], "insert %d %s %s\n", (i * 601) % 1500 + 1,
+				LONG_USERNAME, LONG_EMAIL);
+	}
+
+	cmds[1500] = "select where id between 101 and 1400\n";
+	cmds[1501] = ".exit\n";
+
+	p = expected;
+	for (int i = 0; i < 1500; i++)
+		p += sprintf(p, "simpledb > Executed.\n");
+
+	p += sprintf(p, "simpledb > ");
+	for (int i = 101; i <= 1400; i++)
+		p += sprintf(p, "(%d, %s, %s)\n", i, LONG_USERNAME,
+				LONG_EMAIL);
+
+	sprintf(p, "Executed.\nsimpledb > ");
+
+	run_script_with_options(cmds, options, output, filename, len - 1);
+	cr_assert(eq(str, output, expected));
+
+	for (int i = 0; i < 1500; i++)
+		free(cmds[i]);
+
+	/* unordered, every row still comes exactly once */
+	cmds[0] = "select unordered\n";
+	cmds[1] = ".exit\n";
+	cmds[2] = NULL;
+
+	memset(output, 0x00, len);
+	run_script_with_options(cmds, options, output, filename, len - 1);
+
+	p = strchr(output, '(');
+	while (p) {
+		int id = atoi(p + 1);
+
+		cr_assert(id >= 1 && id <= 1500 && !seen[id - 1]);
+		seen[id - 1] = true;
+		p = strchr(p + 1, '(');
+	}
+
+	for (int i = 0; i < 1500; i++)
+		cr_assert(seen[i]);
+
+	free(cmds);
+	free(output);
+	free(expected);
+	remove(filename);
+}
+
+/* Look key up the way a point select does, holding its leaf latched */
+static bool table_has_key(struct table *table, uint32_t key)
+{
+	struct cursor *cursor;
+	bool found;
+	void *node;
+
+	pager_begin(table->pager);
+	table_latch(table, LATCH_SHARED);
+
+	cursor = table_find_latched(table, key, LATCH_SHARED);
+	node = get_page(table->pager, cursor->page_num);
+	found = cursor->cell_num < *leaf_node_num_cells(node) &&
+		*leaf_node_key(node, cursor->cell_num) == key;
+	unpin_page(table->pager, cursor->page_num);
+
+	cursor_close(cursor);
+	table_unlatch(table);
+	pager_commit(table->pager);
+
+	return found;
+}
+
+static void table_insert_key(struct table *table, uint32_t key)
+{
+	struct statement statement = {
+		.type = STATEMENT_INSERT,
+		.row = {
+			.id = key,
+			.username = LONG_USERNAME,
+			.email = LONG_EMAIL,
+		},
+	};
+
+	execute_statement(&statement, table);
+}
+
+struct concurrent_worker {
+	pthread_t thread;
+	struct table *table;
+	uint32_t first;
+	uint32_t num_keys;
+	bool writer;
+	uint32_t missing;
+};
+
+/*
+ * Writers insert every other odd key from first, readers keep looking
+ * up the even keys which were there before any writer started.
+ */
+static void *concurrent_worker(void *arg)
+{
+	struct concurrent_worker *worker = arg;
+
+	for (uint32_t i = 0; i < worker->num_keys; i++) {
+		uint32_t key = worker->first + 4 * i;
+
+		if (worker->writer)
+			table_insert_key(worker->table, key);
+		else if (!table_has_key(worker->table, key % 1000 * 2 + 2))
+			worker->missing++;
+	}
+
+	return NULL;
+}
+
+Test(database, looks_up_keys_while_inserting)
+{
+	/* 3 rows per leaf, so the writers split all the time */
+	struct concurrent_worker workers[4];
+	struct pager_options options;
+	char filename[] = "XXXXXX.db";
+	struct table *table;
+	int ret;
+
+	ret = mkstemps(filename, 3);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to create filename");
+		exit(EXIT_FAILURE);
+	}
+
+	pager_default_options(&options);
+	options.page_size = 1024;
+	table = db_open(filename, &options);
+
+	for (uint32_t key = 2; key <= 2000; key += 2)
+		table_insert_key(table, key);
+
+	for (int i = 0; i < 4; i++) {
+		workers[i].table = table;
+		workers[i].first = i % 2 ? 3 : 1;
+		workers[i].num_keys = i < 2 ? 500 : 5000;
+		workers[i].writer = i < 2;
+		workers[i].missing = 0;
+		pthread_create(&workers[i].thread, NULL, concurrent_worker,
+				&workers[i]);
+	}
+
+	for (int i = 0; i < 4; i++) {
+		pthread_join(workers[i].thread, NULL);
+		cr_assert(eq(int, workers[i].missing, 0));
+	}
+
+	for (uint32_t key = 1; key <= 2000; key++)
+		cr_assert(table_has_key(table, key));
+
+	cr_assert(eq(int, table_row_count(table), 2000));
+
+	db_close(table);
+	remove(filename);
+}
+
+static uint32_t lower_bound_reference(const uint32_t *keys, uint32_t n,
+		uint32_t key)
+{
+	uint32_t i = 0;
+
+	while (i < n && keys[i] < key)
+		i++;
+
+	return i;
+}
+
+static void check_lower_bound(const uint32_t *keys, uint32_t n, uint32_t key)
+{
+	cr_assert(eq(u32, keys_lower_bound(keys, n, key),
+				lower_bound_reference(keys, n, key)));
+}
+
+Test(search, matches_scalar_lower_bound)
+{
+	/* around the SSE2 and AVX2 widths, and past the bisection cutoff */
+	uint32_t sizes[] = {
+		0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 64, 100,
+		257,
+	};
+	/* from the bottom, across the sign bit, and up to UINT32_MAX */
+	uint32_t firsts[] = { 0, 0x7ffffff0, UINT32_MAX };
+	uint32_t keys[257];
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+		uint32_t n = sizes[s];
+
+		for (size_t f = 0; f < sizeof(firsts) / sizeof(*firsts); f++) {
+			for (uint32_t i = 0; i < n; i++) {
+				if (firsts[f] == UINT32_MAX)
+					keys[i] = UINT32_MAX - 3 * (n - 1 - i);
+				else
+					keys[i] = firsts[f] + 3 * i;
+			}
+
+			check_lower_bound(keys, n, 0);
+			check_lower_bound(keys, n, UINT32_MAX);
+
+			for (uint32_t i = 0; i < n; i++) {
+				check_lower_bound(keys, n, keys[i] - 1);
+				check_lower_bound(keys, n, keys[i]);
+				check_lower_bound(keys, n, keys[i] + 1);
+			}
+		}
+	}
+}
+
 #if 0
 Test(database, prints_error_when_table_full)
 {